@@ -0,0 +1,532 @@
+//
+// Coroutine Awaitable Queue and Lock Operations
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_ASYNC_H_
+#define EVENK_ASYNC_H_
+
+//
+// C++20 coroutine support. Everything here is only available if the
+// compiler supports coroutines, the rest of the library stays C++11.
+//
+// A coroutine that has to wait is suspended into an intrusive list of
+// waiters kept in the awaiter objects. It is resumed by the thread whose
+// operation lets it proceed, and on that very thread. So async_queue
+// wraps a queue and async_mutex wraps a lock: the operations that might
+// let a waiter go have to go through the wrapper to find it.
+//
+// A waiter is registered and then the operation is retried, while every
+// operation that might let a waiter go checks for waiters after it is
+// done. Both sides issue a full fence in between, so either the waiter
+// succeeds on retry or the other side sees it.
+//
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define EVENK_HAVE_COROUTINES 1
+#endif
+#endif
+
+#if EVENK_HAVE_COROUTINES
+
+#include <atomic>
+#include <coroutine>
+#include <utility>
+
+#include "basic.h"
+#include "conqueue.h"
+#include "spinlock.h"
+#include "synch.h"
+
+namespace evenk {
+
+inline namespace detail {
+
+struct async_waiter
+{
+	async_waiter *next = nullptr;
+	std::coroutine_handle<> handle;
+	queue_op_status status = queue_op_status::success;
+};
+
+// A FIFO list of suspended coroutines.
+class async_waiter_list : non_copyable
+{
+public:
+	bool empty() const
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return count_.load(std::memory_order_relaxed) == 0;
+	}
+
+	// Called with the lock held.
+	void push(async_waiter &waiter)
+	{
+		waiter.next = nullptr;
+		if (tail_ == nullptr)
+			head_ = &waiter;
+		else
+			tail_->next = &waiter;
+		tail_ = &waiter;
+		count_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	// Called with the lock held.
+	async_waiter *front() const
+	{
+		return head_;
+	}
+
+	// Called with the lock held.
+	void pop()
+	{
+		head_ = head_->next;
+		if (head_ == nullptr)
+			tail_ = nullptr;
+		count_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Called with the lock held, the waiter must be the last one.
+	void remove_last()
+	{
+		async_waiter *prev = nullptr;
+		for (async_waiter *w = head_; w != tail_; w = w->next)
+			prev = w;
+		if (prev == nullptr)
+			head_ = nullptr;
+		else
+			prev->next = nullptr;
+		tail_ = prev;
+		count_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Called with the lock held.
+	async_waiter *take_all()
+	{
+		async_waiter *waiters = head_;
+		head_ = tail_ = nullptr;
+		count_.store(0, std::memory_order_relaxed);
+		return waiters;
+	}
+
+	tatas_lock &lock()
+	{
+		return lock_;
+	}
+
+private:
+	async_waiter *head_ = nullptr;
+	async_waiter *tail_ = nullptr;
+	std::atomic<std::size_t> count_ = ATOMIC_VAR_INIT(0);
+	tatas_lock lock_;
+};
+
+} // namespace detail
+
+//
+// Awaitable push and pop for bounded_queue, synch_queue or any other queue
+// with try_push() and try_pop() that do not wait for values or space. The
+// values pushed or popped by other threads must also go through this
+// wrapper, otherwise the waiting coroutines might miss them.
+//
+
+template <typename Queue>
+class async_queue : non_copyable
+{
+public:
+	using queue_type = Queue;
+	using value_type = typename Queue::value_type;
+
+	class pop_awaiter : async_waiter
+	{
+	public:
+		bool await_ready()
+		{
+			status = queue_.pop_now(value_);
+			return status != queue_op_status::empty;
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			return queue_.suspend_pop(*this, value_);
+		}
+
+		queue_op_status await_resume() const noexcept
+		{
+			return status;
+		}
+
+	private:
+		friend class async_queue;
+
+		pop_awaiter(async_queue &queue, value_type &value) : queue_(queue), value_(value)
+		{
+		}
+
+		async_queue &queue_;
+		value_type &value_;
+	};
+
+	class push_awaiter : async_waiter
+	{
+	public:
+		bool await_ready()
+		{
+			status = queue_.push_now(value_);
+			return status != queue_op_status::full;
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			return queue_.suspend_push(*this, value_);
+		}
+
+		queue_op_status await_resume() const noexcept
+		{
+			return status;
+		}
+
+	private:
+		friend class async_queue;
+
+		push_awaiter(async_queue &queue, value_type &&value)
+			: queue_(queue), value_(std::move(value))
+		{
+		}
+
+		async_queue &queue_;
+		value_type value_;
+	};
+
+	template <typename... Args>
+	async_queue(Args &&... args) : queue_(std::forward<Args>(args)...)
+	{
+	}
+
+	queue_type &queue()
+	{
+		return queue_;
+	}
+
+	void close()
+	{
+		queue_.close();
+		wake_all();
+	}
+
+	bool is_closed()
+	{
+		return queue_.is_closed();
+	}
+
+	bool is_empty()
+	{
+		return queue_.is_empty();
+	}
+
+	// co_await q.async_pop(value) yields success or closed.
+	pop_awaiter async_pop(value_type &value)
+	{
+		return pop_awaiter(*this, value);
+	}
+
+	// co_await q.async_push(value) yields success or closed.
+	push_awaiter async_push(value_type value)
+	{
+		return push_awaiter(*this, std::move(value));
+	}
+
+	queue_op_status try_push(value_type &&value)
+	{
+		return push_now(value);
+	}
+
+	queue_op_status try_push(const value_type &value)
+	{
+		value_type copy(value);
+		return push_now(copy);
+	}
+
+	queue_op_status try_pop(value_type &value)
+	{
+		return pop_now(value);
+	}
+
+	// These block the calling thread.
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		auto status = queue_.wait_push(std::move(value), std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			serve_pop();
+		return status;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		auto status = queue_.wait_push(value, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			serve_pop();
+		return status;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		auto status = queue_.wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			serve_push();
+		return status;
+	}
+
+private:
+	queue_op_status push_now(value_type &value)
+	{
+		auto status = queue_.try_push(std::move(value));
+		if (status == queue_op_status::success)
+			serve_pop();
+		return status;
+	}
+
+	queue_op_status pop_now(value_type &value)
+	{
+		auto status = queue_.try_pop(value);
+		if (status == queue_op_status::success)
+			serve_push();
+		return status;
+	}
+
+	// Returns false if the operation is done without suspension.
+	bool suspend_pop(async_waiter &waiter, value_type &value)
+	{
+		{
+			lock_guard<tatas_lock> guard(pop_waiters_.lock());
+			pop_waiters_.push(waiter);
+			waiter.status = queue_.try_pop(value);
+			if (waiter.status == queue_op_status::empty)
+				return true;
+			pop_waiters_.remove_last();
+		}
+		if (waiter.status == queue_op_status::success)
+			serve_push();
+		return false;
+	}
+
+	bool suspend_push(async_waiter &waiter, value_type &value)
+	{
+		{
+			lock_guard<tatas_lock> guard(push_waiters_.lock());
+			push_waiters_.push(waiter);
+			waiter.status = queue_.try_push(std::move(value));
+			if (waiter.status == queue_op_status::full)
+				return true;
+			push_waiters_.remove_last();
+		}
+		if (waiter.status == queue_op_status::success)
+			serve_pop();
+		return false;
+	}
+
+	// Something is pushed, pop it for the first waiting coroutine.
+	void serve_pop()
+	{
+		if (pop_waiters_.empty())
+			return;
+
+		pop_awaiter *waiter;
+		{
+			lock_guard<tatas_lock> guard(pop_waiters_.lock());
+			waiter = static_cast<pop_awaiter *>(pop_waiters_.front());
+			if (waiter == nullptr)
+				return;
+			waiter->status = queue_.try_pop(waiter->value_);
+			if (waiter->status == queue_op_status::empty)
+				return;
+			pop_waiters_.pop();
+		}
+		if (waiter->status == queue_op_status::success)
+			serve_push();
+		waiter->handle.resume();
+	}
+
+	// Something is popped, push the value of the first waiting coroutine.
+	void serve_push()
+	{
+		if (push_waiters_.empty())
+			return;
+
+		push_awaiter *waiter;
+		{
+			lock_guard<tatas_lock> guard(push_waiters_.lock());
+			waiter = static_cast<push_awaiter *>(push_waiters_.front());
+			if (waiter == nullptr)
+				return;
+			waiter->status = queue_.try_push(std::move(waiter->value_));
+			if (waiter->status == queue_op_status::full)
+				return;
+			push_waiters_.pop();
+		}
+		if (waiter->status == queue_op_status::success)
+			serve_pop();
+		waiter->handle.resume();
+	}
+
+	// The queue is closed, let all the waiters go.
+	void wake_all()
+	{
+		async_waiter *waiters;
+		{
+			lock_guard<tatas_lock> guard(pop_waiters_.lock());
+			waiters = pop_waiters_.take_all();
+		}
+		while (waiters != nullptr) {
+			pop_awaiter *waiter = static_cast<pop_awaiter *>(waiters);
+			waiters = waiters->next;
+			waiter->status = queue_.try_pop(waiter->value_);
+			waiter->handle.resume();
+		}
+
+		{
+			lock_guard<tatas_lock> guard(push_waiters_.lock());
+			waiters = push_waiters_.take_all();
+		}
+		while (waiters != nullptr) {
+			async_waiter *waiter = waiters;
+			waiters = waiters->next;
+			waiter->status = queue_op_status::closed;
+			waiter->handle.resume();
+		}
+	}
+
+	queue_type queue_;
+	async_waiter_list pop_waiters_;
+	async_waiter_list push_waiters_;
+};
+
+//
+// A lock that may be acquired with co_await m.async_lock(). Threads may
+// use the regular lock() with it too. If a coroutine waits then unlock()
+// passes the ownership to it and resumes it.
+//
+
+template <typename Lock = default_synch::lock_type>
+class async_mutex : non_copyable
+{
+public:
+	using lock_type = Lock;
+
+	class lock_awaiter : async_waiter
+	{
+	public:
+		bool await_ready()
+		{
+			return mutex_.try_lock();
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			return mutex_.suspend(*this);
+		}
+
+		void await_resume() const noexcept
+		{
+		}
+
+	private:
+		friend class async_mutex;
+
+		lock_awaiter(async_mutex &mutex) : mutex_(mutex)
+		{
+		}
+
+		async_mutex &mutex_;
+	};
+
+	template <typename... Backoff>
+	void lock(Backoff... backoff)
+	{
+		lock_.lock(std::forward<Backoff>(backoff)...);
+	}
+
+	bool try_lock()
+	{
+		return lock_.try_lock();
+	}
+
+	void unlock()
+	{
+		for (;;) {
+			if (!waiters_.empty()) {
+				async_waiter *waiter;
+				{
+					lock_guard<tatas_lock> guard(waiters_.lock());
+					waiter = waiters_.front();
+					if (waiter != nullptr)
+						waiters_.pop();
+				}
+				if (waiter != nullptr) {
+					waiter->handle.resume();
+					return;
+				}
+			}
+
+			lock_.unlock();
+			// A coroutine might have failed to get the lock just before
+			// so take it back if possible to hand it over.
+			if (waiters_.empty() || !lock_.try_lock())
+				return;
+		}
+	}
+
+	// co_await m.async_lock() resumes with the lock owned.
+	lock_awaiter async_lock()
+	{
+		return lock_awaiter(*this);
+	}
+
+private:
+	bool suspend(async_waiter &waiter)
+	{
+		lock_guard<tatas_lock> guard(waiters_.lock());
+		waiters_.push(waiter);
+		if (!lock_.try_lock())
+			return true;
+		waiters_.remove_last();
+		return false;
+	}
+
+	lock_type lock_;
+	async_waiter_list waiters_;
+};
+
+} // namespace evenk
+
+#endif // EVENK_HAVE_COROUTINES
+
+#endif // !EVENK_ASYNC_H_
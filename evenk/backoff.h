@@ -26,11 +26,20 @@
 #define EVENK_BACKOFF_H_
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <thread>
 
+#include <cpuid.h>
 #include <emmintrin.h>
+#include <immintrin.h>
 #include <time.h>
+#include <x86intrin.h>
+
+#if (defined(__clang__) && __clang_major__ >= 7) || (!defined(__clang__) && __GNUC__ >= 9)
+#define EVENK_HAVE_WAITPKG 1
+#endif
 
 namespace evenk {
 
@@ -56,6 +65,124 @@ struct cpu_relax
 	}
 };
 
+//
+// Delays that spin for about the given number of nanoseconds regardless of
+// the actual cost of a PAUSE instruction. The TSC rate is calibrated once
+// on the first use. Call tsc_clock::initialize() at startup to avoid the
+// calibration delay at an inconvenient moment.
+//
+
+class tsc_clock
+{
+public:
+	static std::uint64_t now() noexcept
+	{
+		return __rdtsc();
+	}
+
+	static void initialize() noexcept
+	{
+		scale();
+	}
+
+	// The TSC value that is about n nanoseconds ahead.
+	static std::uint64_t deadline(std::uint32_t n) noexcept
+	{
+		return now() + ((std::uint64_t(n) * scale()) >> scale_shift);
+	}
+
+private:
+	static constexpr unsigned scale_shift = 16;
+
+	// TSC ticks per nanosecond as a fixed-point number.
+	static std::uint64_t scale() noexcept
+	{
+		static const std::uint64_t scale = calibrate();
+		return scale;
+	}
+
+	static std::uint64_t calibrate() noexcept
+	{
+		using clock = std::chrono::steady_clock;
+		clock::time_point start = clock::now();
+		std::uint64_t start_ticks = now();
+		clock::time_point end;
+		do
+			end = clock::now();
+		while (end - start < std::chrono::milliseconds(5));
+		std::uint64_t ticks = now() - start_ticks;
+		std::uint64_t nsec =
+			std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+		return (ticks << scale_shift) / nsec;
+	}
+};
+
+struct tsc_cycle
+{
+	void operator()(std::uint32_t n)
+	{
+		std::uint64_t deadline = tsc_clock::deadline(n);
+		while (tsc_clock::now() < deadline)
+			std::atomic_signal_fence(std::memory_order_relaxed);
+	}
+};
+
+struct tsc_relax
+{
+	void operator()(std::uint32_t n)
+	{
+		std::uint64_t deadline = tsc_clock::deadline(n);
+		while (tsc_clock::now() < deadline)
+			::_mm_pause();
+	}
+};
+
+#if EVENK_HAVE_WAITPKG
+
+//
+// Wait in the C0.1 power state with TPAUSE on CPUs that have WAITPKG. On
+// other CPUs fall back to spinning with PAUSE.
+//
+
+struct tsc_tpause
+{
+	void operator()(std::uint32_t n)
+	{
+		if (!supported()) {
+			tsc_relax()(n);
+			return;
+		}
+		// The wait might be cut short by the OS-imposed time limit.
+		std::uint64_t deadline = tsc_clock::deadline(n);
+		do
+			tpause(deadline);
+		while (tsc_clock::now() < deadline);
+	}
+
+	static bool supported() noexcept
+	{
+		static const bool waitpkg = detect();
+		return waitpkg;
+	}
+
+private:
+	__attribute__((target("waitpkg"))) static void tpause(std::uint64_t deadline)
+	{
+		_tpause(1, deadline);
+	}
+
+	static bool detect() noexcept
+	{
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+			return false;
+		// CPUID.(EAX=07H, ECX=0):ECX.WAITPKG[bit 5]
+		return (ecx & (1u << 5)) != 0;
+	}
+};
+
+#endif // EVENK_HAVE_WAITPKG
+
 struct nanosleep
 {
 	void operator()(std::uint32_t n)
@@ -161,6 +288,81 @@ private:
 	Pause pause_;
 };
 
+//
+// A fast per-thread pseudo-random generator for back-off jitter. See:
+//    G. Marsaglia. Xorshift RNGs. Journal of Statistical Software, 2003.
+//
+
+class xorshift
+{
+public:
+	explicit xorshift(std::uint32_t seed) noexcept : state_{seed ? seed : 0x9e3779b9}
+	{
+	}
+
+	std::uint32_t operator()() noexcept
+	{
+		state_ ^= state_ << 13;
+		state_ ^= state_ >> 17;
+		state_ ^= state_ << 5;
+		return state_;
+	}
+
+	// A random number in the [0, n] range.
+	std::uint32_t operator()(std::uint32_t n) noexcept
+	{
+		return (std::uint64_t((*this)()) * (std::uint64_t(n) + 1)) >> 32;
+	}
+
+	static xorshift &thread_instance()
+	{
+		static thread_local xorshift instance(
+			std::hash<std::thread::id>()(std::this_thread::get_id()));
+		return instance;
+	}
+
+private:
+	std::uint32_t state_;
+};
+
+//
+// Exponential back-off with random jitter. The pause is picked from the
+// upper half of the current back-off interval so threads that failed at
+// once get out of lock-step while the expected delay is kept.
+//
+
+template <typename Pause>
+class jittered_backoff
+{
+public:
+	jittered_backoff(std::uint32_t ceiling) noexcept : ceiling_{ceiling}, backoff_{0}
+	{
+	}
+
+	bool operator()()
+	{
+		if (backoff_ >= ceiling_) {
+			pause_(jitter(ceiling_));
+			return true;
+		} else {
+			pause_(jitter(backoff_));
+			backoff_ += backoff_ + 1;
+			return false;
+		}
+	}
+
+private:
+	static std::uint32_t jitter(std::uint32_t backoff)
+	{
+		std::uint32_t half = backoff / 2;
+		return backoff - xorshift::thread_instance()(half);
+	}
+
+	const std::uint32_t ceiling_;
+	std::uint32_t backoff_;
+	Pause pause_;
+};
+
 template <typename Pause>
 class proportional_backoff
 {
@@ -217,6 +419,81 @@ private:
 	bool use_second_;
 };
 
+//
+// Adaptive back-off in the spirit of glibc adaptive mutexes. A spin_estimate
+// object is kept along with a lock or a queue and holds a running average
+// of the number of pauses a waiter needed. An adaptive_backoff spins about
+// twice as long as the estimate and then gives up so that the caller may
+// switch to blocking. When the wait is over the backoff object feeds the
+// number of pauses it made back to the estimate.
+//
+// The estimate is updated when a backoff object is destroyed. Therefore it
+// should be passed by value to the waiting function as usual. Copies that
+// were never called do not affect the estimate.
+//
+
+class spin_estimate
+{
+public:
+	spin_estimate(std::uint32_t ceiling = 1000) noexcept : ceiling_{ceiling}, spins_{0}
+	{
+	}
+
+	std::uint32_t limit() const noexcept
+	{
+		std::uint32_t limit = 2 * spins_.load(std::memory_order_relaxed) + 10;
+		return limit < ceiling_ ? limit : ceiling_;
+	}
+
+	void update(std::uint32_t count) noexcept
+	{
+		// Races among concurrent updates are benign.
+		std::int32_t spins = spins_.load(std::memory_order_relaxed);
+		spins += (std::int32_t(count) - spins) / 8;
+		spins_.store(spins, std::memory_order_relaxed);
+	}
+
+private:
+	const std::uint32_t ceiling_;
+	std::atomic<std::int32_t> spins_;
+};
+
+template <typename Pause>
+class adaptive_backoff
+{
+public:
+	adaptive_backoff(spin_estimate &estimate) noexcept
+		: estimate_{&estimate}, limit_{estimate.limit()}, count_{0}
+	{
+	}
+
+	adaptive_backoff(const adaptive_backoff &other) noexcept
+		: estimate_{other.estimate_}, limit_{other.estimate_->limit()}, count_{0}
+	{
+	}
+
+	~adaptive_backoff()
+	{
+		if (count_)
+			estimate_->update(count_);
+	}
+
+	bool operator()()
+	{
+		pause_(1);
+		if (count_ >= limit_)
+			return true;
+		++count_;
+		return false;
+	}
+
+private:
+	spin_estimate *const estimate_;
+	const std::uint32_t limit_;
+	std::uint32_t count_;
+	Pause pause_;
+};
+
 } // namespace evenk
 
 #endif // !EVENK_BACKOFF_H_
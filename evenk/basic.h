@@ -25,7 +25,9 @@
 #ifndef EVENK_BASIC_H_
 #define EVENK_BASIC_H_
 
+#include <chrono>
 #include <cstddef>
+#include <ctime>
 #include <system_error>
 
 namespace evenk {
@@ -50,6 +52,51 @@ throw_system_error(int err_num, const std::string &what)
 	throw std::system_error(err_num, std::system_category(), what);
 }
 
+//
+// Deadline conversion. A time point of one clock is translated to another
+// clock via their current readings, unless the clocks are the same. The
+// result may be turned into an absolute timespec for system calls.
+//
+
+template <typename ToClock, typename FromClock>
+struct clock_converter
+{
+	template <typename Duration>
+	static typename ToClock::time_point
+	convert(const std::chrono::time_point<FromClock, Duration> &abs_time)
+	{
+		return ToClock::now()
+		       + std::chrono::duration_cast<typename ToClock::duration>(
+			       abs_time - FromClock::now());
+	}
+};
+
+template <typename Clock>
+struct clock_converter<Clock, Clock>
+{
+	template <typename Duration>
+	static typename Clock::time_point
+	convert(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		return std::chrono::time_point_cast<typename Clock::duration>(abs_time);
+	}
+};
+
+template <typename ToClock, typename Clock, typename Duration>
+inline struct timespec
+to_timespec(const std::chrono::time_point<Clock, Duration> &abs_time)
+{
+	auto time = clock_converter<ToClock, Clock>::convert(abs_time).time_since_epoch();
+	struct timespec ts = {0, 0};
+	if (time.count() > 0) {
+		auto sec = std::chrono::duration_cast<std::chrono::seconds>(time);
+		auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(time - sec);
+		ts.tv_sec = sec.count();
+		ts.tv_nsec = nsec.count();
+	}
+	return ts;
+}
+
 class non_copyable
 {
 protected:
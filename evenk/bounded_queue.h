@@ -25,9 +25,13 @@
 #ifndef EVENK_BOUNDED_QUEUE_H_
 #define EVENK_BOUNDED_QUEUE_H_
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
+#include <iterator>
+#include <new>
 #include <stdexcept>
 #include <thread>
 #include <type_traits>
@@ -36,6 +40,8 @@
 #include "basic.h"
 #include "conqueue.h"
 #include "futex.h"
+#include "memory.h"
+#include "stats.h"
 #include "synch.h"
 
 namespace evenk {
@@ -54,13 +60,48 @@ constexpr std::uint32_t bq_ticket_step = 1 << bq_status_bits;
 constexpr std::uint32_t bq_status_mask = bq_ticket_step - 1;
 constexpr std::uint32_t bq_ticket_mask = ~bq_status_mask;
 
+// The waiting bit may be set along with any other status, it only tells
+// whether to wake somebody.
+inline bq_status bq_ticket_status(std::uint32_t ticket)
+{
+	return bq_status(ticket & bq_invalid);
+}
+
+// Most slot types keep all their state in the slot itself.
+struct bq_no_shared_state : non_copyable
+{
+	explicit bq_no_shared_state(const std::atomic<bool> &) noexcept
+	{
+	}
+
+	void wake()
+	{
+	}
+};
+
 } // namespace detail
 
+//
+// A queue keeps one Ticket::shared_state object, constructed with the
+// queue's closed flag, and attaches every slot to it before use.
+//
+
 class bq_slot : protected std::atomic<std::uint32_t>
 {
 public:
 	using base = std::atomic<std::uint32_t>;
 
+	using shared_state = bq_no_shared_state;
+
+	static constexpr bool is_lock_free = true;
+
+	// True if wake() on any slot wakes the waiters of all the slots.
+	static constexpr bool shared_wake = false;
+
+	void attach(shared_state &) noexcept
+	{
+	}
+
 	void initialize(std::uint32_t value)
 	{
 		base::store(value, std::memory_order_relaxed);
@@ -76,6 +117,13 @@ public:
 		return load();
 	}
 
+	template <typename Clock, typename Duration>
+	std::uint32_t
+	wait_and_load_until(std::uint32_t, const std::chrono::time_point<Clock, Duration> &)
+	{
+		return load();
+	}
+
 	void store_and_wake(std::uint32_t value)
 	{
 		base::store(value, std::memory_order_release);
@@ -94,9 +142,23 @@ public:
 		std::this_thread::yield();
 		return load();
 	}
+
+	template <typename Clock, typename Duration>
+	std::uint32_t
+	wait_and_load_until(std::uint32_t, const std::chrono::time_point<Clock, Duration> &)
+	{
+		std::this_thread::yield();
+		return load();
+	}
 };
 
-class bq_futex_slot : public bq_slot
+//
+// The futex slots with the shared scope work for queues placed in memory
+// that is mapped by several processes.
+//
+
+template <futex_scope Scope = futex_private>
+class bq_basic_futex_slot : public bq_slot
 {
 public:
 	std::uint32_t wait_and_load(std::uint32_t value)
@@ -108,21 +170,160 @@ public:
 					    std::memory_order_relaxed,
 					    std::memory_order_relaxed)
 		    || old_value == new_value)
-			futex_wait(*this, value);
+			futex_wait(*this, new_value, Scope);
+		return load();
+	}
+
+	template <typename Clock, typename Duration>
+	std::uint32_t
+	wait_and_load_until(std::uint32_t value,
+			    const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		std::uint32_t old_value = value;
+		std::uint32_t new_value = value | bq_waiting;
+		if (compare_exchange_strong(old_value,
+					    new_value,
+					    std::memory_order_relaxed,
+					    std::memory_order_relaxed)
+		    || old_value == new_value)
+			futex_wait_until(*this, new_value, abs_time, Scope);
 		return load();
 	}
 
 	void store_and_wake(std::uint32_t value)
 	{
 		value = exchange(value, std::memory_order_release);
-		if ((value & bq_status_mask) == bq_waiting)
+		if ((value & bq_waiting) != 0)
 			wake();
 	}
 
 	void wake()
 	{
-		futex_wake(*this, INT32_MAX);
+		futex_wake(*this, INT32_MAX, Scope);
+	}
+};
+
+using bq_futex_slot = bq_basic_futex_slot<futex_private>;
+using bq_interprocess_futex_slot = bq_basic_futex_slot<futex_shared>;
+
+//
+// All the waiters of a queue park on a single event count shared by all
+// its slots. Therefore a store wakes somebody only if there are waiters at
+// all but then it wakes them all as they might wait for any slot. This
+// suits queues that are mostly busy and only occasionally drain.
+//
+
+class bq_event_state : non_copyable
+{
+public:
+	explicit bq_event_state(const std::atomic<bool> &closed) noexcept : closed_(closed)
+	{
+	}
+
+	event_count::key_type prepare_wait()
+	{
+		return events_.prepare_wait();
+	}
+
+	void cancel_wait()
+	{
+		events_.cancel_wait();
+	}
+
+	void commit_wait(event_count::key_type key)
+	{
+		events_.commit_wait(key);
+	}
+
+	template <typename Clock, typename Duration>
+	void commit_wait_until(event_count::key_type key,
+			       const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		events_.commit_wait_until(key, abs_time);
+	}
+
+	// The closing wake-up may have been issued before prepare_wait()
+	// so it is checked for between prepare_wait() and commit_wait().
+	bool is_closed() const
+	{
+		return closed_.load(std::memory_order_relaxed);
+	}
+
+	void wake()
+	{
+		events_.notify_all();
 	}
+
+private:
+	event_count events_;
+	const std::atomic<bool> &closed_;
+};
+
+class bq_event_slot : public bq_slot
+{
+public:
+	using shared_state = bq_event_state;
+
+	static constexpr bool shared_wake = true;
+
+	void attach(shared_state &state) noexcept
+	{
+		state_ = &state;
+	}
+
+	std::uint32_t wait_and_load(std::uint32_t value)
+	{
+		event_count::key_type key = state_->prepare_wait();
+		std::uint32_t current_value = load();
+		if (current_value != value) {
+			state_->cancel_wait();
+			return current_value;
+		}
+		if (state_->is_closed())
+			return yield_closed();
+		state_->commit_wait(key);
+		return load();
+	}
+
+	template <typename Clock, typename Duration>
+	std::uint32_t
+	wait_and_load_until(std::uint32_t value,
+			    const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		event_count::key_type key = state_->prepare_wait();
+		std::uint32_t current_value = load();
+		if (current_value != value) {
+			state_->cancel_wait();
+			return current_value;
+		}
+		if (state_->is_closed())
+			return yield_closed();
+		state_->commit_wait_until(key, abs_time);
+		return load();
+	}
+
+	void store_and_wake(std::uint32_t value)
+	{
+		base::store(value, std::memory_order_release);
+		state_->wake();
+	}
+
+	void wake()
+	{
+		state_->wake();
+	}
+
+private:
+	// A closed queue may still have pending values. Their producers are
+	// not waited for in a sleep that nobody is sure to end, just yield.
+	std::uint32_t yield_closed()
+	{
+		state_->cancel_wait();
+		std::this_thread::yield();
+		return load();
+	}
+
+	bq_event_state *state_ = nullptr;
 };
 
 template <typename Synch = default_synch>
@@ -133,6 +334,8 @@ public:
 	using cond_var_type = typename Synch::cond_var_type;
 	using lock_owner_type = typename Synch::lock_owner_type;
 
+	static constexpr bool is_lock_free = false;
+
 	std::uint32_t wait_and_load(std::uint32_t value)
 	{
 		lock_owner_type guard(lock_);
@@ -144,6 +347,20 @@ public:
 		return current_value;
 	}
 
+	template <typename Clock, typename Duration>
+	std::uint32_t
+	wait_and_load_until(std::uint32_t value,
+			    const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		lock_owner_type guard(lock_);
+		std::uint32_t current_value = base::load(std::memory_order_relaxed);
+		if (current_value == value) {
+			cond_.wait_until(guard, abs_time);
+			current_value = base::load(std::memory_order_relaxed);
+		}
+		return current_value;
+	}
+
 	void store_and_wake(std::uint32_t value)
 	{
 		lock_owner_type guard(lock_);
@@ -162,39 +379,355 @@ private:
 	cond_var_type cond_;
 };
 
-template <typename Value, typename Ticket = bq_slot>
-class bounded_queue : non_copyable
+//
+// Ring layout policies. The padded layout puts every slot on its own cache
+// line. The compact layout packs slots densely and permutes the slot order
+// so that consecutive tickets still fall on distinct cache lines. This way
+// the ring footprint is much smaller for small values while threads that
+// work with adjacent tickets mostly do not share cache lines.
+//
+
+class bq_padded_layout
+{
+public:
+	static constexpr std::size_t slot_alignment = cache_line_size;
+
+	bq_padded_layout(std::uint32_t, std::size_t) noexcept
+	{
+	}
+
+	std::uint32_t position(std::uint32_t index) const noexcept
+	{
+		return index;
+	}
+};
+
+class bq_compact_layout
 {
+public:
+	static constexpr std::size_t slot_alignment = 1;
+
+	bq_compact_layout(std::uint32_t size, std::size_t slot_size) noexcept
+		: line_shift_{0}, group_shift_{0}
+	{
+		// Find the number of slots per cache line rounded down to a power of
+		// two and limited by the ring size. The ring then consists of
+		// 2^group_shift_ groups of 2^line_shift_ slots each. Consecutive
+		// indices are distributed among the groups.
+		while ((std::size_t(2) << line_shift_) * slot_size <= cache_line_size
+		       && (std::uint32_t(2) << line_shift_) <= size)
+			line_shift_++;
+		while ((std::uint32_t(1) << (line_shift_ + group_shift_)) < size)
+			group_shift_++;
+		group_mask_ = (std::uint32_t(1) << group_shift_) - 1;
+	}
+
+	std::uint32_t position(std::uint32_t index) const noexcept
+	{
+		return ((index & group_mask_) << line_shift_) | (index >> group_shift_);
+	}
+
+private:
+	std::uint32_t line_shift_;
+	std::uint32_t group_shift_;
+	std::uint32_t group_mask_;
+};
+
+namespace detail {
+
+//
+// The ticket protocol shared by bounded_queue and shm_bounded_queue. The
+// queue class derives from bq_ticket_ring<Queue>, befriends it, and gives
+// it access to the ring with these members:
+//
+//   ring_slot &get_slot(std::uint64_t index);
+//   std::atomic<std::uint64_t> &head_counter();
+//   std::atomic<std::uint64_t> &tail_counter();
+//   bool is_closed() const;
+//   void add_stat(stat_counter counter);
+//
+
+template <typename Queue>
+class bq_ticket_ring
+{
+protected:
+	static bool give_up()
+	{
+		return true;
+	}
+
+	template <typename Backoff>
+	static bool give_up(Backoff &backoff)
+	{
+		return backoff();
+	}
+
+	static void pause()
+	{
+	}
+
+	template <typename Backoff>
+	static void pause(Backoff &backoff)
+	{
+		backoff();
+	}
+
+	//
+	// Claim a ticket without waiting. The ticket is taken only if its slot
+	// is already in the required state so the following put_value() or
+	// get_value() call never blocks. A lost race is retried if there is
+	// a reason to, otherwise reported as busy.
+	//
+
+	template <typename... Backoff>
+	queue_op_status claim_tail(std::uint64_t &tail, bool retry, Backoff... backoff)
+	{
+		Queue &queue = this->queue();
+		std::atomic<std::uint64_t> &tail_counter = queue.tail_counter();
+		tail = tail_counter.load(std::memory_order_relaxed);
+		for (;;) {
+			if (queue.is_closed())
+				return queue_op_status::closed;
+
+			std::uint32_t current_ticket = queue.get_slot(tail).load() & bq_ticket_mask;
+			std::uint32_t required_ticket = tail << bq_status_bits;
+			if (current_ticket == required_ticket) {
+				if (tail_counter.compare_exchange_strong(tail,
+									 tail + 1,
+									 std::memory_order_relaxed,
+									 std::memory_order_relaxed))
+					return queue_op_status::success;
+			} else if (std::int32_t(current_ticket - required_ticket) < 0) {
+				return queue_op_status::full;
+			} else {
+				tail = tail_counter.load(std::memory_order_relaxed);
+			}
+
+			if (!retry)
+				return queue_op_status::busy;
+			pause(backoff...);
+		}
+	}
+
+	template <typename... Backoff>
+	queue_op_status
+	claim_head(std::uint64_t &head, bq_status &status, bool retry, Backoff... backoff)
+	{
+		Queue &queue = this->queue();
+		std::atomic<std::uint64_t> &head_counter = queue.head_counter();
+		head = head_counter.load(std::memory_order_relaxed);
+		for (;;) {
+			std::uint32_t current_ticket = queue.get_slot(head).load();
+			std::uint32_t required_ticket = (head + 1) << bq_status_bits;
+			if ((current_ticket & bq_ticket_mask) == required_ticket) {
+				if (head_counter.compare_exchange_strong(head,
+									 head + 1,
+									 std::memory_order_relaxed,
+									 std::memory_order_relaxed)) {
+					status = bq_ticket_status(current_ticket);
+					return queue_op_status::success;
+				}
+			} else if (std::int32_t((current_ticket & bq_ticket_mask)
+						- required_ticket)
+				   < 0) {
+				if (is_drained(head))
+					return queue_op_status::closed;
+				return queue_op_status::empty;
+			} else {
+				head = head_counter.load(std::memory_order_relaxed);
+			}
+
+			if (!retry)
+				return queue_op_status::busy;
+			pause(backoff...);
+		}
+	}
+
+	template <typename Slot>
+	void wait_tail(Slot &slot, std::uint64_t tail)
+	{
+		std::uint32_t current_ticket = slot.load();
+		std::uint32_t required_ticket = tail << bq_status_bits;
+		if ((current_ticket & bq_ticket_mask) != required_ticket)
+			queue().add_stat(stat_push_wait);
+		while ((current_ticket & bq_ticket_mask) != required_ticket) {
+			current_ticket = slot.wait_and_load(current_ticket);
+		}
+	}
+
+	template <typename Slot, typename Backoff>
+	void wait_tail(Slot &slot, std::uint64_t tail, Backoff backoff)
+	{
+		bool waiting = false;
+		std::uint32_t current_ticket = slot.load();
+		std::uint32_t required_ticket = tail << bq_status_bits;
+		if ((current_ticket & bq_ticket_mask) != required_ticket)
+			queue().add_stat(stat_push_wait);
+		while ((current_ticket & bq_ticket_mask) != required_ticket) {
+			if (waiting) {
+				current_ticket = slot.wait_and_load(current_ticket);
+			} else {
+				waiting = backoff();
+				current_ticket = slot.load();
+			}
+		}
+	}
+
+	// Returns the slot status or bq_closed if the queue is closed and
+	// there is no value for the ticket.
+	template <typename Slot>
+	bq_status wait_head(Slot &slot, std::uint64_t head)
+	{
+		std::uint32_t current_ticket = slot.load();
+		std::uint32_t required_ticket = (head + 1) << bq_status_bits;
+		if ((current_ticket & bq_ticket_mask) != required_ticket)
+			queue().add_stat(stat_pop_wait);
+		while ((current_ticket & bq_ticket_mask) != required_ticket) {
+			if (is_drained(head))
+				return bq_closed;
+			current_ticket = slot.wait_and_load(current_ticket);
+		}
+		return bq_ticket_status(current_ticket);
+	}
+
+	template <typename Slot, typename Backoff>
+	bq_status wait_head(Slot &slot, std::uint64_t head, Backoff backoff)
+	{
+		bool waiting = false;
+		std::uint32_t current_ticket = slot.load();
+		std::uint32_t required_ticket = (head + 1) << bq_status_bits;
+		if ((current_ticket & bq_ticket_mask) != required_ticket)
+			queue().add_stat(stat_pop_wait);
+		while ((current_ticket & bq_ticket_mask) != required_ticket) {
+			if (is_drained(head))
+				return bq_closed;
+			if (waiting) {
+				current_ticket = slot.wait_and_load(current_ticket);
+			} else {
+				waiting = backoff();
+				current_ticket = slot.load();
+			}
+		}
+		return bq_ticket_status(current_ticket);
+	}
+
+	//
+	// Timed pops do not claim a ticket until a value is there, otherwise
+	// they could not give up when the deadline is passed. Instead they wait
+	// for the slot at the current head to change. The pop function is the
+	// queue's nonblocking pop.
+	//
+
+	template <typename Pop, typename Clock, typename Duration, typename... Backoff>
+	queue_op_status timed_pop(Pop pop,
+				  const std::chrono::time_point<Clock, Duration> &abs_time,
+				  Backoff... backoff)
+	{
+		Queue &queue = this->queue();
+		bool waiting = false;
+		for (;;) {
+			auto status = pop();
+			if (status != queue_op_status::empty && status != queue_op_status::busy)
+				return status;
+			if (Clock::now() >= abs_time)
+				return queue_op_status::timeout;
+			if (status == queue_op_status::busy)
+				continue;
+
+			std::uint64_t head = queue.head_counter().load(std::memory_order_relaxed);
+			auto &slot = queue.get_slot(head);
+			std::uint32_t current_ticket = slot.load();
+			std::uint32_t required_ticket = (head + 1) << bq_status_bits;
+			if ((current_ticket & bq_ticket_mask) == required_ticket)
+				continue;
+			// A closed queue may still get the values that are being
+			// pushed, these are waited for as usual. Once it is drained
+			// the next pop tells so.
+			if (is_drained(head))
+				continue;
+			if (waiting)
+				slot.wait_and_load_until(current_ticket, abs_time);
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+private:
+	Queue &queue()
+	{
+		return static_cast<Queue &>(*this);
+	}
+
+	// True if the queue is closed and no value is coming for the ticket.
+	bool is_drained(std::uint64_t head)
+	{
+		Queue &queue = this->queue();
+		if (!queue.is_closed())
+			return false;
+		std::uint64_t tail = queue.tail_counter().load(std::memory_order_seq_cst);
+		return head >= tail;
+	}
+};
+
+} // namespace detail
+
+template <typename Value,
+	  typename Ticket = bq_slot,
+	  typename Layout = bq_padded_layout,
+	  typename Allocator = heap_allocator,
+	  typename Stats = no_stats>
+class bounded_queue
+	: non_copyable,
+	  detail::bq_ticket_ring<bounded_queue<Value, Ticket, Layout, Allocator, Stats>>
+{
+	struct ring_slot;
+	using ticket_ring = detail::bq_ticket_ring<bounded_queue>;
+
 public:
 	using value_type = Value;
 	using reference = value_type &;
 	using const_reference = const value_type &;
 
-#if 0
-	static_assert(std::is_nothrow_default_constructible<Value>::value,
-		      "bounded_queue requires values with nothrow default constructor");
-#endif
+	using stats_type = Stats;
 
-	bounded_queue(std::uint32_t size)
-		: ring_{nullptr}, mask_{size - 1}, closed_{false}, head_{0}, tail_{0}
+	// The allocator decides where the ring memory comes from, see memory.h.
+	bounded_queue(std::uint32_t size, Allocator allocator = Allocator())
+		: ring_{nullptr},
+		  mask_{size - 1},
+		  allocator_{allocator},
+		  layout_{size, sizeof(ring_slot)},
+		  closed_{false},
+		  shared_{closed_},
+		  head_{0},
+		  tail_{0}
 	{
 		if (size == 0 || (size & mask_) != 0)
 			throw std::invalid_argument(
 				"bounded_queue size must be a power of two");
 
-		void *ring;
-		if (::posix_memalign(&ring, cache_line_size, size * sizeof(ring_slot)))
-			throw std::bad_alloc();
-
-		ring_ = new (ring) ring_slot[size];
+		ring_ = static_cast<ring_slot *>(allocator_.allocate(size * sizeof(ring_slot)));
+		for (std::uint32_t i = 0; i < size; i++) {
+			new (&ring_[i]) ring_slot();
+			ring_[i].attach(shared_);
+		}
 		for (std::uint32_t i = 0; i < size; i++)
-			ring_[i].initialize(i << bq_status_bits);
+			get_slot(i).initialize(i << bq_status_bits);
 	}
 
 	bounded_queue(bounded_queue &&other) noexcept
-		: ring_{other.ring_}, mask_{other.mask_}, closed_{false}, head_{0}, tail_{0}
+		: ring_{other.ring_},
+		  mask_{other.mask_},
+		  allocator_{other.allocator_},
+		  layout_{other.layout_},
+		  stats_{other.stats_},
+		  closed_{other.closed_.load(std::memory_order_relaxed)},
+		  shared_{closed_},
+		  head_{other.head_.load(std::memory_order_relaxed)},
+		  tail_{other.tail_.load(std::memory_order_relaxed)}
 	{
 		other.ring_ = nullptr;
+		for (std::uint32_t i = 0; i < mask_ + 1; i++)
+			ring_[i].attach(shared_);
 	}
 
 	~bounded_queue()
@@ -205,8 +738,14 @@ public:
 	void close()
 	{
 		closed_.store(true, std::memory_order_relaxed);
+		if (Ticket::shared_wake) {
+			shared_.wake();
+			stats_.add(stat_close_wake);
+			return;
+		}
 		for (std::uint32_t i = 0; i < mask_ + 1; i++)
 			ring_[i].wake();
+		stats_.add(stat_close_wake, mask_ + 1);
 	}
 
 	bool is_closed() const
@@ -221,11 +760,44 @@ public:
 		return (tail <= head);
 	}
 
+	bool is_full() const
+	{
+		int64_t head = head_.load(std::memory_order_relaxed);
+		int64_t tail = tail_.load(std::memory_order_relaxed);
+		return (tail - head > mask_);
+	}
+
+	// The number of values in the queue. With concurrent pushes and pops
+	// this is only an estimate.
+	std::size_t depth() const
+	{
+		int64_t head = head_.load(std::memory_order_relaxed);
+		int64_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail <= head)
+			return 0;
+		return std::min<std::uint64_t>(tail - head, mask_ + 1);
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	stats_type &stats()
+	{
+		return stats_;
+	}
+
+	const stats_type &stats() const
+	{
+		return stats_;
+	}
+
 	template <typename... Backoff>
 	void push(value_type &&value, Backoff... backoff)
 	{
 		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
-		ring_slot &slot = ring_[tail & mask_];
+		ring_slot &slot = get_slot(tail);
 		wait_tail(slot, tail, std::forward<Backoff>(backoff)...);
 		put_value(slot, tail, std::move(value));
 	}
@@ -234,107 +806,517 @@ public:
 	void push(const value_type &value, Backoff... backoff)
 	{
 		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
-		ring_slot &slot = ring_[tail & mask_];
+		ring_slot &slot = get_slot(tail);
 		wait_tail(slot, tail, std::forward<Backoff>(backoff)...);
 		put_value(slot, tail, value);
 	}
 
+	// Construct a value in place. A backoff policy cannot be passed here
+	// as it would be taken for a constructor argument.
+	template <typename... Args>
+	void emplace(Args &&... args)
+	{
+		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
+		ring_slot &slot = get_slot(tail);
+		wait_tail(slot, tail);
+		put_value(slot, tail, std::forward<Args>(args)...);
+	}
+
+	template <typename... Args>
+	queue_op_status wait_emplace(Args &&... args)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		emplace(std::forward<Args>(args)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(std::move(value), std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(value, std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(value_type &&value, Backoff... backoff)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, true, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, std::move(value));
+		return status;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(const value_type &value, Backoff... backoff)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, true, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, value);
+		return status;
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, false);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, std::move(value));
+		return status;
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, false);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, value);
+		return status;
+	}
+
+	//
+	// Push a range of values claiming all the required tickets at once.
+	// The range is traversed twice so it takes forward iterators. If the
+	// iterator or a value copy throws the remaining tickets are invalidated
+	// and the exception is rethrown.
+	//
+
+	template <typename Iterator, typename... Backoff>
+	void push_bulk(Iterator first, Iterator last, Backoff... backoff)
+	{
+		static_assert(std::is_base_of<std::forward_iterator_tag,
+					      typename std::iterator_traits<
+						      Iterator>::iterator_category>::value,
+			      "push_bulk requires forward iterators");
+
+		const std::uint64_t count = std::distance(first, last);
+		if (count == 0)
+			return;
+
+		// The tail is advanced only as its slot is published, so on a
+		// throw it is the first slot to invalidate.
+		std::uint64_t tail = tail_.fetch_add(count, std::memory_order_relaxed);
+		const std::uint64_t end = tail + count;
+		try {
+			for (; tail < end; ++first) {
+				ring_slot &slot = get_slot(tail);
+				wait_tail(slot, tail, backoff...);
+				new (slot.storage()) value_type(*first);
+				wake_tail(slot, tail++);
+			}
+		} catch (...) {
+			for (; tail < end; ++tail) {
+				ring_slot &slot = get_slot(tail);
+				wait_tail(slot, tail, backoff...);
+				wake_tail(slot, tail, bq_invalid);
+			}
+			throw;
+		}
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		std::uint64_t head;
+		ring_slot *slot = claim_value(head, std::forward<Backoff>(backoff)...);
+		if (slot == nullptr)
+			throw queue_op_status::closed;
+		return take_value(*slot, head);
+	}
+
 	template <typename... Backoff>
 	queue_op_status wait_pop(value_type &value, Backoff... backoff)
 	{
-		const std::uint64_t head = head_.fetch_add(1, std::memory_order_relaxed);
-		ring_slot &slot = ring_[head & mask_];
+		std::uint64_t head;
+		ring_slot *slot = claim_value(head, std::forward<Backoff>(backoff)...);
+		if (slot == nullptr)
+			return queue_op_status::closed;
+		move_value(*slot, head, value);
+		return queue_op_status::success;
+	}
+
+	// Timed pops do not claim a ticket until there is a value for it.
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		return timed_pop([this, &value] { return nonblocking_pop(value); },
+				 abs_time,
+				 std::forward<Backoff>(backoff)...);
+	}
+
+	//
+	// Pop up to max values claiming all the tickets at once. Only tickets
+	// already taken by producers are claimed this way. If there are none
+	// then wait for a single value. Returns the number of values written
+	// to the output iterator, zero means the queue is closed.
+	//
+	// If a value fails to move the rest of the claimed values is destroyed
+	// and the exception is rethrown.
+	//
+
+	template <typename Iterator, typename... Backoff>
+	std::size_t wait_pop_bulk(Iterator out, std::size_t max, Backoff... backoff)
+	{
+		if (max == 0)
+			return 0;
+
+		std::uint64_t head = head_.load(std::memory_order_relaxed);
 		for (;;) {
-			bq_status status
-				= wait_head(slot, head + 1, std::forward<Backoff>(backoff)...);
-			if (status == bq_closed)
-				return queue_op_status::closed;
-			status = get_value(slot, head, status, value);
+			std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail <= head)
+				break;
+			std::uint64_t count = std::min<std::uint64_t>(tail - head, max);
+			if (head_.compare_exchange_weak(head,
+							head + count,
+							std::memory_order_relaxed,
+							std::memory_order_relaxed)) {
+				count = pop_run(out, head, head + count, backoff...);
+				if (count)
+					return count;
+				head = head_.load(std::memory_order_relaxed);
+			}
+		}
+
+		ring_slot *slot = claim_value(head, backoff...);
+		if (slot == nullptr)
+			return 0;
+		*out = take_value(*slot, head);
+		return 1;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		for (;;) {
+			std::uint64_t head;
+			bq_status status;
+			auto op_status = claim_head(head, status, true, backoff...);
+			if (op_status != queue_op_status::success)
+				return op_status;
+			status = get_value(get_slot(head), head, status, value);
 			if (status == bq_normal)
 				return queue_op_status::success;
 		}
 	}
 
-private:
-	struct alignas(cache_line_size) ring_slot : public Ticket
+	queue_op_status nonblocking_pop(value_type &value)
 	{
-		value_type value;
+		for (;;) {
+			std::uint64_t head;
+			bq_status status;
+			auto op_status = claim_head(head, status, false);
+			if (op_status != queue_op_status::success)
+				return op_status;
+			status = get_value(get_slot(head), head, status, value);
+			if (status == bq_normal)
+				return queue_op_status::success;
+		}
+	}
+
+	//
+	// Two-phase operations that let the value be built and consumed right
+	// in its ring slot. A producer reserves a slot, constructs the value
+	// there and commits it. A consumer acquires a slot, uses the value and
+	// releases it. A push handle dropped without commit() makes the slot
+	// invalid so consumers skip it. A pop handle releases its slot when
+	// dropped. The handles are never to be kept for long: the ring does
+	// not move past a reserved or acquired slot.
+	//
+
+	class push_handle : non_copyable
+	{
+	public:
+		push_handle(push_handle &&other) noexcept
+			: queue_{other.queue_},
+			  slot_{other.slot_},
+			  tail_{other.tail_},
+			  constructed_{other.constructed_}
+		{
+			other.queue_ = nullptr;
+		}
+
+		~push_handle()
+		{
+			if (queue_ != nullptr)
+				cancel();
+		}
+
+		template <typename... Args>
+		value_type &construct(Args &&... args)
+		{
+			new (slot_->storage()) value_type(std::forward<Args>(args)...);
+			constructed_ = true;
+			return slot_->value();
+		}
+
+		value_type &value()
+		{
+			return slot_->value();
+		}
+
+		// Publish the value. Without a constructed value the slot is
+		// cancelled instead. Does nothing on a moved-from handle.
+		void commit()
+		{
+			if (queue_ == nullptr)
+				return;
+			if (!constructed_) {
+				cancel();
+				return;
+			}
+			queue_->wake_tail(*slot_, tail_);
+			queue_ = nullptr;
+		}
+
+	private:
+		friend class bounded_queue;
+
+		push_handle(bounded_queue *queue, ring_slot *slot, std::uint64_t tail) noexcept
+			: queue_{queue}, slot_{slot}, tail_{tail}, constructed_{false}
+		{
+		}
+
+		void cancel()
+		{
+			if (constructed_)
+				slot_->value().~value_type();
+			queue_->wake_tail(*slot_, tail_, bq_invalid);
+			queue_ = nullptr;
+		}
+
+		bounded_queue *queue_;
+		ring_slot *slot_;
+		std::uint64_t tail_;
+		bool constructed_;
 	};
 
-	void destroy()
+	class pop_handle : non_copyable
 	{
-		if (ring_ != nullptr) {
-			std::uint32_t size = mask_ + 1;
-			for (std::uint32_t i = 0; i < size; i++)
-				ring_[i].~ring_slot();
-			std::free(ring_);
+	public:
+		pop_handle(pop_handle &&other) noexcept
+			: queue_{other.queue_}, slot_{other.slot_}, head_{other.head_}
+		{
+			other.queue_ = nullptr;
+		}
+
+		~pop_handle()
+		{
+			if (queue_ != nullptr)
+				release();
+		}
+
+		// False if the queue is closed.
+		explicit operator bool() const
+		{
+			return queue_ != nullptr;
+		}
+
+		value_type &value()
+		{
+			return slot_->value();
+		}
+
+		void release()
+		{
+			queue_->release_value(*slot_, head_);
+			queue_ = nullptr;
+		}
+
+	private:
+		friend class bounded_queue;
+
+		pop_handle(bounded_queue *queue, ring_slot *slot, std::uint64_t head) noexcept
+			: queue_{slot != nullptr ? queue : nullptr}, slot_{slot}, head_{head}
+		{
 		}
+
+		bounded_queue *queue_;
+		ring_slot *slot_;
+		std::uint64_t head_;
+	};
+
+	template <typename... Backoff>
+	push_handle reserve_push(Backoff... backoff)
+	{
+		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
+		ring_slot &slot = get_slot(tail);
+		wait_tail(slot, tail, std::forward<Backoff>(backoff)...);
+		return push_handle(this, &slot, tail);
 	}
 
-	void wait_tail(ring_slot &slot, std::uint64_t tail)
+	template <typename... Backoff>
+	pop_handle acquire_pop(Backoff... backoff)
 	{
-		std::uint32_t current_ticket = slot.load();
-		std::uint32_t required_ticket = tail << bq_status_bits;
-		while ((current_ticket & bq_ticket_mask) != required_ticket) {
-			current_ticket = slot.wait_and_load(current_ticket);
+		std::uint64_t head;
+		ring_slot *slot = claim_value(head, std::forward<Backoff>(backoff)...);
+		return pop_handle(this, slot, head);
+	}
+
+private:
+	friend ticket_ring;
+
+	using ticket_ring::claim_head;
+	using ticket_ring::claim_tail;
+	using ticket_ring::timed_pop;
+	using ticket_ring::wait_head;
+	using ticket_ring::wait_tail;
+
+	// The value storage is constructed by a push and destroyed by a pop.
+	struct alignas(Layout::slot_alignment) alignas(Ticket) alignas(Value) ring_slot
+		: public Ticket
+	{
+		void *storage()
+		{
+			return &storage_;
 		}
+
+		value_type &value()
+		{
+			return *reinterpret_cast<value_type *>(&storage_);
+		}
+
+		typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type
+			storage_;
+	};
+
+	// Destroys the value and releases the slot after a pop even if the
+	// value fails to move.
+	class pop_guard : non_copyable
+	{
+	public:
+		pop_guard(bounded_queue *queue, ring_slot &slot, std::uint64_t head) noexcept
+			: queue_{queue}, slot_(slot), head_{head}
+		{
+		}
+
+		~pop_guard()
+		{
+			queue_->release_value(slot_, head_);
+		}
+
+	private:
+		bounded_queue *const queue_;
+		ring_slot &slot_;
+		const std::uint64_t head_;
+	};
+
+	ring_slot &get_slot(std::uint64_t index)
+	{
+		return ring_[layout_.position(index & mask_)];
 	}
 
-	template <typename Backoff>
-	void wait_tail(ring_slot &slot, std::uint64_t tail, Backoff backoff)
+	std::atomic<std::uint64_t> &head_counter()
 	{
-		bool waiting = false;
-		std::uint32_t current_ticket = slot.load();
-		std::uint32_t required_ticket = tail << bq_status_bits;
-		while ((current_ticket & bq_ticket_mask) != required_ticket) {
-			if (waiting) {
-				current_ticket = slot.wait_and_load(current_ticket);
-			} else {
-				waiting = backoff();
-				current_ticket = slot.load();
+		return head_;
+	}
+
+	std::atomic<std::uint64_t> &tail_counter()
+	{
+		return tail_;
+	}
+
+	void add_stat(stat_counter counter)
+	{
+		stats_.add(counter);
+	}
+
+	void destroy()
+	{
+		if (ring_ != nullptr) {
+			// Destroy the values that were pushed but not popped.
+			std::uint64_t head = head_.load(std::memory_order_relaxed);
+			std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+			for (; head < tail; head++) {
+				ring_slot &slot = get_slot(head);
+				std::uint32_t ticket = slot.load();
+				std::uint32_t full_ticket = (head + 1) << bq_status_bits;
+				if ((ticket & bq_ticket_mask) == full_ticket
+				    && bq_ticket_status(ticket) != bq_invalid)
+					slot.value().~value_type();
 			}
+
+			std::uint32_t size = mask_ + 1;
+			for (std::uint32_t i = 0; i < size; i++)
+				ring_[i].~ring_slot();
+			allocator_.deallocate(ring_, size * sizeof(ring_slot));
 		}
 	}
 
-	bq_status wait_head(ring_slot &slot, std::uint64_t head)
+	// Claim a ticket and wait for a valid value, returns nullptr if the
+	// queue is closed.
+	template <typename... Backoff>
+	ring_slot *claim_value(std::uint64_t &head, Backoff... backoff)
 	{
-		std::uint32_t current_ticket = slot.load();
-		std::uint32_t required_ticket = head << bq_status_bits;
-		while ((current_ticket & bq_ticket_mask) != required_ticket) {
-			if (is_closed()) {
-				std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
-				if (head >= tail)
-					return bq_closed;
-			}
-			current_ticket = slot.wait_and_load(current_ticket);
+		for (;;) {
+			head = head_.fetch_add(1, std::memory_order_relaxed);
+			ring_slot &slot = get_slot(head);
+			bq_status status = wait_head(slot, head, backoff...);
+			if (status == bq_closed)
+				return nullptr;
+			if (status != bq_invalid)
+				return &slot;
+			wake_head(slot, head);
 		}
-		return bq_status(current_ticket & bq_status_mask);
 	}
 
-	template <typename Backoff>
-	bq_status wait_head(ring_slot &slot, std::uint64_t head, Backoff backoff)
+	template <typename Iterator, typename... Backoff>
+	std::size_t
+	pop_run(Iterator &out, std::uint64_t head, std::uint64_t end, Backoff... backoff)
 	{
-		bool waiting = false;
-		std::uint32_t current_ticket = slot.load();
-		std::uint32_t required_ticket = head << bq_status_bits;
-		while ((current_ticket & bq_ticket_mask) != required_ticket) {
-			if (is_closed()) {
-				std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
-				if (head >= tail)
-					return bq_closed;
+		std::size_t count = 0;
+		try {
+			for (; head < end; ++head) {
+				ring_slot &slot = get_slot(head);
+				bq_status status = wait_head(slot, head, backoff...);
+				if (status == bq_invalid) {
+					wake_head(slot, head);
+				} else {
+					*out = take_value(slot, head);
+					++out;
+					++count;
+				}
 			}
-			if (waiting) {
-				current_ticket = slot.wait_and_load(current_ticket);
-			} else {
-				waiting = backoff();
-				current_ticket = slot.load();
+		} catch (...) {
+			while (++head < end) {
+				ring_slot &slot = get_slot(head);
+				if (wait_head(slot, head, backoff...) == bq_invalid)
+					wake_head(slot, head);
+				else
+					release_value(slot, head);
 			}
+			throw;
 		}
-		return bq_status(current_ticket & bq_status_mask);
+		return count;
 	}
 
 	void wake_tail(ring_slot &slot, std::uint32_t tail)
 	{
+		stats_.add(stat_push);
 		slot.store_and_wake((tail + 1) << bq_status_bits);
 	}
 
@@ -348,45 +1330,31 @@ private:
 		slot.store_and_wake((head + mask_ + 1) << bq_status_bits);
 	}
 
-	template <typename V = value_type,
-		  typename std::enable_if<std::is_nothrow_copy_assignable<V>::value>::type
-			  * = nullptr>
-	void put_value(ring_slot &slot, std::uint64_t tail, const value_type &value)
-	{
-		slot.value = value;
-		wake_tail(slot, tail);
-	}
-
-	template <typename V = value_type,
-		  typename std::enable_if<not std::is_nothrow_copy_assignable<V>::value>::type
-			  * = nullptr>
-	void put_value(ring_slot &slot, std::uint64_t tail, const value_type &value)
+	void release_value(ring_slot &slot, std::uint32_t head)
 	{
-		try {
-			slot.value = value;
-		} catch (...) {
-			wake_tail(slot, tail, bq_invalid);
-			throw;
-		}
-		wake_tail(slot, tail);
+		slot.value().~value_type();
+		stats_.add(stat_pop);
+		wake_head(slot, head);
 	}
 
-	template <typename V = value_type,
-		  typename std::enable_if<std::is_nothrow_move_assignable<V>::value>::type
+	template <typename... Args,
+		  typename std::enable_if<
+			  std::is_nothrow_constructible<value_type, Args...>::value>::type
 			  * = nullptr>
-	void put_value(ring_slot &slot, std::uint64_t tail, value_type &&value)
+	void put_value(ring_slot &slot, std::uint64_t tail, Args &&... args)
 	{
-		slot.value = std::move(value);
+		new (slot.storage()) value_type(std::forward<Args>(args)...);
 		wake_tail(slot, tail);
 	}
 
-	template <typename V = value_type,
-		  typename std::enable_if<not std::is_nothrow_move_assignable<V>::value>::type
+	template <typename... Args,
+		  typename std::enable_if<
+			  not std::is_nothrow_constructible<value_type, Args...>::value>::type
 			  * = nullptr>
-	void put_value(ring_slot &slot, std::uint64_t tail, value_type &&value)
+	void put_value(ring_slot &slot, std::uint64_t tail, Args &&... args)
 	{
 		try {
-			slot.value = std::move(value);
+			new (slot.storage()) value_type(std::forward<Args>(args)...);
 		} catch (...) {
 			wake_tail(slot, tail, bq_invalid);
 			throw;
@@ -394,39 +1362,37 @@ private:
 		wake_tail(slot, tail);
 	}
 
-	template <typename V = value_type,
-		  typename std::enable_if<std::is_nothrow_move_assignable<V>::value>::type
-			  * = nullptr>
-	bq_status get_value(ring_slot &slot, std::uint64_t head, bq_status, value_type &value)
-	{
-		value = std::move(slot.value);
-		wake_head(slot, head);
-		return bq_normal;
-	}
-
-	template <typename V = value_type,
-		  typename std::enable_if<not std::is_nothrow_move_assignable<V>::value>::type
-			  * = nullptr>
 	bq_status
 	get_value(ring_slot &slot, std::uint64_t head, bq_status status, value_type &value)
 	{
-		if (status == bq_invalid)
-			return status;
-
-		try {
-			value = std::move(slot.value);
-		} catch (...) {
+		if (status == bq_invalid) {
 			wake_head(slot, head);
-			throw;
+			return status;
 		}
-		wake_head(slot, head);
+		move_value(slot, head, value);
 		return bq_normal;
 	}
 
+	void move_value(ring_slot &slot, std::uint64_t head, value_type &value)
+	{
+		pop_guard guard(this, slot, head);
+		value = std::move(slot.value());
+	}
+
+	value_type take_value(ring_slot &slot, std::uint64_t head)
+	{
+		pop_guard guard(this, slot, head);
+		return std::move(slot.value());
+	}
+
 	ring_slot *ring_;
 	const std::uint32_t mask_;
+	Allocator allocator_;
+	const Layout layout_;
+	Stats stats_;
 
 	std::atomic<bool> closed_;
+	typename Ticket::shared_state shared_;
 
 	alignas(cache_line_size) std::atomic<std::uint64_t> head_;
 	alignas(cache_line_size) std::atomic<std::uint64_t> tail_;
@@ -0,0 +1,519 @@
+//
+// Single-Writer Broadcast Ring
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_BROADCAST_RING_H_
+#define EVENK_BROADCAST_RING_H_
+
+//
+// A ring where a single writer publishes values and every one of a fixed
+// number of readers sees all of them, in the manner of the LMAX Disruptor.
+// The slots use the bounded_queue tickets: the value at position p is
+// published with the ticket (p + 1) << bq_status_bits, so readers wait on
+// the slots with the same Ticket types.
+//
+// Each reader has its own cursor and reads the values in place through a
+// const pointer, then releases the slot to move on. Normally the writer
+// does not overwrite a slot until the slowest reader releases it. A reader
+// that quits should leave() the ring so as not to stall the writer.
+//
+// With Overwrite set the writer never waits. A reader that lags by more
+// than the ring size skips to the oldest value still available. A value
+// may also be overwritten while it is read, so release() validates the
+// read in the manner of a seqlock and returns false if the value has to
+// be discarded. For this the values must be trivially copyable. As in
+// seqlock.h they are kept as atomic words accessed with relaxed operations
+// so that racing reads are well defined. A reader then acquires a copy of
+// the value in its cursor rather than the value in place.
+//
+// All the push operations and close() are for the writer thread only.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+#include "synch.h"
+
+namespace evenk {
+
+template <typename Value, typename Ticket = bq_slot, bool Overwrite = false>
+class broadcast_ring : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	static_assert(!Overwrite || std::is_trivially_copyable<Value>::value,
+		      "broadcast_ring overwrite mode requires trivially copyable values");
+
+	broadcast_ring(std::uint32_t size, std::size_t nreaders)
+		: ring_{nullptr},
+		  cursors_{nullptr},
+		  mask_{size - 1},
+		  nreaders_{nreaders},
+		  gate_{0},
+		  closed_{false},
+		  shared_{closed_},
+		  tail_{0}
+	{
+		if (size < 2 || (size & mask_) != 0)
+			throw std::invalid_argument(
+				"broadcast_ring size must be a power of two");
+		if (nreaders == 0)
+			throw std::invalid_argument("broadcast_ring must have some readers");
+
+		void *ring;
+		if (::posix_memalign(&ring, cache_line_size, size * sizeof(ring_slot)))
+			throw std::bad_alloc();
+		ring_ = static_cast<ring_slot *>(ring);
+		for (std::uint32_t i = 0; i < size; i++) {
+			new (&ring_[i]) ring_slot();
+			ring_[i].attach(shared_);
+			ring_[i].initialize(i << bq_status_bits);
+		}
+
+		void *cursors;
+		if (::posix_memalign(&cursors, cache_line_size, nreaders * sizeof(cursor))) {
+			destroy();
+			throw std::bad_alloc();
+		}
+		cursors_ = static_cast<cursor *>(cursors);
+		for (std::size_t i = 0; i < nreaders; i++)
+			new (&cursors_[i]) cursor();
+	}
+
+	~broadcast_ring()
+	{
+		destroy();
+	}
+
+	std::size_t readers() const
+	{
+		return nreaders_;
+	}
+
+	void close()
+	{
+		closed_.store(true, std::memory_order_seq_cst);
+		if (Ticket::shared_wake) {
+			shared_.wake();
+			return;
+		}
+		for (std::uint32_t i = 0; i < mask_ + 1; i++)
+			ring_[i].wake();
+	}
+
+	bool is_closed() const
+	{
+		return closed_.load(std::memory_order_relaxed);
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		wait_readers(std::forward<Backoff>(backoff)...);
+		put_value(value);
+	}
+
+	template <typename... Backoff>
+	void push(value_type &&value, Backoff... backoff)
+	{
+		wait_readers(std::forward<Backoff>(backoff)...);
+		put_value(std::move(value));
+	}
+
+	template <typename... Args>
+	void emplace(Args &&... args)
+	{
+		wait_readers();
+		put_value(std::forward<Args>(args)...);
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(value, std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(std::move(value), std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		if (!has_space())
+			return queue_op_status::full;
+		put_value(value);
+		return queue_op_status::success;
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		if (!has_space())
+			return queue_op_status::full;
+		put_value(std::move(value));
+		return queue_op_status::success;
+	}
+
+	//
+	// Reader operations. The value pointer stays valid until release().
+	//
+
+	template <typename... Backoff>
+	queue_op_status
+	wait_acquire(std::size_t reader, const value_type *&value, Backoff... backoff)
+	{
+		cursor &c = cursors_[reader];
+		bool waiting = false;
+		for (;;) {
+			std::uint32_t ticket;
+			auto status = poll(c, value, ticket);
+			if (status != queue_op_status::empty)
+				return status;
+			if (waiting)
+				get_slot(c.position.load(std::memory_order_relaxed))
+					.wait_and_load(ticket);
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+	queue_op_status try_acquire(std::size_t reader, const value_type *&value)
+	{
+		std::uint32_t ticket;
+		return poll(cursors_[reader], value, ticket);
+	}
+
+	// Returns false if the value was overwritten while it was read.
+	bool release(std::size_t reader)
+	{
+		cursor &c = cursors_[reader];
+		std::uint64_t position = c.position.load(std::memory_order_relaxed);
+		bool valid = true;
+		if (Overwrite) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			std::uint32_t ticket = get_slot(position).load() & bq_ticket_mask;
+			valid = ticket == std::uint32_t((position + 1) << bq_status_bits);
+		}
+		advance(c, position + 1);
+		return valid;
+	}
+
+	// Copy the next value out of the ring.
+	template <typename... Backoff>
+	queue_op_status wait_pop(std::size_t reader, value_type &value, Backoff... backoff)
+	{
+		for (;;) {
+			const value_type *slot_value;
+			auto status = wait_acquire(reader, slot_value, backoff...);
+			if (status != queue_op_status::success)
+				return status;
+			value = *slot_value;
+			if (release(reader))
+				return status;
+		}
+	}
+
+	// The reader stops holding back the writer for good.
+	void leave(std::size_t reader)
+	{
+		advance(cursors_[reader], inactive);
+	}
+
+private:
+	static constexpr std::uint64_t inactive = std::numeric_limits<std::uint64_t>::max();
+
+	using copy_type = typename std::aligned_storage<Overwrite ? sizeof(value_type) : 1,
+							alignof(value_type)>::type;
+
+	// A value kept in place.
+	template <bool Atomic, typename = void>
+	struct value_storage
+	{
+		template <typename... Args>
+		void construct(Args &&... args)
+		{
+			new (&storage_) value_type(std::forward<Args>(args)...);
+		}
+
+		void destroy()
+		{
+			reinterpret_cast<value_type *>(&storage_)->~value_type();
+		}
+
+		const value_type *get(copy_type &)
+		{
+			return reinterpret_cast<const value_type *>(&storage_);
+		}
+
+		typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type
+			storage_;
+	};
+
+	// A value kept in atomic words that may be read while it is written.
+	template <typename Dummy>
+	struct value_storage<true, Dummy>
+	{
+		using word_type = std::uintptr_t;
+
+		static constexpr std::size_t nwords =
+			(sizeof(value_type) + sizeof(word_type) - 1) / sizeof(word_type);
+
+		template <typename... Args>
+		void construct(Args &&... args)
+		{
+			const value_type value(std::forward<Args>(args)...);
+			word_type words[nwords] = {};
+			std::memcpy(words, &value, sizeof(value_type));
+			for (std::size_t i = 0; i < nwords; i++)
+				words_[i].store(words[i], std::memory_order_relaxed);
+		}
+
+		void destroy()
+		{
+		}
+
+		const value_type *get(copy_type &copy)
+		{
+			word_type words[nwords];
+			for (std::size_t i = 0; i < nwords; i++)
+				words[i] = words_[i].load(std::memory_order_relaxed);
+			std::memcpy(&copy, words, sizeof(value_type));
+			return reinterpret_cast<const value_type *>(&copy);
+		}
+
+		std::atomic<word_type> words_[nwords];
+	};
+
+	struct alignas(Ticket) alignas(Value) ring_slot : public Ticket,
+							  public value_storage<Overwrite>
+	{
+		// False if the value failed to construct.
+		std::atomic<bool> valid = ATOMIC_VAR_INIT(false);
+	};
+
+	struct alignas(cache_line_size) cursor
+	{
+		std::atomic<std::uint64_t> position = ATOMIC_VAR_INIT(0);
+
+		// The value acquired in the overwrite mode.
+		copy_type copy;
+	};
+
+	ring_slot &get_slot(std::uint64_t index)
+	{
+		return ring_[index & mask_];
+	}
+
+	void destroy()
+	{
+		if (ring_ != nullptr) {
+			std::uint32_t size = mask_ + 1;
+			std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+			for (std::uint64_t i = tail < size ? 0 : tail - size; i < tail; i++) {
+				ring_slot &slot = get_slot(i);
+				if (slot.valid.load(std::memory_order_relaxed))
+					slot.destroy();
+			}
+			for (std::uint32_t i = 0; i < size; i++)
+				ring_[i].~ring_slot();
+			std::free(ring_);
+		}
+		if (cursors_ != nullptr) {
+			for (std::size_t i = 0; i < nreaders_; i++)
+				cursors_[i].~cursor();
+			std::free(cursors_);
+		}
+	}
+
+	static bool give_up()
+	{
+		return true;
+	}
+
+	template <typename Backoff>
+	static bool give_up(Backoff &backoff)
+	{
+		return backoff();
+	}
+
+	std::uint64_t min_position(std::uint64_t tail) const
+	{
+		std::uint64_t position = inactive;
+		for (std::size_t i = 0; i < nreaders_; i++)
+			position = std::min(position,
+					    cursors_[i].position.load(std::memory_order_acquire));
+		// With no readers the writer may go on for a whole ring.
+		return std::min(position, tail);
+	}
+
+	bool has_space()
+	{
+		if (Overwrite)
+			return true;
+		std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - gate_ <= mask_)
+			return true;
+		gate_ = min_position(tail);
+		return tail - gate_ <= mask_;
+	}
+
+	template <typename... Backoff>
+	void wait_readers(Backoff... backoff)
+	{
+		bool waiting = false;
+		while (!has_space()) {
+			if (waiting) {
+				event_count::key_type key = space_.prepare_wait();
+				if (has_space())
+					space_.cancel_wait();
+				else
+					space_.commit_wait(key);
+			} else {
+				waiting = give_up(backoff...);
+			}
+		}
+	}
+
+	void advance(cursor &c, std::uint64_t position)
+	{
+		c.position.store(position, std::memory_order_release);
+		if (!Overwrite)
+			space_.notify_one();
+	}
+
+	template <typename... Args>
+	void put_value(Args &&... args)
+	{
+		const std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+		ring_slot &slot = get_slot(tail);
+
+		if (Overwrite) {
+			// Let the readers see that the old value is going.
+			slot.store_and_wake(tail << bq_status_bits);
+			std::atomic_thread_fence(std::memory_order_release);
+		} else if (slot.valid.load(std::memory_order_relaxed)) {
+			slot.destroy();
+		}
+
+		slot.valid.store(false, std::memory_order_relaxed);
+		try {
+			slot.construct(std::forward<Args>(args)...);
+			slot.valid.store(true, std::memory_order_relaxed);
+		} catch (...) {
+			publish(slot, tail);
+			throw;
+		}
+		publish(slot, tail);
+	}
+
+	void publish(ring_slot &slot, std::uint64_t tail)
+	{
+		tail_.store(tail + 1, std::memory_order_release);
+		slot.store_and_wake((tail + 1) << bq_status_bits);
+	}
+
+	// Returns success, empty or closed. A slot with no valid value is
+	// skipped, in the overwrite mode so are the slots already lost.
+	queue_op_status poll(cursor &c, const value_type *&value, std::uint32_t &ticket)
+	{
+		for (;;) {
+			std::uint64_t position = c.position.load(std::memory_order_relaxed);
+			ring_slot &slot = get_slot(position);
+			std::uint32_t required_ticket = (position + 1) << bq_status_bits;
+			ticket = slot.load();
+
+			std::uint32_t current_ticket = ticket & bq_ticket_mask;
+			if (current_ticket == required_ticket) {
+				if (slot.valid.load(std::memory_order_relaxed)) {
+					value = slot.get(c.copy);
+					return queue_op_status::success;
+				}
+				advance(c, position + 1);
+				continue;
+			}
+
+			if (Overwrite && std::int32_t(current_ticket - required_ticket) > 0) {
+				std::uint64_t tail = tail_.load(std::memory_order_acquire);
+				std::uint64_t oldest = tail - mask_;
+				advance(c, std::max(position + 1, oldest));
+				continue;
+			}
+
+			if (is_closed()) {
+				std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
+				if (position >= tail)
+					return queue_op_status::closed;
+			}
+			return queue_op_status::empty;
+		}
+	}
+
+	ring_slot *ring_;
+	cursor *cursors_;
+	const std::uint32_t mask_;
+	const std::size_t nreaders_;
+
+	// The slowest reader position the writer knows about.
+	std::uint64_t gate_;
+
+	std::atomic<bool> closed_;
+	typename Ticket::shared_state shared_;
+
+	alignas(cache_line_size) std::atomic<std::uint64_t> tail_;
+
+	alignas(cache_line_size) event_count space_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_BROADCAST_RING_H_
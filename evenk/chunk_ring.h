@@ -0,0 +1,264 @@
+//
+// Pooled Chunk Ring Sequence
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_CHUNK_RING_H_
+#define EVENK_CHUNK_RING_H_
+
+//
+// A FIFO sequence to be used with synch_queue instead of std::deque. The
+// values are kept in fixed-size chunks and the chunks are referred to from
+// a ring of pointers that doubles as needed. A chunk that gets empty goes
+// to a free list and is reused later, chunks are never freed before the
+// sequence is destroyed. So after a warm-up or an explicit reserve() call
+// push_back() and pop_front() do not allocate memory any more.
+//
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "basic.h"
+
+namespace evenk {
+
+template <typename Value, std::size_t ChunkSize = 64>
+class chunk_ring : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+	using size_type = std::size_t;
+
+	static_assert(ChunkSize > 0, "chunk_ring chunk size must be positive");
+
+	chunk_ring() noexcept
+		: free_{nullptr}, first_{0}, nchunks_{0}, head_{0}, tail_{0}, size_{0}
+	{
+	}
+
+	chunk_ring(chunk_ring &&other) noexcept : chunk_ring()
+	{
+		swap(other);
+	}
+
+	chunk_ring &operator=(chunk_ring &&other) noexcept
+	{
+		swap(other);
+		return *this;
+	}
+
+	~chunk_ring()
+	{
+		clear();
+		for (size_type i = 0; i < nchunks_; i++)
+			delete chunk_at(i);
+		while (free_ != nullptr) {
+			chunk *c = free_;
+			free_ = c->next;
+			delete c;
+		}
+	}
+
+	void swap(chunk_ring &other) noexcept
+	{
+		std::swap(ring_, other.ring_);
+		std::swap(free_, other.free_);
+		std::swap(first_, other.first_);
+		std::swap(nchunks_, other.nchunks_);
+		std::swap(head_, other.head_);
+		std::swap(tail_, other.tail_);
+		std::swap(size_, other.size_);
+	}
+
+	bool empty() const noexcept
+	{
+		return size_ == 0;
+	}
+
+	size_type size() const noexcept
+	{
+		return size_;
+	}
+
+	// Make sure that the given number of values fit without allocation.
+	void reserve(size_type capacity)
+	{
+		size_type needed = (capacity + ChunkSize - 1) / ChunkSize + 1;
+		if (needed > ring_.size())
+			grow(needed);
+
+		size_type available = nchunks_;
+		for (chunk *c = free_; c != nullptr; c = c->next)
+			available++;
+		for (; available < needed; available++) {
+			chunk *c = new chunk;
+			c->next = free_;
+			free_ = c;
+		}
+	}
+
+	reference front() noexcept
+	{
+		return chunk_at(0)->at(head_);
+	}
+
+	const_reference front() const noexcept
+	{
+		return chunk_at(0)->at(head_);
+	}
+
+	void push_back(const value_type &value)
+	{
+		emplace_back(value);
+	}
+
+	void push_back(value_type &&value)
+	{
+		emplace_back(std::move(value));
+	}
+
+	template <typename... Args>
+	void emplace_back(Args &&... args)
+	{
+		if (nchunks_ == 0 || tail_ == ChunkSize)
+			append_chunk();
+		new (chunk_at(nchunks_ - 1)->slot(tail_)) value_type(std::forward<Args>(args)...);
+		tail_++;
+		size_++;
+	}
+
+	void pop_front() noexcept
+	{
+		chunk_at(0)->at(head_).~value_type();
+		head_++;
+		if (--size_ == 0) {
+			// Keep the first chunk and rewind it.
+			while (nchunks_ > 1)
+				release_last_chunk();
+			head_ = tail_ = 0;
+		} else if (head_ == ChunkSize) {
+			release_first_chunk();
+			head_ = 0;
+		}
+	}
+
+	void clear() noexcept
+	{
+		while (size_ != 0)
+			pop_front();
+	}
+
+private:
+	struct chunk
+	{
+		void *slot(size_type index) noexcept
+		{
+			return &items[index];
+		}
+
+		value_type &at(size_type index) noexcept
+		{
+			return *reinterpret_cast<value_type *>(&items[index]);
+		}
+
+		chunk *next;
+		typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type
+			items[ChunkSize];
+	};
+
+	chunk *chunk_at(size_type index) const noexcept
+	{
+		return ring_[(first_ + index) & (ring_.size() - 1)];
+	}
+
+	void grow(size_type needed)
+	{
+		size_type size = ring_.empty() ? 8 : ring_.size();
+		while (size < needed)
+			size *= 2;
+
+		std::vector<chunk *> ring(size, nullptr);
+		for (size_type i = 0; i < nchunks_; i++)
+			ring[i] = chunk_at(i);
+		ring_.swap(ring);
+		first_ = 0;
+	}
+
+	void append_chunk()
+	{
+		if (nchunks_ == ring_.size())
+			grow(nchunks_ + 1);
+
+		chunk *c = free_;
+		if (c != nullptr)
+			free_ = c->next;
+		else
+			c = new chunk;
+
+		ring_[(first_ + nchunks_) & (ring_.size() - 1)] = c;
+		if (nchunks_++ == 0)
+			head_ = 0;
+		tail_ = 0;
+	}
+
+	void release_first_chunk() noexcept
+	{
+		chunk *c = chunk_at(0);
+		c->next = free_;
+		free_ = c;
+		first_ = (first_ + 1) & (ring_.size() - 1);
+		nchunks_--;
+	}
+
+	void release_last_chunk() noexcept
+	{
+		chunk *c = chunk_at(nchunks_ - 1);
+		c->next = free_;
+		free_ = c;
+		nchunks_--;
+	}
+
+	// The ring of chunks in use, its size is a power of two.
+	std::vector<chunk *> ring_;
+	// The list of unused chunks.
+	chunk *free_;
+
+	// The ring index of the first chunk and the number of chunks in use.
+	size_type first_;
+	size_type nchunks_;
+
+	// The first value index in the first chunk and the end index in the
+	// last chunk.
+	size_type head_;
+	size_type tail_;
+
+	size_type size_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_CHUNK_RING_H_
@@ -0,0 +1,427 @@
+//
+// Flat-Combining Synchronized Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_COMBINING_QUEUE_H_
+#define EVENK_COMBINING_QUEUE_H_
+
+//
+// The code in this file is based on the following paper:
+//    D. Hendler, I. Incze, N. Shavit, M. Tzafrir. Flat Combining and the
+//    Synchronization-Parallelism Tradeoff. SPAA 2010.
+//
+// A thread posts its operation to a publication slot and tries to take the
+// lock. The lock owner becomes the combiner and applies all the pending
+// operations to the sequence in one pass. The other threads just wait for
+// their operations to complete. So the lock changes hands much less often
+// than with synch_queue.
+//
+// Each thread starts looking for a free publication slot at its own index
+// so with no more threads than slots every thread effectively has its own
+// slot. Consumers that find the queue empty wait on the condition variable
+// as with synch_queue.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <new>
+#include <stdexcept>
+
+#include "backoff.h"
+#include "basic.h"
+#include "conqueue.h"
+#include "synch.h"
+
+namespace evenk {
+
+template <typename Value, typename Synch = default_synch, typename Sequence = std::deque<Value>>
+class combining_queue : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	using lock_type = typename Synch::lock_type;
+	using cond_var_type = typename Synch::cond_var_type;
+	using lock_owner_type = typename Synch::lock_owner_type;
+
+	using sequence_type = Sequence;
+
+	combining_queue(std::size_t nslots = 64)
+		: requests_{nullptr}, mask_{nslots - 1}, closed_{false}
+	{
+		if (nslots == 0 || (nslots & mask_) != 0)
+			throw std::invalid_argument(
+				"combining_queue slot number must be a power of two");
+
+		void *requests;
+		if (::posix_memalign(&requests, cache_line_size, nslots * sizeof(request)))
+			throw std::bad_alloc();
+		requests_ = static_cast<request *>(requests);
+		for (std::size_t i = 0; i < nslots; i++)
+			new (&requests_[i]) request();
+	}
+
+	~combining_queue()
+	{
+		for (std::size_t i = 0; i <= mask_; i++)
+			requests_[i].~request();
+		std::free(requests_);
+	}
+
+	void close()
+	{
+		lock_owner_type guard(lock_);
+		combine();
+		closed_ = true;
+		cond_.notify_all();
+	}
+
+	bool is_closed()
+	{
+		lock_owner_type guard(lock_);
+		return closed_;
+	}
+
+	bool is_empty()
+	{
+		lock_owner_type guard(lock_);
+		combine();
+		return queue_.empty();
+	}
+
+	bool is_full()
+	{
+		return false;
+	}
+
+	bool is_lock_free() const
+	{
+		return false;
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		auto status = wait_push(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		return try_push(value, std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(const value_type &value, Backoff... backoff)
+	{
+		return execute(push_copy, &value, nullptr, false, backoff...);
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		return execute(push_copy, &value, nullptr, true);
+	}
+
+	template <typename... Backoff>
+	void push(value_type &&value, Backoff... backoff)
+	{
+		auto status = wait_push(std::move(value), std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		return try_push(std::move(value), std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(value_type &&value, Backoff... backoff)
+	{
+		return execute(push_move, nullptr, &value, false, backoff...);
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		return execute(push_move, nullptr, &value, true);
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		auto status = try_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::empty)
+			return status;
+
+		lock_owner_type guard(lock_);
+		for (;;) {
+			combine();
+			status = locked_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			cond_.wait(guard);
+		}
+	}
+
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		auto status = try_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::empty)
+			return status;
+
+		lock_owner_type guard(lock_);
+		for (;;) {
+			combine();
+			status = locked_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			if (cond_.wait_until(guard, abs_time) == std::cv_status::timeout) {
+				combine();
+				status = locked_pop(value);
+				if (status == queue_op_status::empty)
+					return queue_op_status::timeout;
+				return status;
+			}
+		}
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		return execute(pop, nullptr, &value, false, backoff...);
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		return execute(pop, nullptr, &value, true);
+	}
+
+private:
+	enum operation { push_copy, push_move, pop };
+
+	enum request_state : std::uint32_t {
+		// Not used by any thread.
+		request_free,
+		// Owned by a thread that fills it in.
+		request_owned,
+		// Posted and waits for a combiner.
+		request_pending,
+		// Being applied by a combiner.
+		request_taken,
+		// Applied, the result is ready.
+		request_done,
+	};
+
+	struct alignas(cache_line_size) request
+	{
+		std::atomic<std::uint32_t> state = ATOMIC_VAR_INIT(request_free);
+		operation op = pop;
+		const value_type *source = nullptr;
+		value_type *target = nullptr;
+		queue_op_status status = queue_op_status::success;
+		std::exception_ptr error;
+	};
+
+	static std::size_t thread_index()
+	{
+		static std::atomic<std::size_t> next_index = ATOMIC_VAR_INIT(0);
+		static thread_local std::size_t index =
+			next_index.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+
+	static void pause()
+	{
+		cpu_relax()(1);
+	}
+
+	template <typename Backoff>
+	static void pause(Backoff &backoff)
+	{
+		backoff();
+	}
+
+	request &acquire_request()
+	{
+		const std::size_t index = thread_index();
+		for (;;) {
+			for (std::size_t i = 0; i <= mask_; i++) {
+				request &r = requests_[(index + i) & mask_];
+				std::uint32_t state = r.state.load(std::memory_order_relaxed);
+				if (state == request_free
+				    && r.state.compare_exchange_strong(state,
+								       request_owned,
+								       std::memory_order_acquire,
+								       std::memory_order_relaxed))
+					return r;
+			}
+			pause();
+		}
+	}
+
+	// If nonblocking is set and the lock is busy then the request is
+	// withdrawn unless some combiner has already taken it.
+	template <typename... Backoff>
+	queue_op_status execute(operation op,
+				const value_type *source,
+				value_type *target,
+				bool nonblocking,
+				Backoff... backoff)
+	{
+		request &r = acquire_request();
+		r.op = op;
+		r.source = source;
+		r.target = target;
+		r.state.store(request_pending, std::memory_order_release);
+
+		while (r.state.load(std::memory_order_acquire) != request_done) {
+			if (lock_.try_lock()) {
+				combine();
+				lock_.unlock();
+			} else if (nonblocking) {
+				std::uint32_t state = request_pending;
+				if (r.state.compare_exchange_strong(state,
+								    request_free,
+								    std::memory_order_relaxed,
+								    std::memory_order_relaxed))
+					return queue_op_status::busy;
+				nonblocking = false;
+			} else {
+				pause(backoff...);
+			}
+		}
+
+		queue_op_status status = r.status;
+		std::exception_ptr error = r.error;
+		r.error = nullptr;
+		r.state.store(request_free, std::memory_order_release);
+		if (error)
+			std::rethrow_exception(error);
+		return status;
+	}
+
+	// Called with the lock held.
+	void combine()
+	{
+		for (std::size_t i = 0; i <= mask_; i++) {
+			request &r = requests_[i];
+			std::uint32_t state = r.state.load(std::memory_order_relaxed);
+			if (state != request_pending
+			    || !r.state.compare_exchange_strong(state,
+								request_taken,
+								std::memory_order_acquire,
+								std::memory_order_relaxed))
+				continue;
+			try {
+				switch (r.op) {
+				case push_copy:
+					r.status = locked_push(*r.source);
+					break;
+				case push_move:
+					r.status = locked_push(std::move(*r.target));
+					break;
+				case pop:
+					r.status = locked_pop(*r.target);
+					break;
+				}
+			} catch (...) {
+				r.error = std::current_exception();
+			}
+			r.state.store(request_done, std::memory_order_release);
+		}
+	}
+
+	queue_op_status locked_push(const value_type &value)
+	{
+		if (closed_)
+			return queue_op_status::closed;
+
+		queue_.push_back(value);
+		cond_.notify_one();
+		return queue_op_status::success;
+	}
+
+	queue_op_status locked_push(value_type &&value)
+	{
+		if (closed_)
+			return queue_op_status::closed;
+
+		queue_.push_back(std::move(value));
+		cond_.notify_one();
+		return queue_op_status::success;
+	}
+
+	queue_op_status locked_pop(value_type &value)
+	{
+		if (queue_.empty())
+			return closed_ ? queue_op_status::closed : queue_op_status::empty;
+
+		value = std::move(queue_.front());
+		queue_.pop_front();
+		return queue_op_status::success;
+	}
+
+	request *requests_;
+	const std::size_t mask_;
+
+	bool closed_;
+	lock_type lock_;
+	cond_var_type cond_;
+	sequence_type queue_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_COMBINING_QUEUE_H_
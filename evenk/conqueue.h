@@ -31,11 +31,12 @@
 //
 
 #include <iterator>
+#include <type_traits>
 #include <utility>
 
 namespace evenk {
 
-enum class queue_op_status { success = 0, empty, full, closed, busy };
+enum class queue_op_status { success = 0, empty, full, closed, busy, timeout };
 
 template <typename Value>
 class queue_base
@@ -168,7 +169,7 @@ private:
 	queue_type *queue_;
 };
 
-namespace detail {
+inline namespace detail {
 
 //
 // A concurrent queue input iterator. Unlike the underlying queue a given
@@ -326,8 +327,400 @@ private:
 	queue_op_status status_ = queue_op_status::closed;
 };
 
+//
+// A concurrent queue input iterator that is moved rather than copied. The
+// popped value is handed out by a non-const reference so the caller can
+// move it away. It works with a range-based for loop but not with the
+// algorithms that copy iterators.
+//
+
+template <typename Queue>
+class queue_move_iterator
+{
+public:
+	using queue_type = Queue;
+
+	using iterator_category = std::input_iterator_tag;
+	using value_type = typename queue_type::value_type;
+	using difference_type = void;
+	using pointer = value_type *;
+	using reference = value_type &;
+
+	constexpr queue_move_iterator() noexcept = default;
+
+	queue_move_iterator(queue_type &queue) : queue_(&queue)
+	{
+		pop_value();
+	}
+
+	queue_move_iterator(queue_move_iterator &&other) noexcept(
+		std::is_nothrow_move_constructible<value_type>::value)
+		: queue_(other.queue_),
+		  status_(other.status_),
+		  cached_value_(std::move(other.cached_value_))
+	{
+		other.status_ = queue_op_status::closed;
+	}
+
+	queue_move_iterator &operator=(queue_move_iterator &&other) noexcept(
+		std::is_nothrow_move_assignable<value_type>::value)
+	{
+		queue_ = other.queue_;
+		status_ = other.status_;
+		cached_value_ = std::move(other.cached_value_);
+		other.status_ = queue_op_status::closed;
+		return *this;
+	}
+
+	queue_move_iterator(const queue_move_iterator &) = delete;
+	queue_move_iterator &operator=(const queue_move_iterator &) = delete;
+
+	queue_move_iterator &operator++()
+	{
+		pop_value();
+		return *this;
+	}
+
+	pointer operator->()
+	{
+		if (status_ != queue_op_status::success)
+			throw status_;
+		return &cached_value_;
+	}
+	reference operator*()
+	{
+		if (status_ != queue_op_status::success)
+			throw status_;
+		return cached_value_;
+	}
+
+	bool operator==(const queue_move_iterator &rhs)
+	{
+		return status_ == rhs.status_
+		       && (status_ == queue_op_status::closed || queue_ == rhs.queue_);
+	}
+	bool operator!=(const queue_move_iterator &rhs)
+	{
+		return status_ != rhs.status_
+		       || (status_ != queue_op_status::closed && queue_ != rhs.queue_);
+	}
+
+private:
+	void pop_value()
+	{
+		status_ = queue_->wait_pop(cached_value_);
+	}
+
+	queue_type *queue_ = nullptr;
+	queue_op_status status_ = queue_op_status::closed;
+	value_type cached_value_;
+};
+
+//
+// The function table of a type-erased queue reference. There is a single
+// constant table per queue type.
+//
+
+template <typename Value>
+struct queue_ref_table
+{
+	void (*close)(void *);
+
+	bool (*is_closed)(void *);
+	bool (*is_empty)(void *);
+	bool (*is_full)(void *);
+	bool (*is_lock_free)(void *);
+
+	void (*push)(void *, const Value &);
+	queue_op_status (*wait_push)(void *, const Value &);
+	queue_op_status (*try_push)(void *, const Value &);
+	queue_op_status (*nonblocking_push)(void *, const Value &);
+
+	void (*move_push)(void *, Value &&);
+	queue_op_status (*move_wait_push)(void *, Value &&);
+	queue_op_status (*move_try_push)(void *, Value &&);
+	queue_op_status (*move_nonblocking_push)(void *, Value &&);
+
+	Value (*value_pop)(void *);
+	queue_op_status (*wait_pop)(void *, Value &);
+	queue_op_status (*try_pop)(void *, Value &);
+	queue_op_status (*nonblocking_pop)(void *, Value &);
+};
+
+// The copy pushes are only there for copyable values, for move-only ones
+// their table entries are null.
+template <typename Queue,
+	  bool = std::is_copy_constructible<typename Queue::value_type>::value>
+struct queue_ref_copy_ops
+{
+	using value_type = typename Queue::value_type;
+
+	static void push(void *q, const value_type &value)
+	{
+		static_cast<Queue *>(q)->push(value);
+	}
+	static queue_op_status wait_push(void *q, const value_type &value)
+	{
+		return static_cast<Queue *>(q)->wait_push(value);
+	}
+	static queue_op_status try_push(void *q, const value_type &value)
+	{
+		return static_cast<Queue *>(q)->try_push(value);
+	}
+	static queue_op_status nonblocking_push(void *q, const value_type &value)
+	{
+		return static_cast<Queue *>(q)->nonblocking_push(value);
+	}
+};
+
+template <typename Queue>
+struct queue_ref_copy_ops<Queue, false>
+{
+	using value_type = typename Queue::value_type;
+
+	static constexpr void (*push)(void *, const value_type &) = nullptr;
+	static constexpr queue_op_status (*wait_push)(void *, const value_type &) = nullptr;
+	static constexpr queue_op_status (*try_push)(void *, const value_type &) = nullptr;
+	static constexpr queue_op_status (*nonblocking_push)(void *,
+							     const value_type &) = nullptr;
+};
+
+template <typename Queue>
+struct queue_ref_ops : queue_ref_copy_ops<Queue>
+{
+	using value_type = typename Queue::value_type;
+
+	using copy_ops = queue_ref_copy_ops<Queue>;
+
+	static Queue &get(void *queue) noexcept
+	{
+		return *static_cast<Queue *>(queue);
+	}
+
+	static void close(void *q)
+	{
+		get(q).close();
+	}
+
+	static bool is_closed(void *q)
+	{
+		return get(q).is_closed();
+	}
+	static bool is_empty(void *q)
+	{
+		return get(q).is_empty();
+	}
+	static bool is_full(void *q)
+	{
+		return get(q).is_full();
+	}
+	static bool is_lock_free(void *q)
+	{
+		return get(q).is_lock_free();
+	}
+
+	static void move_push(void *q, value_type &&value)
+	{
+		get(q).push(std::move(value));
+	}
+	static queue_op_status move_wait_push(void *q, value_type &&value)
+	{
+		return get(q).wait_push(std::move(value));
+	}
+	static queue_op_status move_try_push(void *q, value_type &&value)
+	{
+		return get(q).try_push(std::move(value));
+	}
+	static queue_op_status move_nonblocking_push(void *q, value_type &&value)
+	{
+		return get(q).nonblocking_push(std::move(value));
+	}
+
+	static value_type value_pop(void *q)
+	{
+		return get(q).value_pop();
+	}
+	static queue_op_status wait_pop(void *q, value_type &value)
+	{
+		return get(q).wait_pop(value);
+	}
+	static queue_op_status try_pop(void *q, value_type &value)
+	{
+		return get(q).try_pop(value);
+	}
+	static queue_op_status nonblocking_pop(void *q, value_type &value)
+	{
+		return get(q).nonblocking_pop(value);
+	}
+
+	static const queue_ref_table<value_type> *table() noexcept
+	{
+		static const queue_ref_table<value_type> table = {
+			close,
+			is_closed,
+			is_empty,
+			is_full,
+			is_lock_free,
+			copy_ops::push,
+			copy_ops::wait_push,
+			copy_ops::try_push,
+			copy_ops::nonblocking_push,
+			move_push,
+			move_wait_push,
+			move_try_push,
+			move_nonblocking_push,
+			value_pop,
+			wait_pop,
+			try_pop,
+			nonblocking_pop,
+		};
+		return &table;
+	}
+};
+
 } // namespace detail
 
+//
+// A type-erased reference to any queue with the given value type. Unlike
+// queue_base it needs no wrapper object and no virtual inheritance. It is
+// just a pair of pointers, to the queue and to the function table of the
+// queue type. So a call is a single indirect jump, which the compiler may
+// inline if it sees where the reference comes from.
+//
+// The reference does not own the queue. It is cheap to copy and to pass
+// by value. For move-only values only the move pushes are available.
+//
+
+template <typename Value>
+class queue_ref
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	using iterator = detail::queue_move_iterator<queue_ref>;
+
+private:
+	// The copy pushes take this type, which is only defined for copyable
+	// values. It is not deduced so V is always the value type.
+	template <typename V>
+	using copy_argument =
+		typename std::enable_if<std::is_copy_constructible<V>::value, V>::type;
+
+public:
+	constexpr queue_ref() noexcept = default;
+
+	template <typename Queue,
+		  typename = typename std::enable_if<
+			  !std::is_same<Queue, queue_ref>::value>::type>
+	queue_ref(Queue &queue) noexcept
+		: queue_(&queue), table_(detail::queue_ref_ops<Queue>::table())
+	{
+		static_assert(std::is_same<typename Queue::value_type, value_type>::value,
+			      "queue_ref value_type must match the queue");
+	}
+
+	queue_ref(const queue_ref &other) noexcept = default;
+	queue_ref &operator=(const queue_ref &other) noexcept = default;
+
+	bool has_queue() const noexcept
+	{
+		return queue_ != nullptr;
+	}
+
+	void close()
+	{
+		table_->close(queue_);
+	}
+
+	bool is_closed()
+	{
+		return table_->is_closed(queue_);
+	}
+	bool is_empty()
+	{
+		return table_->is_empty(queue_);
+	}
+	bool is_full()
+	{
+		return table_->is_full(queue_);
+	}
+	bool is_lock_free()
+	{
+		return table_->is_lock_free(queue_);
+	}
+
+	// Pops values until the queue is closed.
+	iterator begin()
+	{
+		return iterator(*this);
+	}
+	iterator end()
+	{
+		return iterator();
+	}
+
+	template <typename V = value_type>
+	void push(const copy_argument<V> &value)
+	{
+		table_->push(queue_, value);
+	}
+	template <typename V = value_type>
+	queue_op_status wait_push(const copy_argument<V> &value)
+	{
+		return table_->wait_push(queue_, value);
+	}
+	template <typename V = value_type>
+	queue_op_status try_push(const copy_argument<V> &value)
+	{
+		return table_->try_push(queue_, value);
+	}
+	template <typename V = value_type>
+	queue_op_status nonblocking_push(const copy_argument<V> &value)
+	{
+		return table_->nonblocking_push(queue_, value);
+	}
+
+	void push(value_type &&value)
+	{
+		table_->move_push(queue_, std::move(value));
+	}
+	queue_op_status wait_push(value_type &&value)
+	{
+		return table_->move_wait_push(queue_, std::move(value));
+	}
+	queue_op_status try_push(value_type &&value)
+	{
+		return table_->move_try_push(queue_, std::move(value));
+	}
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		return table_->move_nonblocking_push(queue_, std::move(value));
+	}
+
+	value_type value_pop()
+	{
+		return table_->value_pop(queue_);
+	}
+	queue_op_status wait_pop(value_type &value)
+	{
+		return table_->wait_pop(queue_, value);
+	}
+	queue_op_status try_pop(value_type &value)
+	{
+		return table_->try_pop(queue_, value);
+	}
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		return table_->nonblocking_pop(queue_, value);
+	}
+
+private:
+	void *queue_ = nullptr;
+	const detail::queue_ref_table<value_type> *table_ = nullptr;
+};
+
 template <typename Queue>
 class generic_queue_back
 {
@@ -380,7 +773,7 @@ public:
 
 	iterator begin()
 	{
-		return iterator(*this);
+		return iterator(*queue_);
 	}
 	iterator end()
 	{
@@ -388,26 +781,26 @@ public:
 	}
 	const_iterator cbegin()
 	{
-		return const_iterator(*this);
+		return const_iterator(*queue_);
 	}
 	const_iterator cend()
 	{
 		return const_iterator();
 	}
 
-	void push(const value_type &value) override
+	void push(const value_type &value)
 	{
 		queue_->push(value);
 	}
-	queue_op_status wait_push(const value_type &value) override
+	queue_op_status wait_push(const value_type &value)
 	{
 		return queue_->wait_push(value);
 	}
-	queue_op_status try_push(const value_type &value) override
+	queue_op_status try_push(const value_type &value)
 	{
 		return queue_->try_push(value);
 	}
-	queue_op_status nonblocking_push(const value_type &value) override
+	queue_op_status nonblocking_push(const value_type &value)
 	{
 		return queue_->nonblocking_push(value);
 	}
@@ -416,7 +809,7 @@ public:
 	{
 		queue_->push(std::move(value));
 	}
-	queue_op_status wait_push(value_type &&value) override
+	queue_op_status wait_push(value_type &&value)
 	{
 		return queue_->wait_push(std::move(value));
 	}
@@ -485,7 +878,7 @@ public:
 
 	iterator begin()
 	{
-		return iterator(*this);
+		return iterator(*queue_);
 	}
 	iterator end()
 	{
@@ -493,7 +886,7 @@ public:
 	}
 	const_iterator cbegin()
 	{
-		return const_iterator(*this);
+		return const_iterator(*queue_);
 	}
 	const_iterator cend()
 	{
@@ -0,0 +1,225 @@
+//
+// Hardware Lock Elision
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+
+#ifndef EVENK_ELIDED_LOCK_H_
+#define EVENK_ELIDED_LOCK_H_
+
+//
+// A lock adapter that runs critical sections as RTM transactions. The lock
+// word is only read inside a transaction so critical sections that do not
+// touch the same data run in parallel. If a transaction aborts a few times
+// in a row the adapter acquires the wrapped lock for real. The transaction
+// also aborts if it sees the lock held, so it never overlaps with a thread
+// holding the lock.
+//
+// The wrapped lock must have the is_locked() member function. Its backoff
+// policy is used only for the real acquisition.
+//
+// The abort path may count the aborts by cause with a Stats policy, see
+// stats.h. Nothing is counted inside a transaction.
+//
+// Without RTM support in the compiler the adapter always takes the wrapped
+// lock. With no RTM in the CPU it does the same after a single CPUID check.
+//
+
+#include <cstdint>
+
+#include "backoff.h"
+#include "basic.h"
+#include "stats.h"
+
+#if (defined(__x86_64__) || defined(__i386__))                                                  \
+	&& ((defined(__clang__) && __clang_major__ >= 4) || (!defined(__clang__) && __GNUC__ >= 5))
+#define EVENK_HAVE_RTM 1
+#endif
+
+namespace evenk {
+
+template <typename Lock, typename Stats = no_stats>
+class elided_lock : non_copyable, Stats
+{
+public:
+	using lock_type = Lock;
+	using stats_type = Stats;
+
+	static constexpr std::uint32_t default_attempts = 3;
+
+	explicit elided_lock(std::uint32_t attempts = default_attempts) noexcept
+		: attempts_{attempts}
+	{
+	}
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		if (elide())
+			return;
+		Stats::add(stat_fallback);
+		lock_.lock(backoff);
+	}
+
+	bool try_lock()
+	{
+		if (elide())
+			return true;
+		Stats::add(stat_fallback);
+		return lock_.try_lock();
+	}
+
+	void unlock()
+	{
+#if EVENK_HAVE_RTM
+		if (supported() && test()) {
+			end();
+			return;
+		}
+#endif
+		lock_.unlock();
+	}
+
+	// Tells if the calling thread runs a critical section speculatively.
+	bool is_elided() const noexcept
+	{
+#if EVENK_HAVE_RTM
+		return supported() && test();
+#else
+		return false;
+#endif
+	}
+
+	lock_type &wrapped_lock() noexcept
+	{
+		return lock_;
+	}
+
+	stats_type &stats()
+	{
+		return *this;
+	}
+
+	const stats_type &stats() const
+	{
+		return *this;
+	}
+
+	static bool supported() noexcept
+	{
+#if EVENK_HAVE_RTM
+		static const bool rtm = detect();
+		return rtm;
+#else
+		return false;
+#endif
+	}
+
+private:
+#if EVENK_HAVE_RTM
+	// The abort code for a lock found held inside a transaction.
+	static constexpr unsigned busy_code = 0xff;
+
+	// How long to wait for a held lock to get free before the next attempt.
+	static constexpr std::uint32_t busy_spins = 128;
+
+	bool elide()
+	{
+		if (!supported())
+			return false;
+		for (std::uint32_t attempt = 0; attempt < attempts_; attempt++) {
+			unsigned status = begin();
+			if (status == _XBEGIN_STARTED) {
+				if (!lock_.is_locked())
+					return true;
+				abort_busy();
+			}
+
+			Stats::add(stat_abort);
+			if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == busy_code) {
+				Stats::add(stat_abort_busy);
+				// Let the owner go rather than abort again at once.
+				for (std::uint32_t n = busy_spins; n && lock_.is_locked(); n--)
+					cpu_relax{}(1);
+				continue;
+			}
+			if (status & _XABORT_CONFLICT)
+				Stats::add(stat_abort_conflict);
+			if (status & _XABORT_CAPACITY)
+				Stats::add(stat_abort_capacity);
+			// The CPU tells if a retry might succeed.
+			if (!(status & _XABORT_RETRY))
+				break;
+		}
+		return false;
+	}
+
+	__attribute__((target("rtm"))) static unsigned begin() noexcept
+	{
+		return _xbegin();
+	}
+
+	__attribute__((target("rtm"))) static void end() noexcept
+	{
+		_xend();
+	}
+
+	__attribute__((target("rtm"))) static void abort_busy() noexcept
+	{
+		_xabort(busy_code);
+	}
+
+	__attribute__((target("rtm"))) static bool test() noexcept
+	{
+		return _xtest() != 0;
+	}
+
+	// The __get_cpuid_count() helper appeared only in GCC 7, so check the
+	// leaf by hand.
+	static bool detect() noexcept
+	{
+		if (__get_cpuid_max(0, nullptr) < 7)
+			return false;
+		unsigned eax, ebx, ecx, edx;
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		// CPUID.(EAX=07H, ECX=0):EBX.RTM[bit 11]
+		return (ebx & (1u << 11)) != 0;
+	}
+#else
+	bool elide() noexcept
+	{
+		return false;
+	}
+#endif
+
+	lock_type lock_;
+	const std::uint32_t attempts_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_ELIDED_LOCK_H_
@@ -27,7 +27,10 @@
 
 #include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <ctime>
 
 #if __linux__
 #include <linux/futex.h>
@@ -35,12 +38,32 @@
 #include <unistd.h>
 #endif
 
+#include "basic.h"
+
 namespace evenk {
 
 typedef std::atomic<std::uint32_t> futex_t;
 
+//
+// A private futex may only be used by the threads of a single process. This
+// lets the kernel skip the lookup of the backing memory object. A shared
+// futex works for any processes that map the same memory.
+//
+
+enum futex_scope { futex_private, futex_shared };
+
+#if __linux__
+constexpr int
+futex_op(int op, futex_scope scope)
+{
+	return scope == futex_private ? (op | FUTEX_PRIVATE_FLAG) : op;
+}
+#endif
+
 inline int
-futex_wait(futex_t &futex __attribute__((unused)), std::uint32_t value __attribute__((unused)))
+futex_wait(futex_t &futex __attribute__((unused)),
+	   std::uint32_t value __attribute__((unused)),
+	   futex_scope scope __attribute__((unused)) = futex_private)
 {
 #if __linux__
 #if __x86_64__
@@ -48,11 +71,58 @@ futex_wait(futex_t &futex __attribute__((unused)), std::uint32_t value __attribu
 	__asm__ __volatile__("xor %%r10, %%r10\n\t"
 			     "syscall"
 			     : "=a"(result), "+m"(futex)
-			     : "0"(SYS_futex), "D"(&futex), "S"(FUTEX_WAIT_PRIVATE), "d"(value)
+			     : "0"(SYS_futex), "D"(&futex), "S"(futex_op(FUTEX_WAIT, scope)), "d"(value)
 			     : "cc", "rcx", "r10", "r11", "memory");
 	return (result > (unsigned) -4096) ? (int) result : 0;
 #else
-	if (syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) == -1)
+	if (syscall(SYS_futex, &futex, futex_op(FUTEX_WAIT, scope), value, NULL, NULL, 0) == -1)
+		return -errno;
+	else
+		return 0;
+#endif
+#else
+	return -ENOSYS;
+#endif
+}
+
+//
+// Wait with an absolute CLOCK_MONOTONIC deadline. Returns -ETIMEDOUT if the
+// deadline is passed. As the deadline is absolute a wait that is restarted
+// after a spurious wakeup does not extend the total waiting time.
+//
+
+inline int
+futex_wait_until(futex_t &futex __attribute__((unused)),
+		 std::uint32_t value __attribute__((unused)),
+		 const struct timespec *abs_time __attribute__((unused)),
+		 futex_scope scope __attribute__((unused)) = futex_private)
+{
+#if __linux__
+#if __x86_64__
+	unsigned result;
+	register const struct timespec *arg4 __asm__("r10") = abs_time;
+	register void *arg5 __asm__("r8") = nullptr;
+	register int arg6 __asm__("r9") = FUTEX_BITSET_MATCH_ANY;
+	__asm__ __volatile__("syscall"
+			     : "=a"(result), "+m"(futex)
+			     : "0"(SYS_futex),
+			       "D"(&futex),
+			       "S"(futex_op(FUTEX_WAIT_BITSET, scope)),
+			       "d"(value),
+			       "r"(arg4),
+			       "r"(arg5),
+			       "r"(arg6)
+			     : "cc", "rcx", "r11", "memory");
+	return (result > (unsigned) -4096) ? (int) result : 0;
+#else
+	if (syscall(SYS_futex,
+		    &futex,
+		    futex_op(FUTEX_WAIT_BITSET, scope),
+		    value,
+		    abs_time,
+		    NULL,
+		    FUTEX_BITSET_MATCH_ANY)
+	    == -1)
 		return -errno;
 	else
 		return 0;
@@ -62,19 +132,44 @@ futex_wait(futex_t &futex __attribute__((unused)), std::uint32_t value __attribu
 #endif
 }
 
+template <typename Clock, typename Duration>
+inline int
+futex_wait_until(futex_t &futex,
+		 std::uint32_t value,
+		 const std::chrono::time_point<Clock, Duration> &abs_time,
+		 futex_scope scope = futex_private)
+{
+	// The steady clock is backed by CLOCK_MONOTONIC.
+	struct timespec ts = to_timespec<std::chrono::steady_clock>(abs_time);
+	return futex_wait_until(futex, value, &ts, scope);
+}
+
+template <typename Rep, typename Period>
+inline int
+futex_wait_for(futex_t &futex,
+	       std::uint32_t value,
+	       const std::chrono::duration<Rep, Period> &rel_time,
+	       futex_scope scope = futex_private)
+{
+	return futex_wait_until(
+		futex, value, std::chrono::steady_clock::now() + rel_time, scope);
+}
+
 inline int
-futex_wake(futex_t &futex __attribute__((unused)), int count __attribute__((unused)))
+futex_wake(futex_t &futex __attribute__((unused)),
+	   int count __attribute__((unused)),
+	   futex_scope scope __attribute__((unused)) = futex_private)
 {
 #if __linux__
 #if __x86_64__
 	unsigned result;
 	__asm__ __volatile__("syscall"
 			     : "=a"(result), "+m"(futex)
-			     : "0"(SYS_futex), "D"(&futex), "S"(FUTEX_WAKE_PRIVATE), "d"(count)
+			     : "0"(SYS_futex), "D"(&futex), "S"(futex_op(FUTEX_WAKE, scope)), "d"(count)
 			     : "cc", "rcx", "r11");
 	return (result > (unsigned) -4096) ? (int) result : 0;
 #else
-	if (syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) == -1)
+	if (syscall(SYS_futex, &futex, futex_op(FUTEX_WAKE, scope), count, NULL, NULL, 0) == -1)
 		return -errno;
 	else
 		return 0;
@@ -88,7 +183,8 @@ inline int
 futex_requeue(futex_t &futex __attribute__((unused)),
 	      int futex_count __attribute__((unused)),
 	      int queue_count __attribute__((unused)),
-	      futex_t &queue __attribute__((unused)))
+	      futex_t &queue __attribute__((unused)),
+	      futex_scope scope __attribute__((unused)) = futex_private)
 {
 #if __linux__
 #if __x86_64__
@@ -99,7 +195,7 @@ futex_requeue(futex_t &futex __attribute__((unused)),
 			     : "=a"(result), "+m"(futex)
 			     : "0"(SYS_futex),
 			       "D"(&futex),
-			       "S"(FUTEX_REQUEUE_PRIVATE),
+			       "S"(futex_op(FUTEX_REQUEUE, scope)),
 			       "d"(futex_count),
 			       "r"(arg4),
 			       "r"(arg5)
@@ -108,7 +204,7 @@ futex_requeue(futex_t &futex __attribute__((unused)),
 #else
 	if (syscall(SYS_futex,
 		    &futex,
-		    FUTEX_REQUEUE_PRIVATE,
+		    futex_op(FUTEX_REQUEUE, scope),
 		    futex_count,
 		    queue_count,
 		    &queue,
@@ -128,7 +224,8 @@ futex_requeue(futex_t &futex __attribute__((unused)),
 	      int futex_count __attribute__((unused)),
 	      int queue_count __attribute__((unused)),
 	      futex_t &queue __attribute__((unused)),
-	      std::uint32_t futex_value __attribute__((unused)))
+	      std::uint32_t futex_value __attribute__((unused)),
+	      futex_scope scope __attribute__((unused)) = futex_private)
 {
 #if __linux__
 #if __x86_64__
@@ -140,7 +237,7 @@ futex_requeue(futex_t &futex __attribute__((unused)),
 			     : "=a"(result), "+m"(futex)
 			     : "0"(SYS_futex),
 			       "D"(&futex),
-			       "S"(FUTEX_CMP_REQUEUE_PRIVATE),
+			       "S"(futex_op(FUTEX_CMP_REQUEUE, scope)),
 			       "d"(futex_count),
 			       "r"(arg4),
 			       "r"(arg5),
@@ -150,7 +247,7 @@ futex_requeue(futex_t &futex __attribute__((unused)),
 #else
 	if (syscall(SYS_futex,
 		    &futex,
-		    FUTEX_CMP_REQUEUE_PRIVATE,
+		    futex_op(FUTEX_CMP_REQUEUE, scope),
 		    futex_count,
 		    queue_count,
 		    &queue,
@@ -0,0 +1,327 @@
+//
+// Memory Placement
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_MEMORY_H_
+#define EVENK_MEMORY_H_
+
+//
+// Ring memory allocators. An allocator is a small copyable object with the
+// following member functions:
+//
+//   void *allocate(std::size_t size);
+//   void deallocate(void *ptr, std::size_t size);
+//
+// The allocated memory must be aligned to the cache line size.
+//
+// Besides the plain heap there are allocators that back a ring with huge
+// pages or place it on particular NUMA nodes. Both pre-fault the memory.
+//
+// The NUMA support talks to the kernel directly rather than via libnuma.
+// On a system without NUMA everything lives on node 0.
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+#if __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "basic.h"
+
+namespace evenk {
+
+class heap_allocator
+{
+public:
+	void *allocate(std::size_t size)
+	{
+		void *ptr;
+		if (::posix_memalign(&ptr, cache_line_size, size))
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void deallocate(void *ptr, std::size_t)
+	{
+		std::free(ptr);
+	}
+};
+
+//
+// Page Support
+//
+
+// Pages are never less than this.
+constexpr std::size_t min_page_size = 4096;
+
+// Touch every page of fresh memory to get it faulted in right away.
+inline void
+prefault_memory(void *ptr, std::size_t size) noexcept
+{
+	volatile char *data = static_cast<char *>(ptr);
+	for (std::size_t offset = 0; offset < size; offset += min_page_size)
+		data[offset] = 0;
+}
+
+// The default huge page size, zero if unknown.
+inline std::size_t
+huge_page_size()
+{
+	static const std::size_t size = [] {
+		std::size_t size = 0;
+#if __linux__
+		std::FILE *file = std::fopen("/proc/meminfo", "r");
+		if (file != nullptr) {
+			char line[128];
+			unsigned long kbytes;
+			while (std::fgets(line, sizeof line, file) != nullptr) {
+				if (std::sscanf(line, "Hugepagesize: %lu kB", &kbytes) == 1) {
+					size = kbytes * 1024;
+					break;
+				}
+			}
+			std::fclose(file);
+		}
+#endif
+		return size;
+	}();
+	return size;
+}
+
+//
+// An allocator for large rings that backs them with huge pages. This saves
+// the page faults and TLB misses of a first pass through the ring.
+//
+// The memory comes from the reserved huge page pool if possible. Otherwise
+// it is regular memory with a transparent huge page hint, so it may still
+// get huge pages unless THP is disabled. In both cases the memory is
+// faulted in at once and optionally locked. A failed lock is ignored as
+// it only means that the process is over its memlock limit.
+//
+// The size is rounded up to whole huge pages so this is most useful when
+// the ring covers at least a few of them.
+//
+
+class huge_page_allocator
+{
+public:
+	explicit huge_page_allocator(bool lock = false) noexcept : lock_{lock}
+	{
+	}
+
+	void *allocate(std::size_t size)
+	{
+#if __linux__
+		size = round_size(size);
+		void *ptr = ::mmap(nullptr,
+				   size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				   -1,
+				   0);
+		if (ptr == MAP_FAILED) {
+			ptr = ::mmap(nullptr,
+				     size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS,
+				     -1,
+				     0);
+			if (ptr == MAP_FAILED)
+				throw std::bad_alloc();
+			::madvise(ptr, size, MADV_HUGEPAGE);
+		}
+		prefault_memory(ptr, size);
+		if (lock_)
+			::mlock(ptr, size);
+		return ptr;
+#else
+		return heap_allocator().allocate(size);
+#endif
+	}
+
+	void deallocate(void *ptr, std::size_t size)
+	{
+#if __linux__
+		::munmap(ptr, round_size(size));
+#else
+		heap_allocator().deallocate(ptr, size);
+#endif
+	}
+
+private:
+	static std::size_t round_size(std::size_t size)
+	{
+		std::size_t page_size = huge_page_size();
+		if (page_size == 0)
+			page_size = min_page_size;
+		return (size + page_size - 1) & ~(page_size - 1);
+	}
+
+	bool lock_;
+};
+
+//
+// NUMA Topology
+//
+
+constexpr std::size_t max_numa_nodes = 256;
+
+// The number of nodes that may be online.
+inline std::size_t
+numa_node_count()
+{
+	static const std::size_t count = [] {
+		std::size_t count = 1;
+#if __linux__
+		// The file holds a list of node ranges like "0-1,3".
+		std::FILE *file = std::fopen("/sys/devices/system/node/online", "r");
+		if (file != nullptr) {
+			unsigned long node;
+			while (std::fscanf(file, "%lu", &node) == 1) {
+				if (node < max_numa_nodes && node >= count)
+					count = node + 1;
+				if (std::fgetc(file) == EOF)
+					break;
+			}
+			std::fclose(file);
+		}
+#endif
+		return count;
+	}();
+	return count;
+}
+
+// The node of the CPU the calling thread runs on at the moment.
+inline std::size_t
+numa_current_node()
+{
+#if __linux__
+	unsigned cpu, node;
+	if (::syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+		return node;
+#endif
+	return 0;
+}
+
+//
+// A NUMA-aware allocator. The memory is mapped, given a placement policy,
+// and then pre-faulted by the allocating thread. The local policy relies
+// on the first touch by that thread alone. The node policy binds memory
+// to a given node. The interleaved policy spreads pages over all nodes.
+//
+// If the kernel refuses the policy the memory keeps the default placement.
+//
+
+class numa_allocator
+{
+public:
+	numa_allocator() noexcept : policy_{local}, node_{0}
+	{
+	}
+
+	static numa_allocator on_node(std::size_t node)
+	{
+		if (node >= numa_node_count())
+			throw std::invalid_argument("numa_allocator node is not online");
+		return numa_allocator(bound, node);
+	}
+
+	static numa_allocator interleaved() noexcept
+	{
+		return numa_allocator(interleave, 0);
+	}
+
+	void *allocate(std::size_t size)
+	{
+#if __linux__
+		void *ptr = ::mmap(nullptr,
+				   size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS,
+				   -1,
+				   0);
+		if (ptr == MAP_FAILED)
+			throw std::bad_alloc();
+		if (policy_ != local)
+			bind(ptr, size);
+		prefault_memory(ptr, size);
+		return ptr;
+#else
+		return heap_allocator().allocate(size);
+#endif
+	}
+
+	void deallocate(void *ptr, std::size_t size)
+	{
+#if __linux__
+		::munmap(ptr, size);
+#else
+		heap_allocator().deallocate(ptr, size);
+#endif
+	}
+
+private:
+	enum policy_type { local, bound, interleave };
+
+	numa_allocator(policy_type policy, std::size_t node) noexcept
+		: policy_{policy}, node_{node}
+	{
+	}
+
+#if __linux__
+	void bind(void *ptr, std::size_t size) const noexcept
+	{
+		constexpr std::size_t word_bits = 8 * sizeof(unsigned long);
+		unsigned long mask[max_numa_nodes / word_bits] = {};
+
+		int mode;
+		if (policy_ == bound) {
+			mode = MPOL_BIND;
+			mask[node_ / word_bits] |= 1ul << (node_ % word_bits);
+		} else {
+			mode = MPOL_INTERLEAVE;
+			for (std::size_t node = 0; node < numa_node_count(); node++)
+				mask[node / word_bits] |= 1ul << (node % word_bits);
+		}
+
+		// The kernel takes one less than the given number of mask bits.
+		::syscall(SYS_mbind, ptr, size, mode, mask, max_numa_nodes + 1, 0);
+	}
+#endif
+
+	policy_type policy_;
+	std::size_t node_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_MEMORY_H_
@@ -0,0 +1,384 @@
+//
+// Stage Pipeline
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+
+#ifndef EVENK_PIPELINE_H_
+#define EVENK_PIPELINE_H_
+
+//
+// A chain of stages connected with queues. Every stage runs a function on
+// a number of worker threads. A worker pops a batch of values from the
+// input queue, applies the function to each of them, and pushes all the
+// results to the output queue at once. The queues must have the bulk
+// operations of bounded_queue or synch_queue. Idle workers wait in the
+// queues so with more workers than CPUs the queues had better park rather
+// than spin, e.g. bounded_queue with bq_futex_slot.
+//
+//   evenk::pipeline p;
+//   auto input = p.input<evenk::bounded_queue<int>>(1024);
+//   input.stage<evenk::bounded_queue<std::string>>(
+//		"format", 4, [](int v) { return std::to_string(v); }, 1024)
+//	.sink("print", 1, [](std::string s) { std::puts(s.c_str()); });
+//   input.queue().push(42);
+//   p.close();
+//   p.wait();
+//
+// Closing the input queue shuts the pipeline down in order. The workers of
+// a stage drain its input queue. The last one to finish closes the output
+// queue, and so on down the chain.
+//
+// The gauges tell the current input queue depth and the number of values
+// processed by every stage. A stage with a deep input queue is the one that
+// holds the pipeline back.
+//
+// Every worker has its own copy of the stage function. If it throws an
+// exception std::terminate() is called as with std::thread.
+//
+// The values that leave the last queue must be taken by a sink or by the
+// user. Otherwise the pipeline stalls once that queue is full and it can't
+// be shut down.
+//
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "basic.h"
+#include "conqueue.h"
+
+namespace evenk {
+
+struct pipeline_gauge
+{
+	std::string name;
+	std::size_t workers;
+	// Values waiting in the stage input queue.
+	std::size_t depth;
+	// Values done by the stage.
+	std::uint64_t processed;
+};
+
+class pipeline;
+
+//
+// A handle to a pipeline queue used to add the stage that pops from it.
+// Only one stage may be added to a given queue.
+//
+
+template <typename Queue>
+class pipeline_link
+{
+public:
+	using queue_type = Queue;
+	using value_type = typename queue_type::value_type;
+
+	queue_type &queue() const noexcept
+	{
+		return *queue_;
+	}
+
+	// Add a stage that maps every value to a value pushed to a new queue
+	// constructed with the given arguments.
+	template <typename OutQueue, typename Function, typename... Args>
+	pipeline_link<OutQueue> stage(const std::string &name,
+				      std::size_t nworkers,
+				      Function function,
+				      Args &&... args);
+
+	// Add the final stage that consumes every value.
+	template <typename Function>
+	void sink(const std::string &name, std::size_t nworkers, Function function);
+
+private:
+	friend class pipeline;
+
+	template <typename OtherQueue>
+	friend class pipeline_link;
+
+	pipeline_link(pipeline *owner, queue_type *queue) noexcept : owner_(owner), queue_(queue)
+	{
+	}
+
+	pipeline *owner_;
+	queue_type *queue_;
+};
+
+class pipeline : non_copyable
+{
+public:
+	static constexpr std::size_t default_batch_size = 32;
+
+	explicit pipeline(std::size_t batch_size = default_batch_size) : batch_size_{batch_size}
+	{
+		if (batch_size == 0)
+			throw std::invalid_argument("pipeline batch size must not be zero");
+	}
+
+	~pipeline()
+	{
+		close();
+		wait();
+	}
+
+	// Create the queue that feeds the first stage.
+	template <typename Queue, typename... Args>
+	pipeline_link<Queue> input(Args &&... args)
+	{
+		if (close_input_)
+			throw std::logic_error("pipeline already has an input queue");
+		Queue *queue = make_queue<Queue>(std::forward<Args>(args)...);
+		close_input_ = [queue] { queue->close(); };
+		return pipeline_link<Queue>(this, queue);
+	}
+
+	// Close the input queue. The stages finish with the values already
+	// in the pipeline.
+	void close()
+	{
+		if (close_input_)
+			close_input_();
+	}
+
+	// Wait for all the stages to finish.
+	void wait()
+	{
+		for (auto &stage : stages_) {
+			for (auto &thread : stage->threads) {
+				if (thread.joinable())
+					thread.join();
+			}
+		}
+	}
+
+	std::vector<pipeline_gauge> gauges() const
+	{
+		std::vector<pipeline_gauge> gauges;
+		gauges.reserve(stages_.size());
+		for (auto &stage : stages_)
+			gauges.push_back(pipeline_gauge{stage->name,
+							stage->threads.size(),
+							stage->depth(),
+							stage->processed.load(std::memory_order_relaxed)});
+		return gauges;
+	}
+
+private:
+	template <typename Queue>
+	friend class pipeline_link;
+
+	struct queue_holder_base
+	{
+		virtual ~queue_holder_base() = default;
+	};
+
+	template <typename Queue>
+	struct queue_holder : queue_holder_base
+	{
+		template <typename... Args>
+		explicit queue_holder(Args &&... args) : queue(std::forward<Args>(args)...)
+		{
+		}
+
+		// A queue may be aligned to the cache line size.
+		static void *operator new(std::size_t size)
+		{
+			void *ptr;
+			if (::posix_memalign(&ptr, alignof(queue_holder), size))
+				throw std::bad_alloc();
+			return ptr;
+		}
+
+		static void operator delete(void *ptr)
+		{
+			std::free(ptr);
+		}
+
+		Queue queue;
+	};
+
+	struct stage_state
+	{
+		std::string name;
+		std::function<std::size_t()> depth;
+		std::atomic<std::uint64_t> processed = ATOMIC_VAR_INIT(0);
+		std::atomic<std::size_t> running = ATOMIC_VAR_INIT(0);
+		std::function<void()> close_output;
+		std::vector<std::thread> threads;
+	};
+
+	template <typename Queue, typename... Args>
+	Queue *make_queue(Args &&... args)
+	{
+		std::unique_ptr<queue_holder<Queue>> holder(
+			new queue_holder<Queue>(std::forward<Args>(args)...));
+		Queue *queue = &holder->queue;
+		queues_.push_back(std::move(holder));
+		return queue;
+	}
+
+	// The stage holds a running count of its own while the workers are
+	// started so that none of them could close the output too early. If
+	// a thread fails to start the workers that did start drain the input
+	// and close the output, or else it is closed right here.
+	template <typename InQueue, typename Worker>
+	void add_stage(const std::string &name,
+		       std::size_t nworkers,
+		       InQueue *in,
+		       std::function<void()> close_output,
+		       Worker worker)
+	{
+		if (nworkers == 0)
+			throw std::invalid_argument("pipeline stage must have some workers");
+
+		std::unique_ptr<stage_state> stage(new stage_state);
+		stage->name = name;
+		stage->depth = [in] { return in->depth(); };
+		stage->close_output = std::move(close_output);
+		stage->running.store(1, std::memory_order_relaxed);
+
+		stage_state *state = stage.get();
+		stages_.push_back(std::move(stage));
+		try {
+			state->threads.reserve(nworkers);
+			for (std::size_t i = 0; i < nworkers; i++) {
+				state->running.fetch_add(1, std::memory_order_relaxed);
+				try {
+					state->threads.emplace_back(worker, state);
+				} catch (...) {
+					state->running.fetch_sub(1, std::memory_order_relaxed);
+					throw;
+				}
+			}
+		} catch (...) {
+			finish(state);
+			throw;
+		}
+		finish(state);
+	}
+
+	// The last worker of a stage to finish closes its output.
+	static void finish(stage_state *stage)
+	{
+		if (stage->running.fetch_sub(1, std::memory_order_acq_rel) == 1
+		    && stage->close_output)
+			stage->close_output();
+	}
+
+	template <typename InQueue, typename OutQueue, typename Function>
+	static void map_worker(stage_state *stage,
+			       InQueue *in,
+			       OutQueue *out,
+			       Function &function,
+			       std::size_t batch_size)
+	{
+		std::vector<typename InQueue::value_type> input;
+		std::vector<typename OutQueue::value_type> output;
+		input.reserve(batch_size);
+		output.reserve(batch_size);
+		while (in->wait_pop_bulk(std::back_inserter(input), batch_size)) {
+			for (auto &value : input)
+				output.push_back(function(std::move(value)));
+			out->push_bulk(std::make_move_iterator(output.begin()),
+				       std::make_move_iterator(output.end()));
+			stage->processed.fetch_add(input.size(), std::memory_order_relaxed);
+			input.clear();
+			output.clear();
+		}
+		finish(stage);
+	}
+
+	template <typename InQueue, typename Function>
+	static void sink_worker(stage_state *stage,
+				InQueue *in,
+				Function &function,
+				std::size_t batch_size)
+	{
+		std::vector<typename InQueue::value_type> input;
+		input.reserve(batch_size);
+		while (in->wait_pop_bulk(std::back_inserter(input), batch_size)) {
+			for (auto &value : input)
+				function(std::move(value));
+			stage->processed.fetch_add(input.size(), std::memory_order_relaxed);
+			input.clear();
+		}
+		finish(stage);
+	}
+
+	const std::size_t batch_size_;
+	std::function<void()> close_input_;
+	std::vector<std::unique_ptr<queue_holder_base>> queues_;
+	std::vector<std::unique_ptr<stage_state>> stages_;
+};
+
+template <typename Queue>
+template <typename OutQueue, typename Function, typename... Args>
+pipeline_link<OutQueue>
+pipeline_link<Queue>::stage(const std::string &name,
+			    std::size_t nworkers,
+			    Function function,
+			    Args &&... args)
+{
+	OutQueue *out = owner_->make_queue<OutQueue>(std::forward<Args>(args)...);
+	Queue *in = queue_;
+	const std::size_t batch_size = owner_->batch_size_;
+	owner_->add_stage(name,
+			  nworkers,
+			  in,
+			  [out] { out->close(); },
+			  [=](pipeline::stage_state *stage) mutable {
+				  pipeline::map_worker(stage, in, out, function, batch_size);
+			  });
+	return pipeline_link<OutQueue>(owner_, out);
+}
+
+template <typename Queue>
+template <typename Function>
+void
+pipeline_link<Queue>::sink(const std::string &name, std::size_t nworkers, Function function)
+{
+	Queue *in = queue_;
+	const std::size_t batch_size = owner_->batch_size_;
+	owner_->add_stage(name,
+			  nworkers,
+			  in,
+			  nullptr,
+			  [=](pipeline::stage_state *stage) mutable {
+				  pipeline::sink_worker(stage, in, function, batch_size);
+			  });
+}
+
+} // namespace evenk
+
+#endif // !EVENK_PIPELINE_H_
@@ -0,0 +1,333 @@
+//
+// Priority Lane Bounded Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_PRIORITY_BOUNDED_QUEUE_H_
+#define EVENK_PRIORITY_BOUNDED_QUEUE_H_
+
+//
+// A fixed number of bounded_queue lanes, lane 0 has the highest priority.
+// Producers push to the lane of their choice. Consumers always take from
+// the highest priority lane that has a value, so lower lanes may starve.
+//
+// The lanes are only used for non-blocking pops, an idle consumer sleeps
+// on a single event count that producers notify after every push. Thus
+// the lane Ticket type matters only for producers waiting for a free slot
+// in a full lane.
+//
+// The queue is closed when all the lanes are closed. A pop reports closed
+// when all the lanes are closed and empty.
+//
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+#include "synch.h"
+
+namespace evenk {
+
+template <typename Value,
+	  std::size_t Lanes,
+	  typename Ticket = bq_slot,
+	  typename Layout = bq_padded_layout>
+class priority_bounded_queue : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	using lane_type = bounded_queue<Value, Ticket, Layout>;
+
+	static_assert(Lanes > 0, "priority_bounded_queue requires some lanes");
+
+	// Every lane gets the given size.
+	priority_bounded_queue(std::uint32_t size)
+	{
+		std::size_t n = 0;
+		try {
+			for (; n < Lanes; n++)
+				new (&lanes_[n]) lane_type(size);
+		} catch (...) {
+			while (n)
+				lane(--n).~lane_type();
+			throw;
+		}
+	}
+
+	~priority_bounded_queue()
+	{
+		for (std::size_t i = 0; i < Lanes; i++)
+			lane(i).~lane_type();
+	}
+
+	static constexpr std::size_t lanes()
+	{
+		return Lanes;
+	}
+
+	void close()
+	{
+		for (std::size_t i = 0; i < Lanes; i++)
+			lane(i).close();
+		ready_.notify_all();
+	}
+
+	bool is_closed() const
+	{
+		return lane(Lanes - 1).is_closed();
+	}
+
+	bool is_empty() const
+	{
+		for (std::size_t i = 0; i < Lanes; i++) {
+			if (!lane(i).is_empty())
+				return false;
+		}
+		return true;
+	}
+
+	bool is_full(std::size_t priority) const
+	{
+		return lane(priority).is_full();
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	template <typename... Backoff>
+	void push(std::size_t priority, value_type &&value, Backoff... backoff)
+	{
+		lane(priority).push(std::move(value), std::forward<Backoff>(backoff)...);
+		ready_.notify_one();
+	}
+
+	template <typename... Backoff>
+	void push(std::size_t priority, const value_type &value, Backoff... backoff)
+	{
+		lane(priority).push(value, std::forward<Backoff>(backoff)...);
+		ready_.notify_one();
+	}
+
+	template <typename... Args>
+	void emplace(std::size_t priority, Args &&... args)
+	{
+		lane(priority).emplace(std::forward<Args>(args)...);
+		ready_.notify_one();
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(std::size_t priority, value_type &&value, Backoff... backoff)
+	{
+		return notify(lane(priority).wait_push(std::move(value),
+						       std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status
+	wait_push(std::size_t priority, const value_type &value, Backoff... backoff)
+	{
+		return notify(lane(priority).wait_push(value, std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(std::size_t priority, value_type &&value, Backoff... backoff)
+	{
+		return notify(lane(priority).try_push(std::move(value),
+						      std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status
+	try_push(std::size_t priority, const value_type &value, Backoff... backoff)
+	{
+		return notify(lane(priority).try_push(value, std::forward<Backoff>(backoff)...));
+	}
+
+	queue_op_status nonblocking_push(std::size_t priority, value_type &&value)
+	{
+		return notify(lane(priority).nonblocking_push(std::move(value)));
+	}
+
+	queue_op_status nonblocking_push(std::size_t priority, const value_type &value)
+	{
+		return notify(lane(priority).nonblocking_push(value));
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		bool waiting = false;
+		for (;;) {
+			auto status = try_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			if (waiting)
+				wait();
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		bool waiting = false;
+		for (;;) {
+			auto status = try_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			if (Clock::now() >= abs_time)
+				return queue_op_status::timeout;
+			if (waiting)
+				wait_until(abs_time);
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+	// Pop from the highest priority lane that is not empty.
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		std::size_t closed = 0;
+		for (std::size_t i = 0; i < Lanes; i++) {
+			auto status = lane(i).try_pop(value, backoff...);
+			if (status == queue_op_status::success)
+				return status;
+			if (status == queue_op_status::closed)
+				closed++;
+		}
+		return closed == Lanes ? queue_op_status::closed : queue_op_status::empty;
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		std::size_t closed = 0;
+		bool busy = false;
+		for (std::size_t i = 0; i < Lanes; i++) {
+			auto status = lane(i).nonblocking_pop(value);
+			if (status == queue_op_status::success)
+				return status;
+			if (status == queue_op_status::busy)
+				busy = true;
+			else if (status == queue_op_status::closed)
+				closed++;
+		}
+		if (busy)
+			return queue_op_status::busy;
+		return closed == Lanes ? queue_op_status::closed : queue_op_status::empty;
+	}
+
+private:
+	using lane_storage =
+		typename std::aligned_storage<sizeof(lane_type), alignof(lane_type)>::type;
+
+	lane_type &lane(std::size_t priority)
+	{
+		return *reinterpret_cast<lane_type *>(&lanes_[priority]);
+	}
+
+	const lane_type &lane(std::size_t priority) const
+	{
+		return *reinterpret_cast<const lane_type *>(&lanes_[priority]);
+	}
+
+	static bool give_up()
+	{
+		return true;
+	}
+
+	template <typename Backoff>
+	static bool give_up(Backoff &backoff)
+	{
+		return backoff();
+	}
+
+	queue_op_status notify(queue_op_status status)
+	{
+		if (status == queue_op_status::success)
+			ready_.notify_one();
+		return status;
+	}
+
+	// The lanes are checked after announcing the wait so that a push
+	// that comes in between is not missed.
+	void wait()
+	{
+		event_count::key_type key = ready_.prepare_wait();
+		if (!is_empty() || is_closed())
+			ready_.cancel_wait();
+		else
+			ready_.commit_wait(key);
+	}
+
+	template <typename Clock, typename Duration>
+	void wait_until(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		event_count::key_type key = ready_.prepare_wait();
+		if (!is_empty() || is_closed())
+			ready_.cancel_wait();
+		else
+			ready_.commit_wait_until(key, abs_time);
+	}
+
+	lane_storage lanes_[Lanes];
+
+	alignas(cache_line_size) event_count ready_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_PRIORITY_BOUNDED_QUEUE_H_
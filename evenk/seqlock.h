@@ -0,0 +1,159 @@
+//
+// Sequence Lock
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_SEQLOCK_H_
+#define EVENK_SEQLOCK_H_
+
+//
+// A seqlock keeps a small value that is read much more often than written.
+// Readers never write shared memory. They copy the value and retry if the
+// sequence number was odd, that is a write was in progress, or changed
+// meanwhile. Writers are serialized with a Lock of any kind.
+//
+// The value is kept as an array of atomic words accessed with relaxed
+// operations so that racing reads are well defined. See:
+//    H.-J. Boehm. Can Seqlocks Get Along With Programming Language Memory
+//    Models? MSPC 2012.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "backoff.h"
+#include "basic.h"
+#include "synch.h"
+
+namespace evenk {
+
+template <typename Value, typename Lock = default_synch::lock_type>
+class seqlock : non_copyable
+{
+public:
+	using value_type = Value;
+	using lock_type = Lock;
+
+	static_assert(std::is_trivially_copyable<Value>::value,
+		      "seqlock requires trivially copyable values");
+
+	seqlock() : seqlock(value_type())
+	{
+	}
+
+	explicit seqlock(const value_type &value) : sequence_{0}
+	{
+		write(value);
+	}
+
+	template <typename... Backoff>
+	value_type load(Backoff... backoff) const
+	{
+		value_type value;
+		while (!try_load(value))
+			pause(backoff...);
+		return value;
+	}
+
+	bool try_load(value_type &value) const
+	{
+		std::uint32_t sequence = sequence_.load(std::memory_order_acquire);
+		if (sequence & 1)
+			return false;
+		read(value);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return sequence == sequence_.load(std::memory_order_relaxed);
+	}
+
+	template <typename... Backoff>
+	void store(const value_type &value, Backoff... backoff)
+	{
+		lock_guard<lock_type> guard(lock_, std::forward<Backoff>(backoff)...);
+		locked_store(value);
+	}
+
+	// Modify the value in place, the function gets a reference to a copy
+	// of the current value.
+	template <typename Function, typename... Backoff>
+	void update(Function function, Backoff... backoff)
+	{
+		lock_guard<lock_type> guard(lock_, std::forward<Backoff>(backoff)...);
+		value_type value;
+		read(value);
+		function(value);
+		locked_store(value);
+	}
+
+private:
+	using word_type = std::uintptr_t;
+
+	static constexpr std::size_t nwords =
+		(sizeof(value_type) + sizeof(word_type) - 1) / sizeof(word_type);
+
+	static void pause()
+	{
+		cpu_relax()(1);
+	}
+
+	template <typename Backoff>
+	static void pause(Backoff &backoff)
+	{
+		backoff();
+	}
+
+	void locked_store(const value_type &value)
+	{
+		std::uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+		sequence_.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		write(value);
+		sequence_.store(sequence + 2, std::memory_order_release);
+	}
+
+	void read(value_type &value) const
+	{
+		word_type words[nwords];
+		for (std::size_t i = 0; i < nwords; i++)
+			words[i] = data_[i].load(std::memory_order_relaxed);
+		std::memcpy(&value, words, sizeof(value_type));
+	}
+
+	void write(const value_type &value)
+	{
+		word_type words[nwords] = {};
+		std::memcpy(words, &value, sizeof(value_type));
+		for (std::size_t i = 0; i < nwords; i++)
+			data_[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	std::atomic<std::uint32_t> sequence_;
+	std::atomic<word_type> data_[nwords];
+
+	// Keep the writers off the cache line the readers poll.
+	alignas(cache_line_size) lock_type lock_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_SEQLOCK_H_
@@ -0,0 +1,311 @@
+//
+// NUMA Sharded Bounded Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_SHARDED_QUEUE_H_
+#define EVENK_SHARDED_QUEUE_H_
+
+//
+// One bounded_queue per NUMA node with the ring memory bound to the node.
+// Producers push to the shard of their own node. Consumers pop from their
+// own shard first and steal from the other shards next. So values mostly
+// stay on the node where they were produced but there is no ordering among
+// values from different shards.
+//
+// The node of a thread is looked up on its first use of any sharded queue
+// and is not updated later. This works best if threads are pinned to CPUs.
+//
+// As with priority_bounded_queue an idle consumer sleeps on a single event
+// count that producers notify after every push.
+//
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+#include "memory.h"
+#include "synch.h"
+
+namespace evenk {
+
+template <typename Value, typename Ticket = bq_slot, typename Layout = bq_padded_layout>
+class sharded_queue : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	using shard_type = bounded_queue<Value, Ticket, Layout, numa_allocator>;
+
+	// Every shard gets the given size. The shards are placed on the nodes
+	// in turn.
+	sharded_queue(std::uint32_t size, std::size_t nshards = numa_node_count())
+	{
+		if (nshards == 0)
+			throw std::invalid_argument("sharded_queue requires some shards");
+
+		shards_.reserve(nshards);
+		for (std::size_t i = 0; i < nshards; i++)
+			shards_.emplace_back(size, numa_allocator::on_node(i % numa_node_count()));
+	}
+
+	std::size_t shards() const
+	{
+		return shards_.size();
+	}
+
+	// The shard of the calling thread.
+	std::size_t local_shard() const
+	{
+		static thread_local std::size_t node = numa_current_node();
+		return node % shards_.size();
+	}
+
+	void close()
+	{
+		for (auto &shard : shards_)
+			shard.close();
+		ready_.notify_all();
+	}
+
+	bool is_closed() const
+	{
+		return shards_.back().is_closed();
+	}
+
+	bool is_empty() const
+	{
+		for (auto &shard : shards_) {
+			if (!shard.is_empty())
+				return false;
+		}
+		return true;
+	}
+
+	// Tells if the local shard is full.
+	bool is_full() const
+	{
+		return shards_[local_shard()].is_full();
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	template <typename... Backoff>
+	void push(value_type &&value, Backoff... backoff)
+	{
+		shards_[local_shard()].push(std::move(value), std::forward<Backoff>(backoff)...);
+		ready_.notify_one();
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		shards_[local_shard()].push(value, std::forward<Backoff>(backoff)...);
+		ready_.notify_one();
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		return notify(shards_[local_shard()].wait_push(std::move(value),
+							       std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		return notify(shards_[local_shard()].wait_push(value,
+							       std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(value_type &&value, Backoff... backoff)
+	{
+		return notify(shards_[local_shard()].try_push(std::move(value),
+							      std::forward<Backoff>(backoff)...));
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(const value_type &value, Backoff... backoff)
+	{
+		return notify(shards_[local_shard()].try_push(value,
+							      std::forward<Backoff>(backoff)...));
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		return notify(shards_[local_shard()].nonblocking_push(std::move(value)));
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		return notify(shards_[local_shard()].nonblocking_push(value));
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		bool waiting = false;
+		for (;;) {
+			auto status = try_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			if (waiting)
+				wait();
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		bool waiting = false;
+		for (;;) {
+			auto status = try_pop(value);
+			if (status != queue_op_status::empty)
+				return status;
+			if (Clock::now() >= abs_time)
+				return queue_op_status::timeout;
+			if (waiting)
+				wait_until(abs_time);
+			else
+				waiting = give_up(backoff...);
+		}
+	}
+
+	// Pop from the local shard, or else steal from the others.
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		const std::size_t nshards = shards_.size();
+		const std::size_t local = local_shard();
+		std::size_t closed = 0;
+		for (std::size_t i = 0; i < nshards; i++) {
+			auto status = shards_[(local + i) % nshards].try_pop(value, backoff...);
+			if (status == queue_op_status::success)
+				return status;
+			if (status == queue_op_status::closed)
+				closed++;
+		}
+		return closed == nshards ? queue_op_status::closed : queue_op_status::empty;
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		const std::size_t nshards = shards_.size();
+		const std::size_t local = local_shard();
+		std::size_t closed = 0;
+		bool busy = false;
+		for (std::size_t i = 0; i < nshards; i++) {
+			auto status = shards_[(local + i) % nshards].nonblocking_pop(value);
+			if (status == queue_op_status::success)
+				return status;
+			if (status == queue_op_status::busy)
+				busy = true;
+			else if (status == queue_op_status::closed)
+				closed++;
+		}
+		if (busy)
+			return queue_op_status::busy;
+		return closed == nshards ? queue_op_status::closed : queue_op_status::empty;
+	}
+
+private:
+	static bool give_up()
+	{
+		return true;
+	}
+
+	template <typename Backoff>
+	static bool give_up(Backoff &backoff)
+	{
+		return backoff();
+	}
+
+	queue_op_status notify(queue_op_status status)
+	{
+		if (status == queue_op_status::success)
+			ready_.notify_one();
+		return status;
+	}
+
+	void wait()
+	{
+		event_count::key_type key = ready_.prepare_wait();
+		if (!is_empty() || is_closed())
+			ready_.cancel_wait();
+		else
+			ready_.commit_wait(key);
+	}
+
+	template <typename Clock, typename Duration>
+	void wait_until(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		event_count::key_type key = ready_.prepare_wait();
+		if (!is_empty() || is_closed())
+			ready_.cancel_wait();
+		else
+			ready_.commit_wait_until(key, abs_time);
+	}
+
+	std::vector<shard_type> shards_;
+
+	alignas(cache_line_size) event_count ready_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_SHARDED_QUEUE_H_
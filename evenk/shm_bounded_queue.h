@@ -0,0 +1,447 @@
+//
+// Shared Memory Bounded Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_SHM_BOUNDED_QUEUE_H_
+#define EVENK_SHM_BOUNDED_QUEUE_H_
+
+//
+// A bounded queue that is shared by several processes. The whole queue
+// state lives in a single memory region: a header followed by the ring.
+// There are no pointers in the region, the ring is found at a fixed offset
+// from the header, so every process may map the region at its own address.
+//
+// The region is set up once with create() and then the other processes
+// attach() to it. A queue object is just a process-local view of the region
+// and may be freely copied. The values are copied bytewise so they must be
+// trivially copyable and must not refer to process memory.
+//
+// The Ticket type has to work across processes too. This is true for the
+// bq_slot, bq_yield_slot, and bq_interprocess_futex_slot types. The other
+// ones keep their waiters in process memory and will not do here.
+//
+// The shm_region class maps an anonymous memfd file. Its descriptor may
+// be inherited by child processes or passed to unrelated processes over
+// a unix socket.
+//
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <typeinfo>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+
+namespace evenk {
+
+class shm_region : non_copyable
+{
+public:
+	// Create a new memory file of the given size and map it.
+	static shm_region create(std::size_t length, const char *name = "evenk")
+	{
+#if __linux__
+		int fd = ::memfd_create(name, 0);
+		if (fd < 0)
+			throw_system_error(errno, "memfd_create()");
+		if (::ftruncate(fd, length) < 0) {
+			int err_num = errno;
+			::close(fd);
+			throw_system_error(err_num, "ftruncate()");
+		}
+		return shm_region(fd, length);
+#else
+		(void) length;
+		(void) name;
+		throw_system_error(ENOSYS, "memfd_create()");
+#endif
+	}
+
+	// Map a memory file created by another process. The descriptor is
+	// owned by the region from now on.
+	static shm_region attach(int fd)
+	{
+		struct stat st;
+		if (::fstat(fd, &st) < 0)
+			throw_system_error(errno, "fstat()");
+		return shm_region(fd, st.st_size);
+	}
+
+	shm_region(shm_region &&other) noexcept
+		: fd_{other.fd_}, data_{other.data_}, size_{other.size_}
+	{
+		other.fd_ = -1;
+		other.data_ = nullptr;
+		other.size_ = 0;
+	}
+
+	~shm_region()
+	{
+		if (data_ != nullptr)
+			::munmap(data_, size_);
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	int fd() const noexcept
+	{
+		return fd_;
+	}
+
+	void *data() const noexcept
+	{
+		return data_;
+	}
+
+	std::size_t size() const noexcept
+	{
+		return size_;
+	}
+
+private:
+	shm_region(int fd, std::size_t size) : fd_{fd}, data_{nullptr}, size_{size}
+	{
+		void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			int err_num = errno;
+			::close(fd);
+			throw_system_error(err_num, "mmap()");
+		}
+		data_ = data;
+	}
+
+	int fd_;
+	void *data_;
+	std::size_t size_;
+};
+
+template <typename Value,
+	  typename Ticket = bq_interprocess_futex_slot,
+	  typename Layout = bq_padded_layout>
+class shm_bounded_queue : detail::bq_ticket_ring<shm_bounded_queue<Value, Ticket, Layout>>
+{
+	struct ring_slot;
+	using ticket_ring = detail::bq_ticket_ring<shm_bounded_queue>;
+
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	static_assert(std::is_trivially_copyable<Value>::value,
+		      "shm_bounded_queue requires trivially copyable values");
+	static_assert(std::is_same<typename Ticket::shared_state, bq_no_shared_state>::value,
+		      "shm_bounded_queue requires slots with no process-local state");
+
+	// The region length required for a queue of the given size.
+	static std::size_t region_size(std::uint32_t size)
+	{
+		return sizeof(region_header) + std::size_t(size) * sizeof(ring_slot);
+	}
+
+	// Set up a queue in a region. The region must be aligned to the cache
+	// line size, this is so for any mapping. No other process may use the
+	// region until this returns.
+	static shm_bounded_queue create(void *region, std::size_t length, std::uint32_t size)
+	{
+		if (size == 0 || (size & (size - 1)) != 0)
+			throw std::invalid_argument(
+				"shm_bounded_queue size must be a power of two");
+		if (length < region_size(size))
+			throw std::invalid_argument("shm_bounded_queue region is too small");
+		if ((reinterpret_cast<std::uintptr_t>(region) & (cache_line_size - 1)) != 0)
+			throw std::invalid_argument("shm_bounded_queue region is misaligned");
+
+		region_header *header = new (region) region_header();
+		header->tag = type_tag();
+		header->size = size;
+		header->slot_size = sizeof(ring_slot);
+
+		shm_bounded_queue queue(header);
+		for (std::uint32_t i = 0; i < size; i++)
+			new (&queue.ring_[i]) ring_slot();
+		for (std::uint32_t i = 0; i < size; i++)
+			queue.get_slot(i).initialize(i << bq_status_bits);
+
+		// Publish the queue to the processes that attach concurrently.
+		header->magic.store(region_magic, std::memory_order_release);
+		return queue;
+	}
+
+	// Use a queue that is set up by create() in this or another process.
+	static shm_bounded_queue attach(void *region, std::size_t length)
+	{
+		if (length < sizeof(region_header))
+			throw std::invalid_argument("shm_bounded_queue region is too small");
+
+		region_header *header = static_cast<region_header *>(region);
+		if (header->magic.load(std::memory_order_acquire) != region_magic)
+			throw std::invalid_argument("shm_bounded_queue region is not set up");
+		if (header->tag != type_tag() || header->slot_size != sizeof(ring_slot))
+			throw std::invalid_argument("shm_bounded_queue type mismatch");
+		if (length < region_size(header->size))
+			throw std::invalid_argument("shm_bounded_queue region is too small");
+		return shm_bounded_queue(header);
+	}
+
+	void close()
+	{
+		header_->closed.store(true, std::memory_order_relaxed);
+		for (std::uint32_t i = 0; i < mask_ + 1; i++)
+			ring_[i].wake();
+	}
+
+	bool is_closed() const
+	{
+		return header_->closed.load(std::memory_order_relaxed);
+	}
+
+	bool is_empty() const
+	{
+		std::uint64_t head = header_->head.load(std::memory_order_relaxed);
+		std::uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+		return tail <= head;
+	}
+
+	bool is_full() const
+	{
+		std::int64_t head = header_->head.load(std::memory_order_relaxed);
+		std::int64_t tail = header_->tail.load(std::memory_order_relaxed);
+		return tail - head > mask_;
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		const std::uint64_t tail = header_->tail.fetch_add(1, std::memory_order_relaxed);
+		ring_slot &slot = get_slot(tail);
+		wait_tail(slot, tail, std::forward<Backoff>(backoff)...);
+		put_value(slot, tail, value);
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(value, std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(const value_type &value, Backoff... backoff)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, true, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, value);
+		return status;
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		std::uint64_t tail;
+		auto status = claim_tail(tail, false);
+		if (status == queue_op_status::success)
+			put_value(get_slot(tail), tail, value);
+		return status;
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		const std::uint64_t head = header_->head.fetch_add(1, std::memory_order_relaxed);
+		ring_slot &slot = get_slot(head);
+		if (wait_head(slot, head, std::forward<Backoff>(backoff)...) == bq_closed)
+			return queue_op_status::closed;
+		get_value(slot, head, value);
+		return queue_op_status::success;
+	}
+
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	// As with bounded_queue a timed pop does not claim a ticket until
+	// there is a value for it.
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		return timed_pop([this, &value] { return nonblocking_pop(value); },
+				 abs_time,
+				 std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		std::uint64_t head;
+		bq_status slot_status;
+		auto status =
+			claim_head(head, slot_status, true, std::forward<Backoff>(backoff)...);
+		if (status == queue_op_status::success)
+			get_value(get_slot(head), head, value);
+		return status;
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		std::uint64_t head;
+		bq_status slot_status;
+		auto status = claim_head(head, slot_status, false);
+		if (status == queue_op_status::success)
+			get_value(get_slot(head), head, value);
+		return status;
+	}
+
+private:
+	friend ticket_ring;
+
+	using ticket_ring::claim_head;
+	using ticket_ring::claim_tail;
+	using ticket_ring::timed_pop;
+	using ticket_ring::wait_head;
+	using ticket_ring::wait_tail;
+
+	// Identifies a set up region, "EVNKSHMQ".
+	static constexpr std::uint64_t region_magic = 0x45564e4b53484d51;
+
+	struct region_header
+	{
+		std::atomic<std::uint64_t> magic = ATOMIC_VAR_INIT(0);
+		std::uint64_t tag = 0;
+		std::uint32_t size = 0;
+		std::uint32_t slot_size = 0;
+		std::atomic<bool> closed = ATOMIC_VAR_INIT(false);
+
+		alignas(cache_line_size) std::atomic<std::uint64_t> head = ATOMIC_VAR_INIT(0);
+		alignas(cache_line_size) std::atomic<std::uint64_t> tail = ATOMIC_VAR_INIT(0);
+	};
+
+	struct alignas(Layout::slot_alignment) alignas(Ticket) alignas(Value) ring_slot
+		: public Ticket
+	{
+		typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type
+			storage_;
+	};
+
+	static_assert(sizeof(region_header) % alignof(ring_slot) == 0,
+		      "shm_bounded_queue ring is misaligned");
+
+	explicit shm_bounded_queue(region_header *header) noexcept
+		: header_{header},
+		  ring_{reinterpret_cast<ring_slot *>(header + 1)},
+		  mask_{header->size - 1},
+		  layout_{header->size, sizeof(ring_slot)}
+	{
+	}
+
+	// Tells the queue types apart so that a region is not attached with
+	// other Value, Ticket, or Layout than it was created with. This is the
+	// FNV-1a hash of the mangled type name, processes built with the same
+	// compiler ABI agree on it.
+	static std::uint64_t type_tag()
+	{
+		std::uint64_t hash = 0xcbf29ce484222325;
+		for (const char *s = typeid(shm_bounded_queue).name(); *s; s++)
+			hash = (hash ^ std::uint8_t(*s)) * 0x100000001b3;
+		return hash;
+	}
+
+	ring_slot &get_slot(std::uint64_t index) const
+	{
+		return ring_[layout_.position(index & mask_)];
+	}
+
+	std::atomic<std::uint64_t> &head_counter()
+	{
+		return header_->head;
+	}
+
+	std::atomic<std::uint64_t> &tail_counter()
+	{
+		return header_->tail;
+	}
+
+	// There are no stats in a shared region.
+	void add_stat(stat_counter)
+	{
+	}
+
+	void put_value(ring_slot &slot, std::uint64_t tail, const value_type &value)
+	{
+		std::memcpy(&slot.storage_, &value, sizeof(value_type));
+		slot.store_and_wake(std::uint32_t(tail + 1) << bq_status_bits);
+	}
+
+	void get_value(ring_slot &slot, std::uint64_t head, value_type &value)
+	{
+		std::memcpy(&value, &slot.storage_, sizeof(value_type));
+		slot.store_and_wake(std::uint32_t(head + mask_ + 1) << bq_status_bits);
+	}
+
+	region_header *header_;
+	ring_slot *ring_;
+	std::uint32_t mask_;
+	Layout layout_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_SHM_BOUNDED_QUEUE_H_
@@ -27,6 +27,9 @@
 
 #include <atomic>
 #include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
 
 #include "backoff.h"
 #include "basic.h"
@@ -94,6 +97,11 @@ public:
 		lock_.store(false, std::memory_order_release);
 	}
 
+	bool is_locked() const noexcept
+	{
+		return lock_.load(std::memory_order_relaxed);
+	}
+
 private:
 	std::atomic<bool> lock_ = ATOMIC_VAR_INIT(false);
 };
@@ -134,6 +142,12 @@ public:
 		head_.fetch_add(1, std::memory_order_release);
 	}
 
+	bool is_locked() const noexcept
+	{
+		return head_.load(std::memory_order_relaxed)
+		       != tail_.load(std::memory_order_relaxed);
+	}
+
 private:
 	using base_type = std::uint16_t;
 
@@ -141,6 +155,379 @@ private:
 	std::atomic<base_type> tail_ = ATOMIC_VAR_INIT(0);
 };
 
+//
+// A reader-writer spin lock. Writers have preference: a pending writer sets
+// a flag that keeps new readers out.
+//
+
+class rw_spin_lock : non_copyable
+{
+public:
+	constexpr rw_spin_lock() noexcept = default;
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff) noexcept
+	{
+		for (;;) {
+			std::uint32_t state = lock_.load(std::memory_order_relaxed);
+			if ((state & ~pending) == 0) {
+				if (lock_.compare_exchange_weak(state,
+								writer,
+								std::memory_order_acquire,
+								std::memory_order_relaxed))
+					return;
+				continue;
+			}
+			if ((state & pending) == 0)
+				lock_.compare_exchange_weak(state,
+							    state | pending,
+							    std::memory_order_relaxed,
+							    std::memory_order_relaxed);
+			backoff();
+		}
+	}
+
+	bool try_lock()
+	{
+		std::uint32_t state = lock_.load(std::memory_order_relaxed);
+		return (state & ~pending) == 0
+		       && lock_.compare_exchange_strong(state,
+							writer,
+							std::memory_order_acquire,
+							std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		lock_.fetch_sub(writer, std::memory_order_release);
+	}
+
+	void lock_shared()
+	{
+		lock_shared(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock_shared(Backoff backoff) noexcept
+	{
+		for (;;) {
+			std::uint32_t state = lock_.load(std::memory_order_relaxed);
+			if ((state & (writer | pending)) == 0) {
+				if (lock_.compare_exchange_weak(state,
+								state + reader,
+								std::memory_order_acquire,
+								std::memory_order_relaxed))
+					return;
+				continue;
+			}
+			backoff();
+		}
+	}
+
+	bool try_lock_shared()
+	{
+		std::uint32_t state = lock_.load(std::memory_order_relaxed);
+		return (state & (writer | pending)) == 0
+		       && lock_.compare_exchange_strong(state,
+							state + reader,
+							std::memory_order_acquire,
+							std::memory_order_relaxed);
+	}
+
+	void unlock_shared()
+	{
+		lock_.fetch_sub(reader, std::memory_order_release);
+	}
+
+private:
+	static constexpr std::uint32_t writer = 1;
+	static constexpr std::uint32_t pending = 2;
+	static constexpr std::uint32_t reader = 4;
+
+	std::atomic<std::uint32_t> lock_ = ATOMIC_VAR_INIT(0);
+};
+
+//
+// Queue locks. Every waiter spins on its own node so there is no cache line
+// ping-pong among the waiters. By default the nodes are taken from a small
+// per-thread cache. The hot path may avoid the thread-local lookup if the
+// caller provides a node explicitly.
+//
+
+template <typename Node>
+class lock_node_cache : non_copyable
+{
+public:
+	static Node *acquire()
+	{
+		std::vector<Node *> &nodes = instance().nodes_;
+		if (nodes.empty())
+			return allocate();
+		Node *node = nodes.back();
+		nodes.pop_back();
+		return node;
+	}
+
+	static void release(Node *node)
+	{
+		instance().nodes_.push_back(node);
+	}
+
+	static Node *allocate()
+	{
+		void *node;
+		if (::posix_memalign(&node, alignof(Node), sizeof(Node)))
+			throw std::bad_alloc();
+		return new (node) Node();
+	}
+
+	static void deallocate(Node *node) noexcept
+	{
+		node->~Node();
+		std::free(node);
+	}
+
+	~lock_node_cache()
+	{
+		for (Node *node : nodes_)
+			deallocate(node);
+	}
+
+private:
+	lock_node_cache() = default;
+
+	static lock_node_cache &instance()
+	{
+		static thread_local lock_node_cache cache;
+		return cache;
+	}
+
+	std::vector<Node *> nodes_;
+};
+
+//
+// J. M. Mellor-Crummey, M. L. Scott. Algorithms for Scalable Synchronization
+// on Shared-Memory Multiprocessors. ACM TOCS 1991.
+//
+// A waiter spins on a flag in its own node until the predecessor clears
+// it. A caller-provided node may live on the stack as it is not referenced
+// by anybody after unlock.
+//
+
+class mcs_lock : non_copyable
+{
+public:
+	struct alignas(cache_line_size) node
+	{
+		std::atomic<node *> next = ATOMIC_VAR_INIT(nullptr);
+		std::atomic<bool> locked = ATOMIC_VAR_INIT(false);
+	};
+
+	constexpr mcs_lock() noexcept = default;
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		node *n = lock_node_cache<node>::acquire();
+		lock(*n, backoff);
+		owner_ = n;
+	}
+
+	bool try_lock()
+	{
+		node *n = lock_node_cache<node>::acquire();
+		if (!try_lock(*n)) {
+			lock_node_cache<node>::release(n);
+			return false;
+		}
+		owner_ = n;
+		return true;
+	}
+
+	void unlock()
+	{
+		node *n = owner_;
+		unlock(*n);
+		lock_node_cache<node>::release(n);
+	}
+
+	void lock(node &n) noexcept
+	{
+		lock(n, no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(node &n, Backoff backoff) noexcept
+	{
+		n.next.store(nullptr, std::memory_order_relaxed);
+		n.locked.store(true, std::memory_order_relaxed);
+		node *prev = tail_.exchange(&n, std::memory_order_acq_rel);
+		if (prev != nullptr) {
+			prev->next.store(&n, std::memory_order_release);
+			while (n.locked.load(std::memory_order_acquire))
+				backoff();
+		}
+	}
+
+	bool try_lock(node &n) noexcept
+	{
+		n.next.store(nullptr, std::memory_order_relaxed);
+		node *expected = nullptr;
+		return tail_.compare_exchange_strong(
+			expected, &n, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock(node &n) noexcept
+	{
+		node *next = n.next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			node *expected = &n;
+			if (tail_.compare_exchange_strong(expected,
+							  nullptr,
+							  std::memory_order_release,
+							  std::memory_order_relaxed))
+				return;
+			// A successor is about to link itself.
+			while ((next = n.next.load(std::memory_order_acquire)) == nullptr)
+				cpu_relax{}(1);
+		}
+		next->locked.store(false, std::memory_order_release);
+	}
+
+private:
+	std::atomic<node *> tail_ = ATOMIC_VAR_INIT(nullptr);
+
+	// The node of the current owner, only used by the owner itself.
+	node *owner_ = nullptr;
+};
+
+//
+// T. S. Craig. Building FIFO and Priority-Queuing Spin Locks from Atomic
+// Swap. Technical Report TR 93-02-02, University of Washington, 1993.
+//
+// A waiter spins on a flag in its predecessor's node. On unlock the owner
+// gives up its own node and takes over the predecessor's one so the nodes
+// wander between threads. Therefore a caller-provided node must be created
+// with new_node() and is passed by reference to a pointer that might point
+// to a different node after unlock. The caller eventually frees whatever
+// node it has with delete_node().
+//
+
+class clh_lock : non_copyable
+{
+public:
+	struct alignas(cache_line_size) node
+	{
+		std::atomic<bool> locked = ATOMIC_VAR_INIT(false);
+		node *pred = nullptr;
+	};
+
+	clh_lock() : tail_{new_node()}
+	{
+	}
+
+	~clh_lock()
+	{
+		delete_node(tail_.load(std::memory_order_relaxed));
+	}
+
+	static node *new_node()
+	{
+		return lock_node_cache<node>::allocate();
+	}
+
+	static void delete_node(node *n) noexcept
+	{
+		lock_node_cache<node>::deallocate(n);
+	}
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		node *n = lock_node_cache<node>::acquire();
+		lock(n, backoff);
+		owner_ = n;
+	}
+
+	bool try_lock()
+	{
+		node *n = lock_node_cache<node>::acquire();
+		if (!try_lock(n)) {
+			lock_node_cache<node>::release(n);
+			return false;
+		}
+		owner_ = n;
+		return true;
+	}
+
+	void unlock()
+	{
+		node *n = owner_;
+		unlock(n);
+		lock_node_cache<node>::release(n);
+	}
+
+	void lock(node *&n) noexcept
+	{
+		lock(n, no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(node *&n, Backoff backoff) noexcept
+	{
+		n->locked.store(true, std::memory_order_relaxed);
+		node *pred = tail_.exchange(n, std::memory_order_acq_rel);
+		n->pred = pred;
+		while (pred->locked.load(std::memory_order_acquire))
+			backoff();
+	}
+
+	bool try_lock(node *&n) noexcept
+	{
+		node *pred = tail_.load(std::memory_order_acquire);
+		if (pred->locked.load(std::memory_order_relaxed))
+			return false;
+		n->locked.store(true, std::memory_order_relaxed);
+		if (!tail_.compare_exchange_strong(
+			    pred, n, std::memory_order_acq_rel, std::memory_order_relaxed))
+			return false;
+		n->pred = pred;
+		// The predecessor node might have been recycled and enqueued
+		// again in the meantime, then wait for its release.
+		while (pred->locked.load(std::memory_order_acquire))
+			cpu_relax{}(1);
+		return true;
+	}
+
+	void unlock(node *&n) noexcept
+	{
+		node *pred = n->pred;
+		n->locked.store(false, std::memory_order_release);
+		n = pred;
+	}
+
+private:
+	std::atomic<node *> tail_;
+
+	// The node of the current owner, only used by the owner itself.
+	node *owner_ = nullptr;
+};
+
 } // namespace evenk
 
 #endif // !EVENK_SPINLOCK_H_
@@ -0,0 +1,349 @@
+//
+// Fast Bounded Single-Producer Single-Consumer Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_SPSC_BOUNDED_QUEUE_H_
+#define EVENK_SPSC_BOUNDED_QUEUE_H_
+
+//
+// A ring buffer for exactly one producer and one consumer thread. There
+// are no per-slot tickets. Instead the head and tail indices are kept in
+// ticket format in two Ticket instances so that the same wait strategies
+// as for bounded_queue apply. Each side keeps a cached copy of the other
+// side's index and only reloads it when the ring looks full or empty.
+//
+// The SlotAlignment parameter allows to pad every slot to a cache line.
+// By default the slots are packed densely.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+
+namespace evenk {
+
+template <typename Value, typename Ticket = bq_slot, std::size_t SlotAlignment = alignof(Value)>
+class spsc_bounded_queue : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	spsc_bounded_queue(std::uint32_t size)
+		: ring_{nullptr},
+		  mask_{size - 1},
+		  closed_{false},
+		  shared_{closed_},
+		  tail_cache_{0},
+		  head_cache_{0}
+	{
+		if (size == 0 || (size & mask_) != 0)
+			throw std::invalid_argument(
+				"spsc_bounded_queue size must be a power of two");
+		if (size > (bq_ticket_mask >> (bq_status_bits + 1)))
+			throw std::invalid_argument("spsc_bounded_queue size is too large");
+
+		void *ring;
+		if (::posix_memalign(&ring, cache_line_size, size * sizeof(ring_slot)))
+			throw std::bad_alloc();
+
+		ring_ = static_cast<ring_slot *>(ring);
+		for (std::uint32_t i = 0; i < size; i++)
+			new (&ring_[i]) ring_slot();
+
+		head_.attach(shared_);
+		tail_.attach(shared_);
+		head_.initialize(0);
+		tail_.initialize(0);
+	}
+
+	~spsc_bounded_queue()
+	{
+		std::uint32_t size = mask_ + 1;
+		for (std::uint32_t i = 0; i < size; i++)
+			ring_[i].~ring_slot();
+		std::free(ring_);
+	}
+
+	void close()
+	{
+		closed_.store(true, std::memory_order_release);
+		head_.wake();
+		tail_.wake();
+	}
+
+	bool is_closed() const
+	{
+		return closed_.load(std::memory_order_acquire);
+	}
+
+	bool is_empty() const
+	{
+		std::uint32_t head = head_.load() & bq_ticket_mask;
+		std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		return head == tail;
+	}
+
+	bool is_full() const
+	{
+		std::uint32_t head = head_.load() & bq_ticket_mask;
+		std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		return tail - head > (mask_ << bq_status_bits);
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	template <typename... Backoff>
+	void push(value_type &&value, Backoff... backoff)
+	{
+		const std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		if (!has_room(tail))
+			wait_tail(tail, std::forward<Backoff>(backoff)...);
+		slot(tail).value = std::move(value);
+		tail_.store_and_wake(tail + bq_ticket_step);
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		const std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		if (!has_room(tail))
+			wait_tail(tail, std::forward<Backoff>(backoff)...);
+		slot(tail).value = value;
+		tail_.store_and_wake(tail + bq_ticket_step);
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(value_type &&value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(std::move(value), std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_push(const value_type &value, Backoff... backoff)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		push(value, std::forward<Backoff>(backoff)...);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(value_type &&value, Backoff...)
+	{
+		return nonblocking_push(std::move(value));
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_push(const value_type &value, Backoff...)
+	{
+		return nonblocking_push(value);
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		const std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		if (!has_room(tail) && !refresh_head(tail))
+			return queue_op_status::full;
+		slot(tail).value = std::move(value);
+		tail_.store_and_wake(tail + bq_ticket_step);
+		return queue_op_status::success;
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		const std::uint32_t tail = tail_.load() & bq_ticket_mask;
+		if (!has_room(tail) && !refresh_head(tail))
+			return queue_op_status::full;
+		slot(tail).value = value;
+		tail_.store_and_wake(tail + bq_ticket_step);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		const std::uint32_t head = head_.load() & bq_ticket_mask;
+		if (head == tail_cache_ && wait_head(head, std::forward<Backoff>(backoff)...))
+			return queue_op_status::closed;
+		value = std::move(slot(head).value);
+		head_.store_and_wake(head + bq_ticket_step);
+		return queue_op_status::success;
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff...)
+	{
+		return nonblocking_pop(value);
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		const std::uint32_t head = head_.load() & bq_ticket_mask;
+		if (head == tail_cache_ && !refresh_tail(head)) {
+			if (is_closed() && !refresh_tail(head))
+				return queue_op_status::closed;
+			return queue_op_status::empty;
+		}
+		value = std::move(slot(head).value);
+		head_.store_and_wake(head + bq_ticket_step);
+		return queue_op_status::success;
+	}
+
+private:
+	struct alignas(SlotAlignment) ring_slot
+	{
+		value_type value;
+	};
+
+	ring_slot &slot(std::uint32_t ticket)
+	{
+		return ring_[(ticket >> bq_status_bits) & mask_];
+	}
+
+	bool has_room(std::uint32_t tail) const
+	{
+		return tail - head_cache_ <= (mask_ << bq_status_bits);
+	}
+
+	bool refresh_head(std::uint32_t tail)
+	{
+		head_cache_ = head_.load() & bq_ticket_mask;
+		return has_room(tail);
+	}
+
+	bool refresh_tail(std::uint32_t head)
+	{
+		tail_cache_ = tail_.load() & bq_ticket_mask;
+		return tail_cache_ != head;
+	}
+
+	void wait_tail(std::uint32_t tail)
+	{
+		std::uint32_t head = head_.load();
+		while (tail - (head & bq_ticket_mask) > (mask_ << bq_status_bits))
+			head = head_.wait_and_load(head);
+		head_cache_ = head & bq_ticket_mask;
+	}
+
+	template <typename Backoff>
+	void wait_tail(std::uint32_t tail, Backoff backoff)
+	{
+		bool waiting = false;
+		std::uint32_t head = head_.load();
+		while (tail - (head & bq_ticket_mask) > (mask_ << bq_status_bits)) {
+			if (waiting) {
+				head = head_.wait_and_load(head);
+			} else {
+				waiting = backoff();
+				head = head_.load();
+			}
+		}
+		head_cache_ = head & bq_ticket_mask;
+	}
+
+	// Returns true if the queue is closed and drained.
+	bool wait_head(std::uint32_t head)
+	{
+		std::uint32_t tail = tail_.load();
+		while ((tail & bq_ticket_mask) == head) {
+			if (is_closed()) {
+				tail = tail_.load();
+				if ((tail & bq_ticket_mask) == head)
+					return true;
+				break;
+			}
+			tail = tail_.wait_and_load(tail);
+		}
+		tail_cache_ = tail & bq_ticket_mask;
+		return false;
+	}
+
+	template <typename Backoff>
+	bool wait_head(std::uint32_t head, Backoff backoff)
+	{
+		bool waiting = false;
+		std::uint32_t tail = tail_.load();
+		while ((tail & bq_ticket_mask) == head) {
+			if (is_closed()) {
+				tail = tail_.load();
+				if ((tail & bq_ticket_mask) == head)
+					return true;
+				break;
+			}
+			if (waiting) {
+				tail = tail_.wait_and_load(tail);
+			} else {
+				waiting = backoff();
+				tail = tail_.load();
+			}
+		}
+		tail_cache_ = tail & bq_ticket_mask;
+		return false;
+	}
+
+	ring_slot *ring_;
+	const std::uint32_t mask_;
+
+	std::atomic<bool> closed_;
+	typename Ticket::shared_state shared_;
+
+	// The consumer index and its copy of the producer index.
+	alignas(cache_line_size) Ticket head_;
+	std::uint32_t tail_cache_;
+
+	// The producer index and its copy of the consumer index.
+	alignas(cache_line_size) Ticket tail_;
+	std::uint32_t head_cache_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_SPSC_BOUNDED_QUEUE_H_
@@ -0,0 +1,183 @@
+//
+// Contention Statistics
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_STATS_H_
+#define EVENK_STATS_H_
+
+//
+// Stats policies for locks and queues. The no_stats policy is the default,
+// all its member functions are empty so an instrumented class compiles to
+// the same code as before. The sharded_stats policy keeps the counters in
+// a number of cache-aligned shards, every thread updates the shard picked
+// by its index. So the counting itself hardly ever contends. Reading the
+// counters sums up all the shards, the result is exact only when there is
+// no concurrent activity.
+//
+// A stats object is kept by every lock or queue instance. The hold time is
+// measured from lock to unlock by the owner thread.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "basic.h"
+
+namespace evenk {
+
+enum stat_counter : std::size_t {
+	// Lock acquisitions.
+	stat_acquire,
+	// Lock acquisitions that did not succeed at once.
+	stat_contended,
+	// Backoff iterations before lock acquisition or futex wait.
+	stat_spin,
+	// Futex wait calls.
+	stat_park,
+	// Total lock hold time in nanoseconds.
+	stat_hold_time,
+	// Aborted lock elision attempts.
+	stat_abort,
+	// Elision aborts caused by a memory conflict.
+	stat_abort_conflict,
+	// Elision aborts caused by the transaction size.
+	stat_abort_capacity,
+	// Elision aborts caused by a lock held for real.
+	stat_abort_busy,
+	// Lock acquisitions after elision was given up.
+	stat_fallback,
+	// Values pushed to a queue.
+	stat_push,
+	// Values popped from a queue.
+	stat_pop,
+	// Pushes that had to wait for a free slot.
+	stat_push_wait,
+	// Pops that had to wait for a value.
+	stat_pop_wait,
+	// Slot wake calls made by close.
+	stat_close_wake,
+
+	stat_counter_count
+};
+
+class no_stats
+{
+public:
+	void add(stat_counter, std::uint64_t = 1) noexcept
+	{
+	}
+
+	void start_hold() noexcept
+	{
+	}
+
+	void finish_hold() noexcept
+	{
+	}
+};
+
+template <std::size_t Shards = 16>
+class sharded_stats
+{
+public:
+	static_assert(Shards > 0 && (Shards & (Shards - 1)) == 0,
+		      "sharded_stats shard number must be a power of two");
+
+	sharded_stats() noexcept
+	{
+		reset();
+	}
+
+	// Copying takes a snapshot of the counters.
+	sharded_stats(const sharded_stats &other) noexcept : hold_start_{0}
+	{
+		reset();
+		for (std::size_t i = 0; i < stat_counter_count; i++)
+			add(stat_counter(i), other.get(stat_counter(i)));
+	}
+
+	sharded_stats &operator=(const sharded_stats &) = delete;
+
+	void add(stat_counter counter, std::uint64_t count = 1) noexcept
+	{
+		shard &s = shards_[thread_index() & (Shards - 1)];
+		s.counters[counter].fetch_add(count, std::memory_order_relaxed);
+	}
+
+	std::uint64_t get(stat_counter counter) const noexcept
+	{
+		std::uint64_t count = 0;
+		for (std::size_t i = 0; i < Shards; i++)
+			count += shards_[i].counters[counter].load(std::memory_order_relaxed);
+		return count;
+	}
+
+	void reset() noexcept
+	{
+		for (std::size_t i = 0; i < Shards; i++) {
+			for (std::size_t j = 0; j < stat_counter_count; j++)
+				shards_[i].counters[j].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void start_hold() noexcept
+	{
+		hold_start_ = now();
+	}
+
+	void finish_hold() noexcept
+	{
+		add(stat_hold_time, now() - hold_start_);
+	}
+
+private:
+	struct alignas(cache_line_size) shard
+	{
+		std::atomic<std::uint64_t> counters[stat_counter_count];
+	};
+
+	static std::size_t thread_index() noexcept
+	{
+		static std::atomic<std::size_t> next_index = ATOMIC_VAR_INIT(0);
+		static thread_local std::size_t index =
+			next_index.fetch_add(1, std::memory_order_relaxed);
+		return index;
+	}
+
+	static std::uint64_t now() noexcept
+	{
+		auto time = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+	}
+
+	shard shards_[Shards];
+
+	// Only used by the lock owner.
+	std::uint64_t hold_start_ = 0;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_STATS_H_
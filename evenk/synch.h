@@ -25,6 +25,7 @@
 #ifndef EVENK_SYNCH_H_
 #define EVENK_SYNCH_H_
 
+#include <chrono>
 #include <condition_variable>
 #include <limits>
 #include <mutex>
@@ -35,6 +36,7 @@
 #include "backoff.h"
 #include "basic.h"
 #include "futex.h"
+#include "stats.h"
 
 namespace evenk {
 
@@ -72,6 +74,26 @@ public:
 		return true;
 	}
 
+	template <typename Rep, typename Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period> &rel_time)
+	{
+		return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+	}
+
+	template <typename Clock, typename Duration>
+	bool try_lock_until(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		// POSIX mutexes always use CLOCK_REALTIME for deadlines.
+		struct timespec ts = to_timespec<std::chrono::system_clock>(abs_time);
+		int ret = pthread_mutex_timedlock(&mutex_, &ts);
+		if (ret) {
+			if (ret != ETIMEDOUT)
+				throw_system_error(ret, "pthread_mutex_timedlock()");
+			return false;
+		}
+		return true;
+	}
+
 	void unlock()
 	{
 		int ret = pthread_mutex_unlock(&mutex_);
@@ -88,12 +110,20 @@ private:
 	pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
 };
 
-class futex_lock : non_copyable
+//
+// A futex lock with the shared scope may be placed in memory that is mapped
+// by several processes. The Stats policy may count the lock contention, see
+// stats.h.
+//
+
+template <futex_scope Scope = futex_private, typename Stats = no_stats>
+class basic_futex_lock : non_copyable, Stats
 {
 public:
 	using native_handle_type = futex_t &;
+	using stats_type = Stats;
 
-	constexpr futex_lock() noexcept = default;
+	constexpr basic_futex_lock() noexcept = default;
 
 	void lock()
 	{
@@ -103,45 +133,221 @@ public:
 	template <typename Backoff>
 	void lock(Backoff backoff)
 	{
+		std::uint64_t spins = 0;
 		for (std::uint32_t value = 0; !futex_.compare_exchange_strong(
 			     value, 1, std::memory_order_acquire, std::memory_order_relaxed);
 		     value = 0) {
+			spins++;
 			if (backoff()) {
 				if (value == 2
 				    || futex_.exchange(2, std::memory_order_acquire)) {
 					do
-						futex_wait(futex_, 2);
+						park();
 					while (futex_.exchange(2, std::memory_order_acquire));
 				}
 				break;
 			}
 		}
+		acquired(spins);
 	}
 
 	bool try_lock()
 	{
 		std::uint32_t value = 0;
-		return futex_.compare_exchange_strong(
-			value, 1, std::memory_order_acquire, std::memory_order_relaxed);
+		if (!futex_.compare_exchange_strong(
+			    value, 1, std::memory_order_acquire, std::memory_order_relaxed))
+			return false;
+		acquired(0);
+		return true;
+	}
+
+	template <typename Rep, typename Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period> &rel_time)
+	{
+		return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+	}
+
+	template <typename Clock, typename Duration>
+	bool try_lock_until(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		std::uint32_t value = 0;
+		if (futex_.compare_exchange_strong(
+			    value, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+			acquired(0);
+			return true;
+		}
+
+		struct timespec ts = to_timespec<std::chrono::steady_clock>(abs_time);
+		if (value == 2 || futex_.exchange(2, std::memory_order_acquire)) {
+			do {
+				Stats::add(stat_park);
+				if (futex_wait_until(futex_, 2, &ts, Scope) == -ETIMEDOUT) {
+					if (futex_.exchange(2, std::memory_order_acquire))
+						return false;
+					break;
+				}
+			} while (futex_.exchange(2, std::memory_order_acquire));
+		}
+		acquired(1);
+		return true;
 	}
 
 	void unlock()
 	{
+		Stats::finish_hold();
 		if (futex_.fetch_sub(1, std::memory_order_release) != 1) {
 			futex_.store(0, std::memory_order_relaxed);
-			futex_wake(futex_, 1);
+			futex_wake(futex_, 1, Scope);
 		}
 	}
 
+	bool is_locked() const noexcept
+	{
+		return futex_.load(std::memory_order_relaxed) != 0;
+	}
+
 	native_handle_type native_handle()
 	{
 		return futex_;
 	}
 
+	stats_type &stats()
+	{
+		return *this;
+	}
+
+	const stats_type &stats() const
+	{
+		return *this;
+	}
+
 private:
+	void park()
+	{
+		Stats::add(stat_park);
+		futex_wait(futex_, 2, Scope);
+	}
+
+	void acquired(std::uint64_t spins)
+	{
+		Stats::add(stat_acquire);
+		if (spins) {
+			Stats::add(stat_contended);
+			Stats::add(stat_spin, spins);
+		}
+		Stats::start_hold();
+	}
+
 	futex_t futex_ = ATOMIC_VAR_INIT(0);
 };
 
+using futex_lock = basic_futex_lock<futex_private>;
+using interprocess_futex_lock = basic_futex_lock<futex_shared>;
+
+//
+// A ticket lock with 32-bit tickets for heavily oversubscribed threads. The
+// waiters close to the head spin with the given backoff. A waiter farther
+// than the spin distance parks on a futex. Every waiter maps its ticket to
+// one of a few futex slots. When the head moves the unlock only wakes the
+// slot of the ticket that just came into the spin distance. So the sleepers
+// get up in turn ahead of time and FIFO order is kept. Waiters with tickets
+// that map to the same slot wake up too and then park again.
+//
+// The spinning waiters never park. If there may be more threads than CPUs
+// then a yielding backoff keeps them from burning the rest of their time
+// slice while the owner is preempted.
+//
+
+class futex_ticket_lock : non_copyable
+{
+public:
+	static constexpr std::uint32_t default_spin_distance = 2;
+
+	explicit futex_ticket_lock(std::uint32_t spin_distance = default_spin_distance) noexcept
+		: spin_distance_{spin_distance}
+	{
+	}
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		std::uint32_t ticket = tail_.fetch_add(1, std::memory_order_relaxed);
+		for (;;) {
+			std::uint32_t head = head_.load(std::memory_order_acquire);
+			if (ticket == head)
+				break;
+			std::uint32_t distance = ticket - head;
+			if (distance > spin_distance_)
+				park(ticket);
+			else
+				proportional_adapter(backoff, distance);
+		}
+	}
+
+	bool try_lock()
+	{
+		std::uint32_t head = head_.load(std::memory_order_acquire);
+		std::uint32_t tail = tail_.load(std::memory_order_relaxed);
+		return head == tail
+		       && tail_.compare_exchange_strong(
+				  tail, tail + 1, std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		// This must be ordered before the waiter check, see park().
+		std::uint32_t head = head_.fetch_add(1, std::memory_order_seq_cst) + 1;
+		slot &s = slots_[(head + spin_distance_) & slot_mask];
+		if (s.waiters.load(std::memory_order_seq_cst) != 0) {
+			s.futex.fetch_add(1, std::memory_order_seq_cst);
+			futex_wake(s.futex, std::numeric_limits<int>::max());
+		}
+	}
+
+	bool is_locked() const noexcept
+	{
+		return head_.load(std::memory_order_relaxed)
+		       != tail_.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr std::uint32_t slot_count = 16;
+	static constexpr std::uint32_t slot_mask = slot_count - 1;
+
+	struct slot
+	{
+		futex_t futex = ATOMIC_VAR_INIT(0);
+		std::atomic<std::uint32_t> waiters = ATOMIC_VAR_INIT(0);
+	};
+
+	// The waiter count goes up before the head is checked and the unlock
+	// moves the head before it checks the count. So either the waiter sees
+	// the new head or the unlock sees the waiter and bumps the futex value.
+	void park(std::uint32_t ticket)
+	{
+		slot &s = slots_[ticket & slot_mask];
+		s.waiters.fetch_add(1, std::memory_order_seq_cst);
+		for (;;) {
+			std::uint32_t value = s.futex.load(std::memory_order_acquire);
+			std::uint32_t head = head_.load(std::memory_order_seq_cst);
+			if (ticket - head <= spin_distance_)
+				break;
+			futex_wait(s.futex, value);
+		}
+		s.waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<std::uint32_t> head_ = ATOMIC_VAR_INIT(0);
+	std::atomic<std::uint32_t> tail_ = ATOMIC_VAR_INIT(0);
+	const std::uint32_t spin_distance_;
+	slot slots_[slot_count];
+};
+
 //
 // Lock Guard
 //
@@ -209,6 +415,24 @@ public:
 		return owns_lock_;
 	}
 
+	template <typename Rep, typename Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period> &rel_time)
+	{
+		if (owns_lock_)
+			throw_system_error(int(std::errc::resource_deadlock_would_occur));
+		owns_lock_ = mutex_->try_lock_for(rel_time);
+		return owns_lock_;
+	}
+
+	template <typename Clock, typename Duration>
+	bool try_lock_until(const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		if (owns_lock_)
+			throw_system_error(int(std::errc::resource_deadlock_would_occur));
+		owns_lock_ = mutex_->try_lock_until(abs_time);
+		return owns_lock_;
+	}
+
 	void unlock()
 	{
 		if (!owns_lock_)
@@ -232,6 +456,93 @@ private:
 	bool owns_lock_;
 };
 
+template <typename Lock>
+class shared_lock_guard : non_copyable
+{
+public:
+	using mutex_type = Lock;
+
+	shared_lock_guard(mutex_type &mutex) : mutex_(&mutex), owns_lock_(false)
+	{
+		lock();
+	}
+
+	template <typename Backoff>
+	shared_lock_guard(mutex_type &mutex, Backoff backoff) : mutex_(&mutex), owns_lock_(false)
+	{
+		lock(backoff);
+	}
+
+	shared_lock_guard(mutex_type &mutex, std::adopt_lock_t) noexcept
+		: mutex_(&mutex), owns_lock_(true)
+	{
+	}
+
+	shared_lock_guard(mutex_type &mutex, std::defer_lock_t) noexcept
+		: mutex_(&mutex), owns_lock_(false)
+	{
+	}
+
+	shared_lock_guard(mutex_type &mutex, std::try_to_lock_t)
+		: mutex_(&mutex), owns_lock_(false)
+	{
+		try_lock();
+	}
+
+	~shared_lock_guard()
+	{
+		if (owns_lock_)
+			mutex_->unlock_shared();
+	}
+
+	void lock()
+	{
+		if (owns_lock_)
+			throw_system_error(int(std::errc::resource_deadlock_would_occur));
+		mutex_->lock_shared();
+		owns_lock_ = true;
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		if (owns_lock_)
+			throw_system_error(int(std::errc::resource_deadlock_would_occur));
+		mutex_->lock_shared(backoff);
+		owns_lock_ = true;
+	}
+
+	bool try_lock()
+	{
+		if (owns_lock_)
+			throw_system_error(int(std::errc::resource_deadlock_would_occur));
+		owns_lock_ = mutex_->try_lock_shared();
+		return owns_lock_;
+	}
+
+	void unlock()
+	{
+		if (!owns_lock_)
+			throw_system_error(int(std::errc::operation_not_permitted));
+		mutex_->unlock_shared();
+		owns_lock_ = false;
+	}
+
+	mutex_type *mutex()
+	{
+		return mutex_;
+	}
+
+	bool owns_lock()
+	{
+		return owns_lock_;
+	}
+
+private:
+	mutex_type *mutex_;
+	bool owns_lock_;
+};
+
 //
 // Condition Variables
 //
@@ -255,6 +566,29 @@ public:
 			throw_system_error(ret, "pthread_cond_wait()");
 	}
 
+	template <typename Rep, typename Period>
+	std::cv_status wait_for(std::unique_lock<posix_mutex> &lock,
+				const std::chrono::duration<Rep, Period> &rel_time)
+	{
+		return wait_until(lock, std::chrono::steady_clock::now() + rel_time);
+	}
+
+	template <typename Clock, typename Duration>
+	std::cv_status wait_until(std::unique_lock<posix_mutex> &lock,
+				  const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		// The condition variable is initialized statically so it uses
+		// CLOCK_REALTIME for deadlines.
+		struct timespec ts = to_timespec<std::chrono::system_clock>(abs_time);
+		int ret = pthread_cond_timedwait(&cond_, lock.mutex()->native_handle(), &ts);
+		if (ret) {
+			if (ret != ETIMEDOUT)
+				throw_system_error(ret, "pthread_cond_timedwait()");
+			return std::cv_status::timeout;
+		}
+		return std::cv_status::no_timeout;
+	}
+
 	void notify_one()
 	{
 		int ret = pthread_cond_signal(&cond_);
@@ -285,24 +619,27 @@ public:
 
 	void wait(lock_guard<futex_lock> &guard)
 	{
-		futex_lock *owner = guard.mutex();
-		if (owner_ != nullptr && owner_ != owner)
-			throw std::invalid_argument(
-				"different locks used for the same condition variable.");
-		owner_.store(owner, std::memory_order_relaxed);
-
-		count_.fetch_add(1, std::memory_order_relaxed);
-		std::atomic_thread_fence(std::memory_order_acq_rel);
-		std::uint32_t value = futex_.load(std::memory_order_relaxed);
-
-		owner->unlock();
-
+		std::uint32_t value = prepare_wait(guard);
 		futex_wait(futex_, value);
+		finish_wait(guard);
+	}
 
-		futex_t &owner_futex = owner->native_handle();
-		count_.fetch_sub(1, std::memory_order_relaxed);
-		while (owner_futex.exchange(2, std::memory_order_acquire))
-			futex_wait(owner_futex, 2);
+	template <typename Rep, typename Period>
+	std::cv_status wait_for(lock_guard<futex_lock> &guard,
+				const std::chrono::duration<Rep, Period> &rel_time)
+	{
+		return wait_until(guard, std::chrono::steady_clock::now() + rel_time);
+	}
+
+	template <typename Clock, typename Duration>
+	std::cv_status wait_until(lock_guard<futex_lock> &guard,
+				  const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		struct timespec ts = to_timespec<std::chrono::steady_clock>(abs_time);
+		std::uint32_t value = prepare_wait(guard);
+		int ret = futex_wait_until(futex_, value, &ts);
+		finish_wait(guard);
+		return ret == -ETIMEDOUT ? std::cv_status::timeout : std::cv_status::no_timeout;
 	}
 
 	void notify_one()
@@ -327,11 +664,234 @@ public:
 	}
 
 private:
+	std::uint32_t prepare_wait(lock_guard<futex_lock> &guard)
+	{
+		futex_lock *owner = guard.mutex();
+		if (owner_ != nullptr && owner_ != owner)
+			throw std::invalid_argument(
+				"different locks used for the same condition variable.");
+		owner_.store(owner, std::memory_order_relaxed);
+
+		count_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acq_rel);
+		std::uint32_t value = futex_.load(std::memory_order_relaxed);
+
+		owner->unlock();
+		return value;
+	}
+
+	void finish_wait(lock_guard<futex_lock> &guard)
+	{
+		futex_t &owner_futex = guard.mutex()->native_handle();
+		count_.fetch_sub(1, std::memory_order_relaxed);
+		while (owner_futex.exchange(2, std::memory_order_acquire))
+			futex_wait(owner_futex, 2);
+	}
+
 	futex_t futex_ = ATOMIC_VAR_INIT(0);
 	futex_t count_ = ATOMIC_VAR_INIT(0);
 	std::atomic<futex_lock *> owner_ = ATOMIC_VAR_INIT(nullptr);
 };
 
+//
+// Event Count
+//
+// A waiter calls prepare_wait(), re-checks its condition and then either
+// calls cancel_wait() if the condition holds or commit_wait() with the key
+// obtained from prepare_wait(). A notifier first makes the condition true
+// and then calls notify_one() or notify_all(). Notifications are cheap when
+// there are no waiters as no system call is made at all.
+//
+
+class event_count : non_copyable
+{
+public:
+	using key_type = std::uint32_t;
+
+	constexpr event_count() noexcept = default;
+
+	key_type prepare_wait()
+	{
+		waiters_.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return epoch_.load(std::memory_order_acquire);
+	}
+
+	void cancel_wait()
+	{
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void commit_wait(key_type key)
+	{
+		futex_wait(epoch_, key);
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Returns false if the deadline is passed.
+	template <typename Clock, typename Duration>
+	bool commit_wait_until(key_type key,
+			       const std::chrono::time_point<Clock, Duration> &abs_time)
+	{
+		int ret = futex_wait_until(epoch_, key, abs_time);
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+		return ret != -ETIMEDOUT;
+	}
+
+	void notify_one()
+	{
+		notify(1);
+	}
+
+	void notify_all()
+	{
+		notify(std::numeric_limits<int>::max());
+	}
+
+	bool has_waiters() const
+	{
+		return waiters_.load(std::memory_order_relaxed) != 0;
+	}
+
+private:
+	void notify(int count)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters_.load(std::memory_order_relaxed)) {
+			epoch_.fetch_add(1, std::memory_order_release);
+			futex_wake(epoch_, count);
+		}
+	}
+
+	futex_t epoch_ = ATOMIC_VAR_INIT(0);
+	futex_t waiters_ = ATOMIC_VAR_INIT(0);
+};
+
+//
+// Shared Lock
+//
+// Writers have preference: as soon as a writer is pending no new readers
+// are let in. Sleeping readers and writers wait on separate event counts.
+//
+
+class shared_futex_lock : non_copyable
+{
+public:
+	constexpr shared_futex_lock() noexcept = default;
+
+	void lock()
+	{
+		lock(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock(Backoff backoff)
+	{
+		std::uint32_t state = 0;
+		if (state_.compare_exchange_strong(
+			    state, writer, std::memory_order_acquire, std::memory_order_relaxed))
+			return;
+
+		pending_writers_.fetch_add(1, std::memory_order_relaxed);
+		bool waiting = false;
+		for (;;) {
+			state = state_.load(std::memory_order_relaxed);
+			if (state == 0) {
+				if (state_.compare_exchange_weak(state,
+								 writer,
+								 std::memory_order_acquire,
+								 std::memory_order_relaxed))
+					break;
+			} else if (!waiting) {
+				waiting = backoff();
+			} else {
+				event_count::key_type key = writers_.prepare_wait();
+				if (state_.load(std::memory_order_relaxed) == 0)
+					writers_.cancel_wait();
+				else
+					writers_.commit_wait(key);
+			}
+		}
+		pending_writers_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	bool try_lock()
+	{
+		std::uint32_t state = 0;
+		return state_.compare_exchange_strong(
+			state, writer, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+	void unlock()
+	{
+		state_.store(0, std::memory_order_release);
+		writers_.notify_one();
+		if (pending_writers_.load(std::memory_order_relaxed) == 0)
+			readers_.notify_all();
+	}
+
+	void lock_shared()
+	{
+		lock_shared(no_backoff{});
+	}
+
+	template <typename Backoff>
+	void lock_shared(Backoff backoff)
+	{
+		bool waiting = false;
+		for (;;) {
+			std::uint32_t state = state_.load(std::memory_order_relaxed);
+			if (may_read(state)) {
+				if (state_.compare_exchange_weak(state,
+								 state + 1,
+								 std::memory_order_acquire,
+								 std::memory_order_relaxed))
+					break;
+			} else if (!waiting) {
+				waiting = backoff();
+			} else {
+				event_count::key_type key = readers_.prepare_wait();
+				if (may_read(state_.load(std::memory_order_relaxed)))
+					readers_.cancel_wait();
+				else
+					readers_.commit_wait(key);
+			}
+		}
+	}
+
+	bool try_lock_shared()
+	{
+		std::uint32_t state = state_.load(std::memory_order_relaxed);
+		return may_read(state)
+		       && state_.compare_exchange_strong(state,
+							 state + 1,
+							 std::memory_order_acquire,
+							 std::memory_order_relaxed);
+	}
+
+	void unlock_shared()
+	{
+		if (state_.fetch_sub(1, std::memory_order_release) == 1)
+			writers_.notify_one();
+	}
+
+private:
+	static constexpr std::uint32_t writer = 0x80000000;
+
+	bool may_read(std::uint32_t state) const
+	{
+		return (state & writer) == 0
+		       && pending_writers_.load(std::memory_order_relaxed) == 0;
+	}
+
+	// The writer bit and the number of readers.
+	std::atomic<std::uint32_t> state_ = ATOMIC_VAR_INIT(0);
+	std::atomic<std::uint32_t> pending_writers_ = ATOMIC_VAR_INIT(0);
+
+	event_count readers_;
+	event_count writers_;
+};
+
 //
 // Synchronization Traits
 //
@@ -360,6 +920,17 @@ public:
 	using lock_owner_type = lock_guard<futex_lock>;
 };
 
+// A shared lock with a generic condition variable. The lock owner takes
+// the lock exclusively, shared_lock_owner_type is for read-only access.
+class shared_futex_synch
+{
+public:
+	using lock_type = shared_futex_lock;
+	using cond_var_type = std::condition_variable_any;
+	using lock_owner_type = lock_guard<shared_futex_lock>;
+	using shared_lock_owner_type = shared_lock_guard<shared_futex_lock>;
+};
+
 #if __linux__
 using default_synch = futex_synch;
 #else
@@ -25,6 +25,8 @@
 #ifndef EVENK_SYNCH_QUEUE_H_
 #define EVENK_SYNCH_QUEUE_H_
 
+#include <chrono>
+#include <cstddef>
 #include <deque>
 
 #include "conqueue.h"
@@ -50,6 +52,13 @@ public:
 	{
 	}
 
+	// Pre-allocate the sequence storage, requires a Sequence with the
+	// reserve() member such as chunk_ring.
+	explicit synch_queue(std::size_t capacity) : closed_(false)
+	{
+		queue_.reserve(capacity);
+	}
+
 	synch_queue(synch_queue &&other) noexcept : closed_(other.closed_)
 	{
 		std::swap(queue_, other.queue_);
@@ -79,6 +88,12 @@ public:
 		return false;
 	}
 
+	std::size_t depth()
+	{
+		lock_owner_type guard(lock_);
+		return queue_.size();
+	}
+
 	bool is_lock_free() const
 	{
 		return false;
@@ -142,6 +157,21 @@ public:
 		return locked_push(std::move(value));
 	}
 
+	// Push a range of values under a single lock acquisition.
+	template <typename Iterator, typename... Backoff>
+	void push_bulk(Iterator first, Iterator last, Backoff... backoff)
+	{
+		if (first == last)
+			return;
+
+		lock_owner_type guard(lock_, std::forward<Backoff>(backoff)...);
+		if (closed_)
+			throw queue_op_status::closed;
+		for (; first != last; ++first)
+			queue_.push_back(*first);
+		cond_.notify_all();
+	}
+
 	template <typename... Backoff>
 	value_type value_pop(Backoff... backoff)
 	{
@@ -164,6 +194,61 @@ public:
 		return status;
 	}
 
+	// Pop up to max values under a single lock acquisition. Waits while
+	// the queue is empty. Returns the number of values written to the
+	// output iterator, zero means the queue is closed.
+	template <typename Iterator, typename... Backoff>
+	std::size_t wait_pop_bulk(Iterator out, std::size_t max, Backoff... backoff)
+	{
+		if (max == 0)
+			return 0;
+
+		lock_owner_type guard(lock_, std::forward<Backoff>(backoff)...);
+		while (queue_.empty()) {
+			if (closed_)
+				return 0;
+			cond_.wait(guard);
+		}
+
+		std::size_t count = 0;
+		while (count < max && !queue_.empty()) {
+			*out = std::move(queue_.front());
+			queue_.pop_front();
+			++out;
+			++count;
+		}
+		return count;
+	}
+
+	template <typename Rep, typename Period, typename... Backoff>
+	queue_op_status wait_pop_for(value_type &value,
+				     const std::chrono::duration<Rep, Period> &rel_time,
+				     Backoff... backoff)
+	{
+		return wait_pop_until(value,
+				      std::chrono::steady_clock::now() + rel_time,
+				      std::forward<Backoff>(backoff)...);
+	}
+
+	template <typename Clock, typename Duration, typename... Backoff>
+	queue_op_status wait_pop_until(value_type &value,
+				       const std::chrono::time_point<Clock, Duration> &abs_time,
+				       Backoff... backoff)
+	{
+		lock_owner_type guard(lock_, std::forward<Backoff>(backoff)...);
+		auto status = locked_pop(value);
+		while (status == queue_op_status::empty) {
+			if (cond_.wait_until(guard, abs_time) == std::cv_status::timeout) {
+				status = locked_pop(value);
+				if (status == queue_op_status::empty)
+					return queue_op_status::timeout;
+				break;
+			}
+			status = locked_pop(value);
+		}
+		return status;
+	}
+
 	template <typename... Backoff>
 	queue_op_status try_pop(value_type &value, Backoff... backoff)
 	{
@@ -0,0 +1,261 @@
+//
+// Work-Stealing Thread Pool
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_THREAD_POOL_H_
+#define EVENK_THREAD_POOL_H_
+
+//
+// Every worker thread owns a work-stealing deque. Tasks submitted from a
+// worker thread go to its own deque, tasks submitted from other threads
+// go to a shared unbounded queue. An idle worker looks at its own deque,
+// then at the shared queue, then tries to steal from the other workers.
+// If nothing is found it spins according to the Backoff policy and once
+// the policy gives up it parks on an event count until some task is submitted.
+//
+// The destructor waits until all the submitted tasks are executed. If a
+// task throws an exception std::terminate() is called as with std::thread.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "backoff.h"
+#include "basic.h"
+#include "conqueue.h"
+#include "synch.h"
+#include "unbounded_queue.h"
+#include "work_stealing_deque.h"
+
+namespace evenk {
+
+template <typename Backoff = no_backoff>
+class thread_pool : non_copyable
+{
+public:
+	using task_type = std::function<void()>;
+
+	thread_pool(std::size_t nthreads, Backoff backoff = Backoff())
+		: workers_{nullptr},
+		  nworkers_{0},
+		  backoff_{backoff},
+		  stopped_{false}
+	{
+		if (nthreads == 0)
+			throw std::invalid_argument("thread_pool must have some threads");
+
+		void *workers;
+		if (::posix_memalign(&workers, cache_line_size, nthreads * sizeof(worker)))
+			throw std::bad_alloc();
+		workers_ = static_cast<worker *>(workers);
+		for (; nworkers_ < nthreads; nworkers_++)
+			new (&workers_[nworkers_]) worker(this);
+
+		try {
+			for (std::size_t i = 0; i < nthreads; i++)
+				workers_[i].thread =
+					std::thread(&thread_pool::run, this, std::ref(workers_[i]));
+		} catch (...) {
+			destroy();
+			throw;
+		}
+	}
+
+	~thread_pool()
+	{
+		destroy();
+	}
+
+	std::size_t size() const
+	{
+		return nworkers_;
+	}
+
+	void submit(task_type &&fn)
+	{
+		task *t = new task{std::move(fn)};
+		worker *w = current_worker();
+		if (w != nullptr && w->pool == this) {
+			w->tasks.push(t);
+		} else {
+			try {
+				shared_.push(t);
+			} catch (...) {
+				delete t;
+				throw;
+			}
+		}
+		notify();
+	}
+
+	void submit(const task_type &fn)
+	{
+		submit(task_type(fn));
+	}
+
+private:
+	struct task
+	{
+		task_type fn;
+	};
+
+	struct alignas(cache_line_size) worker
+	{
+		worker(thread_pool *p) : pool{p}
+		{
+		}
+
+		thread_pool *const pool;
+		work_stealing_deque<task *> tasks;
+		std::thread thread;
+	};
+
+	static worker *&current_worker()
+	{
+		static thread_local worker *current = nullptr;
+		return current;
+	}
+
+	void destroy()
+	{
+		stopped_.store(true, std::memory_order_seq_cst);
+		shared_.close();
+		idle_.notify_all();
+
+		for (std::size_t i = 0; i < nworkers_; i++) {
+			if (workers_[i].thread.joinable())
+				workers_[i].thread.join();
+		}
+
+		for (std::size_t i = 0; i < nworkers_; i++)
+			workers_[i].~worker();
+		std::free(workers_);
+	}
+
+	void notify()
+	{
+		idle_.notify_one();
+	}
+
+	void run(worker &self)
+	{
+		current_worker() = &self;
+		for (;;) {
+			task *t = find_task(self);
+			if (t == nullptr && (t = wait_task(self)) == nullptr)
+				break;
+			execute(t);
+		}
+		current_worker() = nullptr;
+	}
+
+	// Returns nullptr if the pool is stopped and there are no more tasks.
+	task *wait_task(worker &self)
+	{
+		Backoff backoff = backoff_;
+		bool waiting = false;
+		for (;;) {
+			bool stopped = stopped_.load(std::memory_order_acquire);
+			task *t = find_task(self);
+			if (t != nullptr)
+				return t;
+			if (stopped)
+				return nullptr;
+			if (waiting)
+				park();
+			else
+				waiting = backoff();
+		}
+	}
+
+	void execute(task *t)
+	{
+		t->fn();
+		delete t;
+	}
+
+	task *find_task(worker &self)
+	{
+		task *t = nullptr;
+		if (self.tasks.pop(t) == queue_op_status::success)
+			return t;
+		if (shared_.try_pop(t) == queue_op_status::success)
+			return t;
+
+		std::size_t index = &self - workers_;
+		for (;;) {
+			bool busy = false;
+			for (std::size_t i = 1; i < nworkers_; i++) {
+				worker &victim = workers_[(index + i) % nworkers_];
+				auto status = victim.tasks.steal(t);
+				if (status == queue_op_status::success)
+					return t;
+				if (status == queue_op_status::busy)
+					busy = true;
+			}
+			if (!busy)
+				return nullptr;
+		}
+	}
+
+	bool has_tasks() const
+	{
+		if (!shared_.is_empty())
+			return true;
+		for (std::size_t i = 0; i < nworkers_; i++) {
+			if (!workers_[i].tasks.is_empty())
+				return true;
+		}
+		return false;
+	}
+
+	void park()
+	{
+		event_count::key_type key = idle_.prepare_wait();
+		if (has_tasks() || stopped_.load(std::memory_order_acquire))
+			idle_.cancel_wait();
+		else
+			idle_.commit_wait(key);
+	}
+
+	worker *workers_;
+	std::size_t nworkers_;
+
+	const Backoff backoff_;
+
+	unbounded_queue<task *> shared_;
+
+	std::atomic<bool> stopped_;
+
+	alignas(cache_line_size) event_count idle_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_THREAD_POOL_H_
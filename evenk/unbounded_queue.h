@@ -0,0 +1,643 @@
+//
+// Fast Unbounded Concurrent Queue
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_UNBOUNDED_QUEUE_H_
+#define EVENK_UNBOUNDED_QUEUE_H_
+
+//
+// The queue is a linked list of segments. Every segment is an array of
+// slots that works like a bounded_queue ring that is passed only once.
+// Producers and consumers take tickets from the global tail and head
+// counters and then find the segment that corresponds to the ticket.
+// A slot is initially empty and becomes full when its producer stores
+// bq_ticket_step into it, the same Ticket wait strategies as in the
+// bounded_queue apply.
+//
+// A segment is retired when all of its slots have been consumed, and the
+// segments before it have been retired. Retired segments are recycled
+// through a free list and are only released to the system when the queue
+// is destroyed. So a thread that looks at a stale segment never touches
+// freed memory. The segment state word contains the segment number and
+// is validated on every step of the list traversal. Linking a new segment
+// requires a pin on the current last segment to guarantee that it is not
+// recycled in the middle of the operation. A pinned segment is recycled
+// by the thread that drops the last pin.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+#include "backoff.h"
+#include "basic.h"
+#include "bounded_queue.h"
+#include "conqueue.h"
+#include "spinlock.h"
+
+namespace evenk {
+
+template <typename Value, typename Ticket = bq_slot, typename Layout = bq_padded_layout>
+class unbounded_queue : non_copyable
+{
+public:
+	using value_type = Value;
+	using reference = value_type &;
+	using const_reference = const value_type &;
+
+	unbounded_queue(std::uint32_t segment_size = 1024)
+		: mask_{segment_size - 1},
+		  shift_{0},
+		  layout_{segment_size, sizeof(ring_slot)},
+		  closed_{false},
+		  shared_{closed_},
+		  free_list_{nullptr},
+		  retire_pending_{false},
+		  head_{0},
+		  tail_{0}
+	{
+		if (segment_size == 0 || (segment_size & mask_) != 0)
+			throw std::invalid_argument(
+				"unbounded_queue segment size must be a power of two");
+		while ((std::uint32_t(1) << shift_) < segment_size)
+			shift_++;
+
+		segment *seg = allocate_segment(0);
+		head_segment_.store(seg, std::memory_order_relaxed);
+		tail_segment_.store(seg, std::memory_order_relaxed);
+	}
+
+	~unbounded_queue()
+	{
+		segment *seg = head_segment_.load(std::memory_order_relaxed);
+		while (seg != nullptr) {
+			segment *next = seg->next.load(std::memory_order_relaxed);
+			destroy_segment(seg);
+			seg = next;
+		}
+		seg = free_list_.load(std::memory_order_relaxed);
+		while (seg != nullptr) {
+			segment *next = seg->free_next;
+			destroy_segment(seg);
+			seg = next;
+		}
+	}
+
+	void close()
+	{
+		closed_.store(true, std::memory_order_seq_cst);
+
+		// Wake the consumers that wait for values that will never come.
+		if (Ticket::shared_wake) {
+			shared_.wake();
+			return;
+		}
+		std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
+		std::uint64_t head = head_.load(std::memory_order_seq_cst);
+		for (; tail < head; tail++) {
+			bool stale;
+			segment *seg;
+			do
+				seg = lookup_segment(segment_number(tail), stale);
+			while (stale);
+			if (seg == nullptr)
+				break;
+			seg->slot(layout_.position(tail & mask_)).wake();
+		}
+	}
+
+	bool is_closed() const
+	{
+		return closed_.load(std::memory_order_relaxed);
+	}
+
+	bool is_empty() const
+	{
+		int64_t head = head_.load(std::memory_order_relaxed);
+		int64_t tail = tail_.load(std::memory_order_relaxed);
+		return (tail <= head);
+	}
+
+	bool is_full() const
+	{
+		return false;
+	}
+
+	bool is_lock_free() const
+	{
+		return Ticket::is_lock_free;
+	}
+
+	void push(value_type &&value)
+	{
+		auto status = wait_push(std::move(value));
+		if (status != queue_op_status::success)
+			throw status;
+	}
+
+	void push(const value_type &value)
+	{
+		auto status = wait_push(value);
+		if (status != queue_op_status::success)
+			throw status;
+	}
+
+	queue_op_status wait_push(value_type &&value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
+		put_value(claim_slot(tail), std::move(value));
+		return queue_op_status::success;
+	}
+
+	queue_op_status wait_push(const value_type &value)
+	{
+		if (is_closed())
+			return queue_op_status::closed;
+		const std::uint64_t tail = tail_.fetch_add(1, std::memory_order_relaxed);
+		put_value(claim_slot(tail), value);
+		return queue_op_status::success;
+	}
+
+	queue_op_status try_push(value_type &&value)
+	{
+		return wait_push(std::move(value));
+	}
+
+	queue_op_status try_push(const value_type &value)
+	{
+		return wait_push(value);
+	}
+
+	queue_op_status nonblocking_push(value_type &&value)
+	{
+		return wait_push(std::move(value));
+	}
+
+	queue_op_status nonblocking_push(const value_type &value)
+	{
+		return wait_push(value);
+	}
+
+	template <typename... Backoff>
+	value_type value_pop(Backoff... backoff)
+	{
+		value_type value;
+		auto status = wait_pop(value, std::forward<Backoff>(backoff)...);
+		if (status != queue_op_status::success)
+			throw status;
+		return value;
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		if (is_closed() && is_empty())
+			return queue_op_status::closed;
+		for (;;) {
+			const std::uint64_t head = head_.fetch_add(1, std::memory_order_relaxed);
+			segment *seg = find_segment(segment_number(head), head_segment_);
+			ring_slot &slot = seg->slot(layout_.position(head & mask_));
+			bq_status status = wait_head(slot, head, backoff...);
+			if (status == bq_closed)
+				return queue_op_status::closed;
+			if (get_value(seg, slot, status, value) == bq_normal)
+				return queue_op_status::success;
+		}
+	}
+
+	template <typename... Backoff>
+	queue_op_status try_pop(value_type &value, Backoff... backoff)
+	{
+		return claim_and_pop(value, true, backoff...);
+	}
+
+	queue_op_status nonblocking_pop(value_type &value)
+	{
+		return claim_and_pop(value, false);
+	}
+
+private:
+	static constexpr std::uint64_t pin_mask = 0x7fffffff;
+	static constexpr std::uint64_t retired_bit = 0x80000000;
+	static constexpr std::uint32_t number_shift = 32;
+
+	struct alignas(Layout::slot_alignment) alignas(Ticket) alignas(Value) ring_slot
+		: public Ticket
+	{
+		value_type value;
+	};
+
+	struct alignas(cache_line_size) segment
+	{
+		// The segment number, the retired flag, and the pin count.
+		std::atomic<std::uint64_t> state;
+		std::atomic<segment *> next;
+		segment *free_next;
+
+		alignas(cache_line_size) std::atomic<std::uint32_t> consumed;
+
+		ring_slot &slot(std::uint32_t index)
+		{
+			return reinterpret_cast<ring_slot *>(this + 1)[index];
+		}
+	};
+
+	static std::uint32_t state_number(std::uint64_t state)
+	{
+		return state >> number_shift;
+	}
+
+	std::uint32_t segment_number(std::uint64_t ticket) const
+	{
+		return ticket >> shift_;
+	}
+
+	//
+	// Segment memory management.
+	//
+
+	segment *allocate_segment(std::uint32_t serial)
+	{
+		segment *seg = pop_free_segment();
+		if (seg == nullptr) {
+			std::uint32_t size = mask_ + 1;
+			void *memory;
+			if (::posix_memalign(&memory,
+					     cache_line_size,
+					     sizeof(segment) + size * sizeof(ring_slot)))
+				throw std::bad_alloc();
+
+			seg = new (memory) segment;
+			for (std::uint32_t i = 0; i < size; i++) {
+				new (&seg->slot(i)) ring_slot();
+				seg->slot(i).attach(shared_);
+			}
+		}
+
+		// A stale reader may still look at a recycled segment. Change the
+		// segment number before anything else so that it notices.
+		seg->state.store(std::uint64_t(serial) << number_shift,
+				 std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		seg->next.store(nullptr, std::memory_order_relaxed);
+		seg->consumed.store(0, std::memory_order_relaxed);
+		for (std::uint32_t i = 0; i <= mask_; i++)
+			seg->slot(i).initialize(0);
+		return seg;
+	}
+
+	void destroy_segment(segment *seg)
+	{
+		for (std::uint32_t i = 0; i <= mask_; i++)
+			seg->slot(i).~ring_slot();
+		seg->~segment();
+		std::free(seg);
+	}
+
+	void push_free_segment(segment *seg)
+	{
+		segment *top = free_list_.load(std::memory_order_relaxed);
+		do
+			seg->free_next = top;
+		while (!free_list_.compare_exchange_weak(
+			top, seg, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	segment *pop_free_segment()
+	{
+		// There is at most one thread that pops segments at any time so
+		// the ABA problem is impossible. If the lock is taken then simply
+		// allocate a new segment rather than wait.
+		if (!free_lock_.try_lock())
+			return nullptr;
+		segment *top = free_list_.load(std::memory_order_acquire);
+		while (top != nullptr
+		       && !free_list_.compare_exchange_weak(top,
+							    top->free_next,
+							    std::memory_order_acquire,
+							    std::memory_order_acquire))
+			;
+		free_lock_.unlock();
+		return top;
+	}
+
+	bool pin_segment(segment *seg, std::uint32_t serial)
+	{
+		std::uint64_t state = seg->state.load(std::memory_order_acquire);
+		do {
+			if (state_number(state) != serial || (state & retired_bit) != 0)
+				return false;
+		} while (!seg->state.compare_exchange_weak(
+			state, state + 1, std::memory_order_acquire, std::memory_order_acquire));
+		return true;
+	}
+
+	void unpin_segment(segment *seg)
+	{
+		std::uint64_t state = seg->state.fetch_sub(1, std::memory_order_acq_rel);
+		if ((state & retired_bit) != 0 && (state & pin_mask) == 1)
+			push_free_segment(seg);
+	}
+
+	void retire_segment(segment *seg)
+	{
+		std::uint64_t state = seg->state.fetch_or(retired_bit, std::memory_order_acq_rel);
+		if ((state & pin_mask) == 0)
+			push_free_segment(seg);
+	}
+
+	// Advance the head segment past all the fully consumed segments. Only
+	// one thread at a time does this, others just leave a note for it.
+	void retire_segments()
+	{
+		retire_pending_.store(true, std::memory_order_seq_cst);
+		while (retire_pending_.load(std::memory_order_seq_cst) && retire_lock_.try_lock()) {
+			retire_pending_.store(false, std::memory_order_relaxed);
+			segment *seg = head_segment_.load(std::memory_order_relaxed);
+			while (seg->consumed.load(std::memory_order_seq_cst) > mask_) {
+				segment *next = seg->next.load(std::memory_order_acquire);
+				if (next == nullptr)
+					break;
+				head_segment_.store(next, std::memory_order_release);
+				retire_segment(seg);
+				seg = next;
+			}
+			retire_lock_.unlock();
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+	}
+
+	//
+	// Segment lookup.
+	//
+
+	// Find the segment for a claimed ticket creating it if needed. The
+	// segment cannot be retired until the ticket is served so the result
+	// stays valid.
+	segment *find_segment(std::uint32_t target, std::atomic<segment *> &hint)
+	{
+		segment *seg = hint.load(std::memory_order_acquire);
+		std::uint64_t state = seg->state.load(std::memory_order_acquire);
+		for (;;) {
+			std::uint32_t current = state_number(state);
+			std::int32_t distance = target - current;
+			if (distance == 0)
+				return seg;
+
+			if (distance > 0) {
+				segment *next = seg->next.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (seg->state.load(std::memory_order_relaxed) >> number_shift
+				    == current) {
+					if (next == nullptr)
+						next = extend_segment(seg, current);
+					if (next != nullptr) {
+						state = next->state.load(std::memory_order_acquire);
+						if (state_number(state) == current + 1) {
+							seg = next;
+							continue;
+						}
+					}
+				}
+			}
+
+			// The segment was recycled under our feet, start over.
+			seg = head_segment_.load(std::memory_order_acquire);
+			state = seg->state.load(std::memory_order_acquire);
+		}
+	}
+
+	// Find the segment for a ticket that is not claimed yet. If the ticket
+	// is already served by someone else the segment might be gone, this
+	// is reported as stale.
+	segment *lookup_segment(std::uint32_t target, bool &stale)
+	{
+		stale = false;
+		segment *seg = head_segment_.load(std::memory_order_acquire);
+		std::uint64_t state = seg->state.load(std::memory_order_acquire);
+		for (;;) {
+			std::uint32_t current = state_number(state);
+			std::int32_t distance = target - current;
+			if (distance == 0)
+				return seg;
+			if (distance < 0)
+				break;
+
+			segment *next = seg->next.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seg->state.load(std::memory_order_relaxed) >> number_shift != current)
+				break;
+			if (next == nullptr)
+				return nullptr;
+			state = next->state.load(std::memory_order_acquire);
+			if (state_number(state) != current + 1)
+				break;
+			seg = next;
+		}
+		stale = true;
+		return nullptr;
+	}
+
+	segment *extend_segment(segment *seg, std::uint32_t serial)
+	{
+		if (!pin_segment(seg, serial))
+			return nullptr;
+
+		segment *next = seg->next.load(std::memory_order_acquire);
+		if (next == nullptr) {
+			segment *fresh = allocate_segment(serial + 1);
+			if (seg->next.compare_exchange_strong(next,
+							      fresh,
+							      std::memory_order_acq_rel,
+							      std::memory_order_acquire)) {
+				next = fresh;
+				segment *last = seg;
+				tail_segment_.compare_exchange_strong(last,
+								      fresh,
+								      std::memory_order_release,
+								      std::memory_order_relaxed);
+			} else {
+				fresh->state.fetch_or(retired_bit, std::memory_order_relaxed);
+				push_free_segment(fresh);
+			}
+		}
+
+		unpin_segment(seg);
+		return next;
+	}
+
+	ring_slot &claim_slot(std::uint64_t tail)
+	{
+		segment *seg = find_segment(segment_number(tail), tail_segment_);
+		return seg->slot(layout_.position(tail & mask_));
+	}
+
+	//
+	// Value transfer.
+	//
+
+	static void pause()
+	{
+	}
+
+	template <typename Backoff>
+	static void pause(Backoff &backoff)
+	{
+		backoff();
+	}
+
+	template <typename... Backoff>
+	queue_op_status claim_and_pop(value_type &value, bool retry, Backoff... backoff)
+	{
+		std::uint64_t head = head_.load(std::memory_order_relaxed);
+		for (;;) {
+			bool stale;
+			segment *seg = lookup_segment(segment_number(head), stale);
+			if (stale) {
+				head = head_.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			std::uint32_t ticket = bq_normal;
+			if (seg != nullptr)
+				ticket = seg->slot(layout_.position(head & mask_)).load();
+			if ((ticket & bq_ticket_mask) != bq_ticket_step) {
+				if (is_closed()) {
+					std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
+					if (head >= tail)
+						return queue_op_status::closed;
+				}
+				return queue_op_status::empty;
+			}
+
+			if (head_.compare_exchange_strong(head,
+							  head + 1,
+							  std::memory_order_relaxed,
+							  std::memory_order_relaxed)) {
+				ring_slot &slot = seg->slot(layout_.position(head & mask_));
+				bq_status status = bq_status(ticket & bq_status_mask);
+				if (get_value(seg, slot, status, value) == bq_normal)
+					return queue_op_status::success;
+				head = head_.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			if (!retry)
+				return queue_op_status::busy;
+			pause(backoff...);
+		}
+	}
+
+	bq_status wait_head(ring_slot &slot, std::uint64_t head)
+	{
+		std::uint32_t current_ticket = slot.load();
+		while ((current_ticket & bq_ticket_mask) != bq_ticket_step) {
+			if (is_closed()) {
+				std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
+				if (head >= tail)
+					return bq_closed;
+			}
+			current_ticket = slot.wait_and_load(current_ticket);
+		}
+		return bq_status(current_ticket & bq_status_mask);
+	}
+
+	template <typename Backoff>
+	bq_status wait_head(ring_slot &slot, std::uint64_t head, Backoff backoff)
+	{
+		bool waiting = false;
+		std::uint32_t current_ticket = slot.load();
+		while ((current_ticket & bq_ticket_mask) != bq_ticket_step) {
+			if (is_closed()) {
+				std::uint64_t tail = tail_.load(std::memory_order_seq_cst);
+				if (head >= tail)
+					return bq_closed;
+			}
+			if (waiting) {
+				current_ticket = slot.wait_and_load(current_ticket);
+			} else {
+				waiting = backoff();
+				current_ticket = slot.load();
+			}
+		}
+		return bq_status(current_ticket & bq_status_mask);
+	}
+
+	template <typename V>
+	void put_value(ring_slot &slot, V &&value)
+	{
+		try {
+			slot.value = std::forward<V>(value);
+		} catch (...) {
+			slot.store_and_wake(bq_ticket_step | bq_invalid);
+			throw;
+		}
+		slot.store_and_wake(bq_ticket_step);
+	}
+
+	bq_status get_value(segment *seg, ring_slot &slot, bq_status status, value_type &value)
+	{
+		if (status == bq_normal) {
+			try {
+				value = std::move(slot.value);
+			} catch (...) {
+				consume(seg);
+				throw;
+			}
+		}
+		consume(seg);
+		return status;
+	}
+
+	void consume(segment *seg)
+	{
+		if (seg->consumed.fetch_add(1, std::memory_order_seq_cst) == mask_)
+			retire_segments();
+	}
+
+	const std::uint32_t mask_;
+	std::uint32_t shift_;
+	const Layout layout_;
+
+	std::atomic<bool> closed_;
+	typename Ticket::shared_state shared_;
+
+	alignas(cache_line_size) std::atomic<segment *> head_segment_;
+	alignas(cache_line_size) std::atomic<segment *> tail_segment_;
+
+	alignas(cache_line_size) std::atomic<segment *> free_list_;
+	tatas_lock free_lock_;
+	tatas_lock retire_lock_;
+	std::atomic<bool> retire_pending_;
+
+	alignas(cache_line_size) std::atomic<std::uint64_t> head_;
+	alignas(cache_line_size) std::atomic<std::uint64_t> tail_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_UNBOUNDED_QUEUE_H_
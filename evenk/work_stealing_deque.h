@@ -0,0 +1,188 @@
+//
+// Work-Stealing Deque
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_WORK_STEALING_DEQUE_H_
+#define EVENK_WORK_STEALING_DEQUE_H_
+
+//
+// The code in this file is based on the following papers:
+//    D. Chase, Y. Lev. Dynamic Circular Work-Stealing Deque. SPAA 2005.
+//    N. M. Le, A. Pop, A. Cohen, F. Zappa Nardelli. Correct and Efficient
+//    Work-Stealing for Weak Memory Models. PPoPP 2013.
+//
+// The deque owner pushes and pops values at the bottom end in LIFO order.
+// Any other thread may steal values from the top end in FIFO order. The
+// values are read speculatively by thieves so they must be trivially
+// copyable, typically these are pointers to some task objects.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "basic.h"
+#include "conqueue.h"
+
+namespace evenk {
+
+template <typename Value>
+class work_stealing_deque : non_copyable
+{
+public:
+	using value_type = Value;
+
+	static_assert(std::is_trivially_copyable<Value>::value,
+		      "work_stealing_deque requires trivially copyable values");
+
+	work_stealing_deque(std::size_t size = 1024) : top_{0}, bottom_{0}
+	{
+		if (size == 0 || (size & (size - 1)) != 0)
+			throw std::invalid_argument(
+				"work_stealing_deque size must be a power of two");
+		array_.store(new ring(size), std::memory_order_relaxed);
+	}
+
+	~work_stealing_deque()
+	{
+		delete array_.load(std::memory_order_relaxed);
+		for (ring *r : retired_)
+			delete r;
+	}
+
+	bool is_empty() const
+	{
+		std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+		std::int64_t top = top_.load(std::memory_order_relaxed);
+		return bottom <= top;
+	}
+
+	// Owner only.
+	void push(value_type value)
+	{
+		std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+		std::int64_t top = top_.load(std::memory_order_acquire);
+		ring *r = array_.load(std::memory_order_relaxed);
+		if (bottom - top > std::int64_t(r->mask))
+			r = grow(r, top, bottom);
+		r->put(bottom, value);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom_.store(bottom + 1, std::memory_order_relaxed);
+	}
+
+	// Owner only.
+	queue_op_status pop(value_type &value)
+	{
+		std::int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+		ring *r = array_.load(std::memory_order_relaxed);
+		bottom_.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t top = top_.load(std::memory_order_relaxed);
+
+		if (top > bottom) {
+			bottom_.store(bottom + 1, std::memory_order_relaxed);
+			return queue_op_status::empty;
+		}
+
+		value = r->get(bottom);
+		if (top == bottom) {
+			// The last value, race against thieves for it.
+			bool won = top_.compare_exchange_strong(top,
+								top + 1,
+								std::memory_order_seq_cst,
+								std::memory_order_relaxed);
+			bottom_.store(bottom + 1, std::memory_order_relaxed);
+			if (!won)
+				return queue_op_status::empty;
+		}
+		return queue_op_status::success;
+	}
+
+	// Any thread. Returns busy if lost a race against another thread.
+	queue_op_status steal(value_type &value)
+	{
+		std::int64_t top = top_.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t bottom = bottom_.load(std::memory_order_acquire);
+		if (top >= bottom)
+			return queue_op_status::empty;
+
+		ring *r = array_.load(std::memory_order_acquire);
+		value_type result = r->get(top);
+		if (!top_.compare_exchange_strong(
+			    top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return queue_op_status::busy;
+		value = result;
+		return queue_op_status::success;
+	}
+
+private:
+	struct ring
+	{
+		ring(std::size_t size) : mask{size - 1}, items{new std::atomic<value_type>[size]}
+		{
+		}
+
+		~ring()
+		{
+			delete[] items;
+		}
+
+		void put(std::int64_t index, value_type value)
+		{
+			items[index & mask].store(value, std::memory_order_relaxed);
+		}
+
+		value_type get(std::int64_t index)
+		{
+			return items[index & mask].load(std::memory_order_relaxed);
+		}
+
+		const std::size_t mask;
+		std::atomic<value_type> *const items;
+	};
+
+	ring *grow(ring *r, std::int64_t top, std::int64_t bottom)
+	{
+		ring *bigger = new ring(2 * (r->mask + 1));
+		for (std::int64_t i = top; i < bottom; i++)
+			bigger->put(i, r->get(i));
+		array_.store(bigger, std::memory_order_release);
+
+		// Thieves might still read from the old array so it is kept
+		// around until the deque is destroyed.
+		retired_.push_back(r);
+		return bigger;
+	}
+
+	alignas(cache_line_size) std::atomic<std::int64_t> top_;
+	alignas(cache_line_size) std::atomic<std::int64_t> bottom_;
+	std::atomic<ring *> array_;
+	std::vector<ring *> retired_;
+};
+
+} // namespace evenk
+
+#endif // !EVENK_WORK_STEALING_DEQUE_H_
@@ -0,0 +1,345 @@
+//
+// Benchmark Harness
+//
+// Copyright (c) 2015-2016  Aleksey Demakov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#ifndef EVENK_TESTS_BENCH_H_
+#define EVENK_TESTS_BENCH_H_
+
+//
+// Common parts of the lock and queue benchmarks: latency histograms, thread
+// pinning, a gate that separates warm-up from measurement, and reporting in
+// text, CSV, or JSON form.
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace harness {
+
+//
+// A log-linear histogram of nanosecond values. Every power of two range is
+// split into 32 buckets so a reported value is off by 3% at most.
+//
+
+class latency_histogram
+{
+public:
+	latency_histogram() : buckets_(bucket_count, 0), count_{0}, max_{0}
+	{
+	}
+
+	void record(std::uint64_t value)
+	{
+		buckets_[bucket_index(value)]++;
+		count_++;
+		if (max_ < value)
+			max_ = value;
+	}
+
+	void merge(const latency_histogram &other)
+	{
+		for (std::size_t i = 0; i < bucket_count; i++)
+			buckets_[i] += other.buckets_[i];
+		count_ += other.count_;
+		if (max_ < other.max_)
+			max_ = other.max_;
+	}
+
+	std::uint64_t count() const
+	{
+		return count_;
+	}
+
+	std::uint64_t max() const
+	{
+		return max_;
+	}
+
+	// The upper bound of the bucket that holds the given fraction of
+	// all the values.
+	std::uint64_t percentile(double fraction) const
+	{
+		if (count_ == 0)
+			return 0;
+		std::uint64_t rank = std::uint64_t(fraction * count_ + 0.5);
+		if (rank == 0)
+			rank = 1;
+		std::uint64_t total = 0;
+		for (std::size_t i = 0; i < bucket_count; i++) {
+			total += buckets_[i];
+			if (total >= rank) {
+				std::uint64_t upper = bucket_start(i + 1) - 1;
+				return upper < max_ ? upper : max_;
+			}
+		}
+		return max_;
+	}
+
+private:
+	static constexpr unsigned sub_bits = 5;
+	static constexpr std::size_t sub_count = std::size_t(1) << sub_bits;
+	static constexpr std::size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+	static std::size_t bucket_index(std::uint64_t value)
+	{
+		if (value < sub_count)
+			return value;
+		unsigned msb = 63 - __builtin_clzll(value);
+		std::size_t group = msb - sub_bits + 1;
+		std::size_t mantissa = value >> (msb - sub_bits);
+		return group * sub_count + (mantissa - sub_count);
+	}
+
+	static std::uint64_t bucket_start(std::size_t index)
+	{
+		std::size_t group = index / sub_count;
+		if (group == 0)
+			return index;
+		std::uint64_t mantissa = index % sub_count + sub_count;
+		return mantissa << (group - 1);
+	}
+
+	std::vector<std::uint64_t> buckets_;
+	std::uint64_t count_;
+	std::uint64_t max_;
+};
+
+inline std::uint64_t
+nanoseconds_since(std::chrono::steady_clock::time_point start)
+{
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+inline void
+pin_this_thread(unsigned cpu)
+{
+#if __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % std::thread::hardware_concurrency(), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#else
+	(void) cpu;
+#endif
+}
+
+//
+// The workers pass the gate after the warm-up. The driver opens the gate
+// when they all get there and starts the clock.
+//
+
+class gate
+{
+public:
+	explicit gate(unsigned nthreads) : nthreads_{nthreads}, ready_{0}, open_{false}
+	{
+	}
+
+	void ready()
+	{
+		ready_.fetch_add(1, std::memory_order_acq_rel);
+		while (!is_open())
+			std::this_thread::yield();
+	}
+
+	bool is_open() const
+	{
+		return open_.load(std::memory_order_acquire);
+	}
+
+	void wait_ready() const
+	{
+		while (ready_.load(std::memory_order_acquire) < nthreads_)
+			std::this_thread::yield();
+	}
+
+	void open()
+	{
+		opened_at_ = std::chrono::steady_clock::now();
+		open_.store(true, std::memory_order_release);
+	}
+
+	// Valid once is_open() returns true.
+	std::chrono::steady_clock::time_point opened_at() const
+	{
+		return opened_at_;
+	}
+
+private:
+	const unsigned nthreads_;
+	std::atomic<unsigned> ready_;
+	std::atomic<bool> open_;
+	std::chrono::steady_clock::time_point opened_at_;
+};
+
+//
+// Options shared by all the benchmarks.
+//
+
+enum class output_format { text, csv, json };
+
+struct options
+{
+	// Measured operations per thread.
+	std::size_t ops = 0;
+	// Unmeasured operations per thread done first.
+	std::size_t warmup = 1000;
+	// Pin every thread to its own CPU.
+	bool pin = false;
+	// Only run benchmarks with this in the name.
+	std::string filter;
+	output_format format = output_format::text;
+
+	bool selected(const std::string &name) const
+	{
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+};
+
+inline std::size_t
+parse_number(const char *program, const char *option, const char *arg)
+{
+	char *end;
+	unsigned long long value = std::strtoull(arg, &end, 0);
+	if (*arg == 0 || *end != 0) {
+		std::cerr << program << ": invalid " << option << " value '" << arg << "'\n";
+		std::exit(1);
+	}
+	return value;
+}
+
+inline output_format
+parse_format(const char *program, const char *arg)
+{
+	if (std::strcmp(arg, "text") == 0)
+		return output_format::text;
+	if (std::strcmp(arg, "csv") == 0)
+		return output_format::csv;
+	if (std::strcmp(arg, "json") == 0)
+		return output_format::json;
+	std::cerr << program << ": invalid format '" << arg << "'\n";
+	std::exit(1);
+}
+
+//
+// Results are reported per operation kind, e.g. push and pop for queues.
+//
+
+struct result
+{
+	std::string name;
+	std::string op;
+	unsigned threads;
+	double seconds;
+	latency_histogram latency;
+};
+
+class reporter
+{
+public:
+	explicit reporter(output_format format) : format_{format}, rows_{0}
+	{
+		if (format_ == output_format::csv)
+			std::cout << "name,op,threads,ops,seconds,ops_per_sec,"
+				     "p50_ns,p99_ns,p999_ns,max_ns\n";
+		else if (format_ == output_format::json)
+			std::cout << "[";
+	}
+
+	~reporter()
+	{
+		if (format_ == output_format::json)
+			std::cout << "\n]\n";
+	}
+
+	// Free form text that only goes to the text output.
+	void note(const std::string &text)
+	{
+		if (format_ == output_format::text)
+			std::cout << text << "\n";
+	}
+
+	// Errors go to stderr unless the output is text.
+	void error(const std::string &name, const std::string &text)
+	{
+		if (format_ == output_format::text)
+			std::cout << name << ": " << text << "\n";
+		else
+			std::cerr << name << ": " << text << "\n";
+	}
+
+	void add(const result &r)
+	{
+		std::uint64_t ops = r.latency.count();
+		double rate = r.seconds > 0 ? ops / r.seconds : 0;
+		std::uint64_t p50 = r.latency.percentile(0.5);
+		std::uint64_t p99 = r.latency.percentile(0.99);
+		std::uint64_t p999 = r.latency.percentile(0.999);
+		std::uint64_t max = r.latency.max();
+
+		switch (format_) {
+		case output_format::text:
+			std::cout << r.name << " " << r.op << ": threads=" << r.threads
+				  << ", ops=" << ops << ", seconds=" << r.seconds
+				  << ", ops/sec=" << std::uint64_t(rate) << ", p50=" << p50
+				  << "ns, p99=" << p99 << "ns, p99.9=" << p999
+				  << "ns, max=" << max << "ns\n";
+			break;
+		case output_format::csv:
+			std::cout << '"' << r.name << "\"," << r.op << "," << r.threads << ","
+				  << ops << "," << r.seconds << "," << std::uint64_t(rate) << ","
+				  << p50 << "," << p99 << "," << p999 << "," << max << "\n";
+			break;
+		case output_format::json:
+			std::cout << (rows_ ? ",\n" : "\n") << "  {\"name\": \"" << r.name
+				  << "\", \"op\": \"" << r.op << "\", \"threads\": " << r.threads
+				  << ", \"ops\": " << ops << ", \"seconds\": " << r.seconds
+				  << ", \"ops_per_sec\": " << std::uint64_t(rate)
+				  << ", \"p50_ns\": " << p50 << ", \"p99_ns\": " << p99
+				  << ", \"p999_ns\": " << p999 << ", \"max_ns\": " << max << "}";
+			break;
+		}
+		rows_++;
+	}
+
+private:
+	const output_format format_;
+	std::size_t rows_;
+};
+
+} // namespace harness
+
+#endif // !EVENK_TESTS_BENCH_H_
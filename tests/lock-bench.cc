@@ -1,17 +1,52 @@
+#include "bench.h"
+
+#include "evenk/elided_lock.h"
+#include "evenk/seqlock.h"
 #include "evenk/spinlock.h"
 #include "evenk/synch.h"
 
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <getopt.h>
+
+#if __cplusplus >= 201402L
+#include <shared_mutex>
+#endif
+
 std::mutex mutex;
 evenk::posix_mutex posix_mutex;
 evenk::spin_lock spin_lock;
 evenk::tatas_lock tatas_lock;
 evenk::ticket_lock ticket_lock;
 evenk::futex_lock futex_lock;
+evenk::futex_ticket_lock futex_ticket_lock;
+evenk::basic_futex_lock<evenk::futex_private, evenk::sharded_stats<>> futex_stats_lock;
+evenk::elided_lock<evenk::tatas_lock> elided_tatas_lock;
+evenk::elided_lock<evenk::futex_lock, evenk::sharded_stats<>> elided_futex_lock;
+evenk::mcs_lock mcs_lock;
+evenk::clh_lock clh_lock;
+
+#if __cplusplus >= 201402L
+std::shared_timed_mutex shared_timed_mutex;
+#endif
+evenk::shared_futex_lock shared_futex_lock;
+evenk::rw_spin_lock rw_spin_lock;
+
+struct snapshot
+{
+	std::uint64_t first;
+	std::uint64_t second;
+};
+
+evenk::seqlock<snapshot, evenk::tatas_lock> tatas_seqlock;
+#if __linux__
+evenk::seqlock<snapshot, evenk::futex_lock> futex_seqlock;
+#endif
 
 evenk::no_backoff no_backoff;
 evenk::yield_backoff yield_backoff;
@@ -29,55 +64,347 @@ evenk::const_backoff<evenk::cpu_relax> const_relax_x8_backoff(8);
 evenk::linear_backoff<evenk::cpu_relax> linear_relax_backoff(10, 2);
 evenk::exponential_backoff<evenk::cpu_relax> exponential_relax_backoff(5);
 evenk::proportional_backoff<evenk::cpu_relax> proportional_relax_backoff(1);
+evenk::jittered_backoff<evenk::cpu_relax> jittered_relax_backoff(5);
+evenk::jittered_backoff<evenk::cpu_cycle> jittered_cycle_backoff(40);
+
+// These take nanoseconds rather than iterations.
+evenk::linear_backoff<evenk::tsc_relax> linear_tsc_relax_backoff(2000, 50);
+evenk::exponential_backoff<evenk::tsc_relax> exponential_tsc_relax_backoff(2000);
+#if EVENK_HAVE_WAITPKG
+evenk::exponential_backoff<evenk::tsc_tpause> exponential_tsc_tpause_backoff(2000);
+#endif
+
+evenk::spin_estimate relax_estimate;
+evenk::adaptive_backoff<evenk::cpu_relax> adaptive_relax_backoff(relax_estimate);
 
 evenk::composite_backoff<evenk::linear_backoff<evenk::cpu_cycle>, evenk::yield_backoff>
 	cycle_yield_backoff(linear_cycle_backoff, yield_backoff);
 evenk::composite_backoff<evenk::linear_backoff<evenk::cpu_relax>, evenk::yield_backoff>
 	relax_yield_backoff(linear_relax_backoff, yield_backoff);
 
+struct lock_options : harness::options
+{
+	// Zero stands for 1, 2, 3, and so on up to the number of CPUs.
+	unsigned threads = 0;
+	// CPU cycles spent in and out of the critical section.
+	std::uint32_t work = 5000;
+	// The percentage of exclusive locks in the read/write benchmarks.
+	unsigned write_percent = 10;
+};
+
+struct bench_context
+{
+	const lock_options &options;
+	harness::reporter &report;
+	unsigned nthreads;
+};
+
+//
+// Every worker does its warm-up iterations and waits at the gate. When
+// all the workers are there the gate is opened and the measurement starts.
+// The lock acquisition latency is recorded from the lock call to its
+// return.
+//
+
+class worker
+{
+public:
+	worker(const bench_context &ctx, harness::gate &gate, unsigned cpu, std::size_t &count)
+		: ctx_(ctx), gate_(gate), cpu_{cpu}, count_(count)
+	{
+	}
+
+	// Tells if there is another iteration to do.
+	bool next(std::size_t i)
+	{
+		if (i == 0 && ctx_.options.pin)
+			harness::pin_this_thread(cpu_);
+		if (i == ctx_.options.warmup) {
+			gate_.ready();
+			measured_ = true;
+		}
+		return i < ctx_.options.warmup + ctx_.options.ops;
+	}
+
+	bool is_write(std::size_t i) const
+	{
+		return unsigned(i % 100) < ctx_.options.write_percent;
+	}
+
+	void acquired(std::chrono::steady_clock::time_point start, bool write = true)
+	{
+		if (measured_) {
+			auto &latency = write ? write_latency_ : read_latency_;
+			latency.record(harness::nanoseconds_since(start));
+		}
+	}
+
+	void work() const
+	{
+		evenk::cpu_cycle{}(ctx_.options.work);
+	}
+
+	// Update the shared counter under an exclusive lock.
+	std::size_t update()
+	{
+		writes_++;
+		return ++count_;
+	}
+
+	// Read the shared counter under a shared lock.
+	std::size_t load() const
+	{
+		return static_cast<volatile std::size_t &>(count_);
+	}
+
+	std::size_t writes() const
+	{
+		return writes_;
+	}
+
+	const harness::latency_histogram &write_latency() const
+	{
+		return write_latency_;
+	}
+
+	const harness::latency_histogram &read_latency() const
+	{
+		return read_latency_;
+	}
+
+private:
+	const bench_context &ctx_;
+	harness::gate &gate_;
+	const unsigned cpu_;
+	std::size_t &count_;
+	std::size_t writes_ = 0;
+	bool measured_ = false;
+	harness::latency_histogram write_latency_;
+	harness::latency_histogram read_latency_;
+};
+
 template <typename Lock, typename... Backoff>
 void
-spin(int &count, Lock &lock, Backoff... backoff)
+spin(worker &w, Lock &lock, Backoff... backoff)
 {
-	for (int i = 0; i < 100 * 1000; ++i) {
+	for (std::size_t i = 0; w.next(i); ++i) {
+		auto start = std::chrono::steady_clock::now();
 		lock.lock(backoff...);
-		evenk::cpu_cycle{}(5000);
-		++count;
+		w.acquired(start);
+		w.work();
+		w.update();
 		lock.unlock();
-		evenk::cpu_cycle{}(5000);
+		w.work();
+	}
+}
+
+template <typename Lock, typename... Backoff>
+void
+rw_spin(worker &w, Lock &lock, Backoff... backoff)
+{
+	for (std::size_t i = 0; w.next(i); ++i) {
+		auto start = std::chrono::steady_clock::now();
+		if (w.is_write(i)) {
+			lock.lock(backoff...);
+			w.acquired(start);
+			w.work();
+			w.update();
+			lock.unlock();
+		} else {
+			lock.lock_shared(backoff...);
+			w.acquired(start, false);
+			w.work();
+			w.load();
+			lock.unlock_shared();
+		}
+		w.work();
+	}
+}
+
+template <typename Lock, typename... Backoff>
+void
+seq_spin(worker &w, evenk::seqlock<snapshot, Lock> &lock, Backoff... backoff)
+{
+	for (std::size_t i = 0; w.next(i); ++i) {
+		auto start = std::chrono::steady_clock::now();
+		if (w.is_write(i)) {
+			lock.update(
+				[&](snapshot &s) {
+					w.acquired(start);
+					w.work();
+					s.first = s.second = w.update();
+				},
+				backoff...);
+		} else {
+			snapshot s = lock.load(backoff...);
+			w.acquired(start, false);
+			w.work();
+			if (s.first != s.second)
+				std::abort();
+		}
+		w.work();
+	}
+}
+
+// Queue locks with a node provided by the caller.
+template <typename Lock>
+class lock_node;
+
+template <>
+class lock_node<evenk::mcs_lock>
+{
+public:
+	evenk::mcs_lock::node &get()
+	{
+		return node_;
+	}
+
+private:
+	evenk::mcs_lock::node node_;
+};
+
+template <>
+class lock_node<evenk::clh_lock>
+{
+public:
+	~lock_node()
+	{
+		evenk::clh_lock::delete_node(node_);
+	}
+
+	evenk::clh_lock::node *&get()
+	{
+		return node_;
+	}
+
+private:
+	evenk::clh_lock::node *node_ = evenk::clh_lock::new_node();
+};
+
+template <typename Lock, typename... Backoff>
+void
+node_spin(worker &w, Lock &lock, Backoff... backoff)
+{
+	lock_node<Lock> node;
+	for (std::size_t i = 0; w.next(i); ++i) {
+		auto start = std::chrono::steady_clock::now();
+		lock.lock(node.get(), backoff...);
+		w.acquired(start);
+		w.work();
+		w.update();
+		lock.unlock(node.get());
+		w.work();
 	}
 }
 
 template <typename Lock, typename... Backoff>
 void
-bench(unsigned nthreads, std::string const &name, Lock &lock, Backoff... backoff)
+bench(const bench_context &ctx,
+      std::string const &name,
+      void (*fn)(worker &, Lock &, Backoff...),
+      Lock &lock,
+      Backoff... backoff)
 {
-	int count = 0;
+	if (!ctx.options.selected(name))
+		return;
+
+	const unsigned nthreads = ctx.nthreads;
+	std::size_t count = 0;
+	harness::gate gate(nthreads);
+
+	std::vector<worker> workers;
+	workers.reserve(nthreads);
+	for (unsigned i = 0; i < nthreads; ++i)
+		workers.emplace_back(ctx, gate, i, count);
 
 	std::vector<std::thread> v;
 	v.reserve(nthreads);
+	for (unsigned i = 0; i < nthreads; ++i)
+		v.emplace_back(fn, std::ref(workers[i]), std::ref(lock), backoff...);
 
+	gate.wait_ready();
 	auto start = std::chrono::steady_clock::now();
+	gate.open();
 
-	for (unsigned i = 0; i < nthreads; ++i)
-		v.emplace_back(
-			spin<Lock, Backoff...>, std::ref(count), std::ref(lock), backoff...);
 	for (auto &t : v)
 		t.join();
 
-	auto end = std::chrono::steady_clock::now();
-	std::chrono::duration<double> diff = end - start;
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+	harness::result writes, reads;
+	writes.name = reads.name = name;
+	writes.threads = reads.threads = nthreads;
+	writes.seconds = reads.seconds = diff.count();
+
+	std::size_t total = 0;
+	for (auto &w : workers) {
+		total += w.writes();
+		writes.latency.merge(w.write_latency());
+		reads.latency.merge(w.read_latency());
+	}
+	if (count != total)
+		ctx.report.error(name, "FAIL!!! count=" + std::to_string(count));
 
-	std::cout << name << ": count=" << count << ", duration=" << diff.count() << "\n";
+	if (reads.latency.count() == 0) {
+		writes.op = "lock";
+		ctx.report.add(writes);
+	} else {
+		writes.op = "write";
+		reads.op = "read";
+		ctx.report.add(writes);
+		ctx.report.add(reads);
+	}
+}
+
+template <typename Stats>
+std::string
+lock_stats(const Stats &stats)
+{
+	std::ostringstream out;
+	out << "  acquire=" << stats.get(evenk::stat_acquire)
+	    << ", contended=" << stats.get(evenk::stat_contended)
+	    << ", spin=" << stats.get(evenk::stat_spin) << ", park=" << stats.get(evenk::stat_park)
+	    << ", hold_time=" << stats.get(evenk::stat_hold_time);
+	return out.str();
+}
+
+template <typename Stats>
+std::string
+elision_stats(const Stats &stats)
+{
+	std::ostringstream out;
+	out << "  abort=" << stats.get(evenk::stat_abort)
+	    << ", conflict=" << stats.get(evenk::stat_abort_conflict)
+	    << ", capacity=" << stats.get(evenk::stat_abort_capacity)
+	    << ", busy=" << stats.get(evenk::stat_abort_busy)
+	    << ", fallback=" << stats.get(evenk::stat_fallback);
+	return out.str();
 }
 
 void
-bench(unsigned nthreads, unsigned hardware_nthreads)
+bench(const bench_context &ctx, unsigned hardware_nthreads)
 {
-	std::cout << "Threads: " << nthreads << "\n";
+	const unsigned nthreads = ctx.nthreads;
+	ctx.report.note("Threads: " + std::to_string(nthreads));
 
-#define BENCH1(lock) bench(nthreads, #lock, lock)
-#define BENCH2(lock, backoff) bench(nthreads, #lock " " #backoff, lock, backoff)
+	// The write percent is noted before the first of the read/write
+	// benchmarks that is selected.
+	bool write_noted = false;
+	auto note_write_percent = [&](const std::string &name) {
+		if (write_noted || !ctx.options.selected(name))
+			return;
+		ctx.report.note("Write percent: " + std::to_string(ctx.options.write_percent));
+		write_noted = true;
+	};
+
+#define BENCH1(lock) bench(ctx, #lock, spin, lock)
+#define BENCH2(lock, backoff) bench(ctx, #lock " " #backoff, spin, lock, backoff)
+#define NODE_BENCH2(lock, backoff) bench(ctx, #lock " node " #backoff, node_spin, lock, backoff)
+#define RW_BENCH1(lock) RW_BENCH(#lock " rw", rw_spin, lock)
+#define RW_BENCH2(lock, backoff) RW_BENCH(#lock " rw " #backoff, rw_spin, lock, backoff)
+#define SEQ_BENCH1(lock) RW_BENCH(#lock, seq_spin, lock)
+#define SEQ_BENCH2(lock, backoff) RW_BENCH(#lock " " #backoff, seq_spin, lock, backoff)
+#define RW_BENCH(name, ...) (note_write_percent(name), bench(ctx, name, __VA_ARGS__))
 
 	BENCH1(mutex);
 	BENCH1(posix_mutex);
@@ -88,6 +415,14 @@ bench(unsigned nthreads, unsigned hardware_nthreads)
 	BENCH2(futex_lock, exponential_cycle_backoff);
 	BENCH2(futex_lock, linear_relax_backoff);
 	BENCH2(futex_lock, exponential_relax_backoff);
+	BENCH2(futex_lock, adaptive_relax_backoff);
+	BENCH2(futex_lock, jittered_relax_backoff);
+	BENCH2(futex_lock, linear_tsc_relax_backoff);
+	BENCH2(futex_lock, exponential_tsc_relax_backoff);
+	futex_stats_lock.stats().reset();
+	BENCH2(futex_stats_lock, linear_relax_backoff);
+	if (ctx.options.selected("futex_stats_lock linear_relax_backoff"))
+		ctx.report.note(lock_stats(futex_stats_lock.stats()));
 #endif
 
 	BENCH2(spin_lock, no_backoff);
@@ -101,6 +436,13 @@ bench(unsigned nthreads, unsigned hardware_nthreads)
 	BENCH2(spin_lock, const_relax_x8_backoff);
 	BENCH2(spin_lock, linear_relax_backoff);
 	BENCH2(spin_lock, exponential_relax_backoff);
+	BENCH2(spin_lock, jittered_cycle_backoff);
+	BENCH2(spin_lock, jittered_relax_backoff);
+	BENCH2(spin_lock, linear_tsc_relax_backoff);
+	BENCH2(spin_lock, exponential_tsc_relax_backoff);
+#if EVENK_HAVE_WAITPKG
+	BENCH2(spin_lock, exponential_tsc_tpause_backoff);
+#endif
 	BENCH2(spin_lock, yield_backoff);
 	BENCH2(spin_lock, cycle_yield_backoff);
 	BENCH2(spin_lock, relax_yield_backoff);
@@ -116,10 +458,40 @@ bench(unsigned nthreads, unsigned hardware_nthreads)
 	BENCH2(tatas_lock, const_relax_x8_backoff);
 	BENCH2(tatas_lock, linear_relax_backoff);
 	BENCH2(tatas_lock, exponential_relax_backoff);
+	BENCH2(tatas_lock, jittered_cycle_backoff);
+	BENCH2(tatas_lock, jittered_relax_backoff);
+	BENCH2(tatas_lock, linear_tsc_relax_backoff);
+	BENCH2(tatas_lock, exponential_tsc_relax_backoff);
 	BENCH2(tatas_lock, yield_backoff);
 	BENCH2(tatas_lock, cycle_yield_backoff);
 	BENCH2(tatas_lock, relax_yield_backoff);
 
+	if (!evenk::elided_lock<evenk::tatas_lock>::supported() && ctx.options.selected("elided"))
+		ctx.report.note("No RTM, elided locks fall back at once");
+	BENCH2(elided_tatas_lock, no_backoff);
+	BENCH2(elided_tatas_lock, const_relax_backoff);
+	BENCH2(elided_tatas_lock, exponential_relax_backoff);
+#if __linux__
+	elided_futex_lock.stats().reset();
+	BENCH2(elided_futex_lock, linear_relax_backoff);
+	if (ctx.options.selected("elided_futex_lock linear_relax_backoff"))
+		ctx.report.note(elision_stats(elided_futex_lock.stats()));
+#endif
+
+	BENCH2(mcs_lock, no_backoff);
+	BENCH2(mcs_lock, const_relax_backoff);
+	BENCH2(mcs_lock, yield_backoff);
+	NODE_BENCH2(mcs_lock, no_backoff);
+	NODE_BENCH2(mcs_lock, const_relax_backoff);
+	NODE_BENCH2(mcs_lock, yield_backoff);
+
+	BENCH2(clh_lock, no_backoff);
+	BENCH2(clh_lock, const_relax_backoff);
+	BENCH2(clh_lock, yield_backoff);
+	NODE_BENCH2(clh_lock, no_backoff);
+	NODE_BENCH2(clh_lock, const_relax_backoff);
+	NODE_BENCH2(clh_lock, yield_backoff);
+
 	if (nthreads < hardware_nthreads || hardware_nthreads <= 8) {
 		BENCH2(ticket_lock, no_backoff);
 		BENCH2(ticket_lock, const_cycle_backoff);
@@ -143,14 +515,134 @@ bench(unsigned nthreads, unsigned hardware_nthreads)
 		BENCH2(ticket_lock, relax_yield_backoff);
 	}
 
-	std::cout << "\n";
+#if __linux__
+	if (nthreads < hardware_nthreads || hardware_nthreads <= 8) {
+		BENCH2(futex_ticket_lock, no_backoff);
+		BENCH2(futex_ticket_lock, proportional_relax_backoff);
+	}
+	BENCH2(futex_ticket_lock, yield_backoff);
+	BENCH2(futex_ticket_lock, relax_yield_backoff);
+#endif
+
+#if __cplusplus >= 201402L
+	RW_BENCH1(shared_timed_mutex);
+#endif
+#if __linux__
+	RW_BENCH2(shared_futex_lock, no_backoff);
+	RW_BENCH2(shared_futex_lock, linear_relax_backoff);
+	RW_BENCH2(shared_futex_lock, exponential_relax_backoff);
+	RW_BENCH2(shared_futex_lock, adaptive_relax_backoff);
+#endif
+	RW_BENCH2(rw_spin_lock, no_backoff);
+	RW_BENCH2(rw_spin_lock, const_relax_backoff);
+	RW_BENCH2(rw_spin_lock, exponential_relax_backoff);
+	RW_BENCH2(rw_spin_lock, yield_backoff);
+	RW_BENCH2(rw_spin_lock, relax_yield_backoff);
+	SEQ_BENCH1(tatas_seqlock);
+	SEQ_BENCH2(tatas_seqlock, const_relax_backoff);
+	SEQ_BENCH2(tatas_seqlock, yield_backoff);
+#if __linux__
+	SEQ_BENCH1(futex_seqlock);
+	SEQ_BENCH2(futex_seqlock, linear_relax_backoff);
+#endif
+
+	ctx.report.note("");
+}
+
+void
+usage(const char *program)
+{
+	std::cerr << "usage: " << program << " [options] [write-percent]\n"
+		  << "  -t, --threads N        worker threads (1, 2, 3, ... up to CPUs)\n"
+		  << "  -n, --ops N            measured iterations per thread (100000)\n"
+		  << "  -w, --warmup N         warm-up iterations per thread (1000)\n"
+		  << "      --work N           CPU cycles in and out of the lock (5000)\n"
+		  << "      --write-percent N  exclusive locks in read/write benchmarks (10)\n"
+		  << "      --pin              pin threads to CPUs\n"
+		  << "  -f, --format FORMAT    text, csv, or json (text)\n"
+		  << "      --filter TEXT      run benchmarks with TEXT in the name\n";
 }
 
 int
-main()
+main(int argc, char *argv[])
 {
+	enum { opt_work = 256, opt_write_percent, opt_pin, opt_filter };
+	static const struct option long_options[] = {
+		{"threads", required_argument, nullptr, 't'},
+		{"ops", required_argument, nullptr, 'n'},
+		{"warmup", required_argument, nullptr, 'w'},
+		{"work", required_argument, nullptr, opt_work},
+		{"write-percent", required_argument, nullptr, opt_write_percent},
+		{"pin", no_argument, nullptr, opt_pin},
+		{"format", required_argument, nullptr, 'f'},
+		{"filter", required_argument, nullptr, opt_filter},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	lock_options options;
+	options.ops = 100 * 1000;
+
+	const char *program = argv[0];
+	int opt;
+	while ((opt = getopt_long(argc, argv, "t:n:w:f:h", long_options, nullptr)) != -1) {
+		switch (opt) {
+		case 't':
+			options.threads = harness::parse_number(program, "threads", optarg);
+			break;
+		case 'n':
+			options.ops = harness::parse_number(program, "ops", optarg);
+			break;
+		case 'w':
+			options.warmup = harness::parse_number(program, "warmup", optarg);
+			break;
+		case opt_work:
+			options.work = harness::parse_number(program, "work", optarg);
+			break;
+		case opt_write_percent:
+			options.write_percent =
+				harness::parse_number(program, "write-percent", optarg);
+			break;
+		case opt_pin:
+			options.pin = true;
+			break;
+		case 'f':
+			options.format = harness::parse_format(program, optarg);
+			break;
+		case opt_filter:
+			options.filter = optarg;
+			break;
+		case 'h':
+			usage(program);
+			return 0;
+		default:
+			usage(program);
+			return 1;
+		}
+	}
+	// The write percent used to be the only argument.
+	if (optind < argc)
+		options.write_percent = harness::parse_number(program, "write-percent", argv[optind++]);
+	if (optind < argc || options.write_percent > 100) {
+		usage(program);
+		return 1;
+	}
+
+	evenk::tsc_clock::initialize();
+
 	unsigned n = std::thread::hardware_concurrency();
-	for (unsigned i = 1; i <= n; i += std::min(i, 8u))
-		bench(i, n);
+	std::vector<unsigned> thread_counts;
+	if (options.threads) {
+		thread_counts.push_back(options.threads);
+	} else {
+		for (unsigned i = 1; i <= n; i += std::min(i, 8u))
+			thread_counts.push_back(i);
+	}
+
+	harness::reporter report(options.format);
+	for (unsigned nthreads : thread_counts) {
+		bench_context ctx{options, report, nthreads};
+		bench(ctx, n);
+	}
 	return 0;
 }
@@ -1,190 +1,824 @@
+#include "bench.h"
+
 #include "evenk/bounded_queue.h"
+#include "evenk/broadcast_ring.h"
+#include "evenk/chunk_ring.h"
+#include "evenk/combining_queue.h"
+#include "evenk/priority_bounded_queue.h"
+#include "evenk/sharded_queue.h"
+#include "evenk/spsc_bounded_queue.h"
 #include "evenk/synch_queue.h"
+#include "evenk/unbounded_queue.h"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include <getopt.h>
+
 using namespace evenk;
 
+struct queue_options : harness::options
+{
+	unsigned producers = 1;
+	// Zero stands for 1, 2, 4, and so on up to the number of CPUs.
+	unsigned consumers = 0;
+	std::string payload = "string";
+	std::size_t payload_size = 21;
+	std::uint32_t capacity = 1024;
+};
+
+struct bench_context
+{
+	const queue_options &options;
+	harness::reporter &report;
+	unsigned producers;
+	unsigned consumers;
+};
+
+// A fixed size value that does not own any memory.
+template <std::size_t Size>
+struct blob
+{
+	char data[Size];
+};
+
+template <typename Value>
+struct bench_data
+{
+	static Value get(const queue_options &)
+	{
+		return Value(42);
+	}
+};
+
+template <>
+struct bench_data<std::string>
+{
+	static std::string get(const queue_options &options)
+	{
+		return std::string(options.payload_size, 'x');
+	}
+};
+
+template <std::size_t Size>
+struct bench_data<blob<Size>>
+{
+	static blob<Size> get(const queue_options &)
+	{
+		blob<Size> value;
+		std::memset(value.data, 42, Size);
+		return value;
+	}
+};
+
+// Spread the pushed values over all the lanes of a priority queue.
+template <typename Queue>
+class lane_spreader
+{
+public:
+	using value_type = typename Queue::value_type;
+
+	lane_spreader(Queue &queue) : queue_(queue)
+	{
+	}
+
+	void close()
+	{
+		queue_.close();
+	}
+
+	template <typename... Backoff>
+	void push(const value_type &value, Backoff... backoff)
+	{
+		std::size_t lane = next_.fetch_add(1, std::memory_order_relaxed);
+		queue_.push(lane % Queue::lanes(), value, backoff...);
+	}
+
+	template <typename... Backoff>
+	queue_op_status wait_pop(value_type &value, Backoff... backoff)
+	{
+		return queue_.wait_pop(value, backoff...);
+	}
+
+private:
+	Queue &queue_;
+	std::atomic<std::size_t> next_{0};
+};
+
+template <typename Stats>
+std::string
+queue_stats(const Stats &stats)
+{
+	std::ostringstream text;
+	text << "  push=" << stats.get(stat_push) << ", pop=" << stats.get(stat_pop)
+	     << ", push_wait=" << stats.get(stat_push_wait)
+	     << ", pop_wait=" << stats.get(stat_pop_wait)
+	     << ", close_wake=" << stats.get(stat_close_wake);
+	return text.str();
+}
+
+void
+report(const bench_context &ctx,
+       const std::string &name,
+       const char *op,
+       unsigned threads,
+       double seconds,
+       const std::vector<harness::latency_histogram> &latency)
+{
+	harness::result r;
+	r.name = name;
+	r.op = op;
+	r.threads = threads;
+	r.seconds = seconds;
+	for (auto &h : latency)
+		r.latency.merge(h);
+	ctx.report.add(r);
+}
+
+//
+// Every producer does its warm-up pushes and waits at the gate. When
+// the consumers have got all the warm-up values the gate is opened and
+// the measurement starts. Whether a pop is measured depends on how many
+// values were popped before it, not on when it started: a consumer may
+// block in a pop during the warm-up and get a measured value. The time
+// spent before the gate opened is not counted for such a pop.
+//
+
 template <typename Queue, typename... Backoff>
 void
-consume(Queue &queue, size_t &count, Backoff... backoff)
+produce(Queue &queue,
+	const bench_context &ctx,
+	harness::gate &gate,
+	unsigned cpu,
+	harness::latency_histogram &latency,
+	Backoff... backoff)
 {
-	std::string data;
-	while (queue.wait_pop(data, backoff...) == queue_op_status::success) {
-		++count;
+	if (ctx.options.pin)
+		harness::pin_this_thread(cpu);
+
+	typename Queue::value_type data = bench_data<typename Queue::value_type>::get(ctx.options);
+	for (std::size_t i = 0; i < ctx.options.warmup; i++)
+		queue.push(data, backoff...);
+	gate.ready();
+
+	for (std::size_t i = 0; i < ctx.options.ops; i++) {
+		auto start = std::chrono::steady_clock::now();
+		queue.push(data, backoff...);
+		latency.record(harness::nanoseconds_since(start));
 	}
 }
 
 template <typename Queue, typename... Backoff>
 void
-produce(Queue &queue, int count, Backoff... backoff)
+consume(Queue &queue,
+	const bench_context &ctx,
+	harness::gate &gate,
+	unsigned cpu,
+	std::atomic<std::size_t> &pop_count,
+	std::size_t &count,
+	harness::latency_histogram &latency,
+	Backoff... backoff)
 {
-	std::string data = "this is a test string";
-	for (int i = 0; i < count; i++) {
-		queue.push(data, backoff...);
+	if (ctx.options.pin)
+		harness::pin_this_thread(cpu);
+
+	const std::size_t warmup = ctx.producers * ctx.options.warmup;
+	typename Queue::value_type data;
+	for (;;) {
+		auto start = std::chrono::steady_clock::now();
+		if (queue.wait_pop(data, backoff...) != queue_op_status::success)
+			break;
+		if (pop_count.fetch_add(1, std::memory_order_relaxed) >= warmup)
+			latency.record(
+				harness::nanoseconds_since(std::max(start, gate.opened_at())));
+		++count;
 	}
 }
 
 template <typename Queue, typename... Backoff>
 void
-bench(unsigned nthreads, const std::string &name, Queue &queue, Backoff... backoff)
+bench(const bench_context &ctx, const std::string &name, Queue &queue, Backoff... backoff)
 {
-	std::vector<size_t> counts(nthreads);
-	std::vector<std::thread> threads(nthreads);
+	if (!ctx.options.selected(name))
+		return;
 
-	auto start = std::chrono::steady_clock::now();
+	const unsigned np = ctx.producers;
+	const unsigned nc = ctx.consumers;
 
-	for (size_t i = 0; i < threads.size(); i++)
-		threads[i] = std::thread(consume<Queue, Backoff...>,
-					 std::ref(queue),
-					 std::ref(counts[i]),
-					 backoff...);
+	harness::gate gate(np);
+	std::atomic<std::size_t> pop_count(0);
+	std::vector<std::size_t> counts(nc);
+	std::vector<harness::latency_histogram> push_latency(np);
+	std::vector<harness::latency_histogram> pop_latency(nc);
 
-#define TOTAL (250 * 1000)
+	std::vector<std::thread> threads;
+	threads.reserve(np + nc);
+	for (unsigned i = 0; i < nc; i++)
+		threads.emplace_back(consume<Queue, Backoff...>,
+				     std::ref(queue),
+				     std::cref(ctx),
+				     std::ref(gate),
+				     np + i,
+				     std::ref(pop_count),
+				     std::ref(counts[i]),
+				     std::ref(pop_latency[i]),
+				     backoff...);
+	for (unsigned i = 0; i < np; i++)
+		threads.emplace_back(produce<Queue, Backoff...>,
+				     std::ref(queue),
+				     std::cref(ctx),
+				     std::ref(gate),
+				     i,
+				     std::ref(push_latency[i]),
+				     backoff...);
 
-	produce(queue, TOTAL, backoff...);
-	queue.close();
+	gate.wait_ready();
+	while (pop_count.load(std::memory_order_relaxed) < np * ctx.options.warmup)
+		std::this_thread::yield();
+	auto start = std::chrono::steady_clock::now();
+	gate.open();
 
-	for (auto &t : threads)
-		t.join();
+	for (unsigned i = nc; i < nc + np; i++)
+		threads[i].join();
+	queue.close();
+	for (unsigned i = 0; i < nc; i++)
+		threads[i].join();
 
-	auto end = std::chrono::steady_clock::now();
-	std::chrono::duration<double> diff = end - start;
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-	size_t total = 0;
+	std::size_t total = 0;
 	for (auto &c : counts)
 		total += c;
+	if (total != np * (ctx.options.warmup + ctx.options.ops))
+		ctx.report.error(name, "FAIL!!! count=" + std::to_string(total));
 
-	std::cout << name << ": duration=" << diff.count() << ", count=" << total << "\n";
-	if (total != TOTAL)
-		std::cout << "FAIL!!!\n";
+	report(ctx, name, "push", np, diff.count(), push_latency);
+	report(ctx, name, "pop", nc, diff.count(), pop_latency);
+}
 
-	for (auto &c : counts)
-		std::cout << " " << c;
-	std::cout << '\n';
+template <typename Ring, typename... Backoff>
+void
+broadcast_consume(Ring &ring,
+		  const bench_context &ctx,
+		  harness::gate &gate,
+		  std::size_t reader,
+		  std::atomic<std::size_t> &warm_count,
+		  std::size_t &count,
+		  harness::latency_histogram &latency,
+		  Backoff... backoff)
+{
+	if (ctx.options.pin)
+		harness::pin_this_thread(reader + 1);
+
+	// Every reader gets all the values so it counts the warm-up ones
+	// on its own.
+	const typename Ring::value_type *data;
+	for (;;) {
+		auto start = std::chrono::steady_clock::now();
+		if (ring.wait_acquire(reader, data, backoff...) != queue_op_status::success)
+			break;
+		ring.release(reader);
+		if (count >= ctx.options.warmup)
+			latency.record(
+				harness::nanoseconds_since(std::max(start, gate.opened_at())));
+		else
+			warm_count.fetch_add(1, std::memory_order_relaxed);
+		++count;
+	}
 }
 
+// Every consumer reads every value.
+template <typename Ring, typename... Backoff>
 void
-bench(unsigned nthreads)
+broadcast_bench(const bench_context &ctx,
+		const std::string &name,
+		Ring &ring,
+		Backoff... backoff)
 {
-	std::cout << "Threads: " << nthreads << "\n";
+	if (!ctx.options.selected(name))
+		return;
+
+	const unsigned nc = ctx.consumers;
+
+	harness::gate gate(1);
+	std::atomic<std::size_t> warm_count(0);
+	std::vector<std::size_t> counts(nc);
+	std::vector<harness::latency_histogram> push_latency(1);
+	std::vector<harness::latency_histogram> pop_latency(nc);
+
+	std::vector<std::thread> threads;
+	threads.reserve(nc + 1);
+	for (unsigned i = 0; i < nc; i++)
+		threads.emplace_back(broadcast_consume<Ring, Backoff...>,
+				     std::ref(ring),
+				     std::cref(ctx),
+				     std::ref(gate),
+				     i,
+				     std::ref(warm_count),
+				     std::ref(counts[i]),
+				     std::ref(pop_latency[i]),
+				     backoff...);
+	threads.emplace_back(produce<Ring, Backoff...>,
+			     std::ref(ring),
+			     std::cref(ctx),
+			     std::ref(gate),
+			     0,
+			     std::ref(push_latency[0]),
+			     backoff...);
+
+	gate.wait_ready();
+	while (warm_count.load(std::memory_order_relaxed) < nc * ctx.options.warmup)
+		std::this_thread::yield();
+	auto start = std::chrono::steady_clock::now();
+	gate.open();
+
+	threads[nc].join();
+	ring.close();
+	for (unsigned i = 0; i < nc; i++)
+		threads[i].join();
+
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
 
-#define BENCH1(queue) bench(nthreads, #queue, queue)
-#define BENCH2(queue, backoff) bench(nthreads, #queue " " #backoff, queue, backoff)
+	for (auto &c : counts) {
+		if (c != ctx.options.warmup + ctx.options.ops)
+			ctx.report.error(name, "FAIL!!! count=" + std::to_string(c));
+	}
 
-	synch_queue<std::string, std_synch> std_queue;
-	synch_queue<std::string, posix_synch> posix_queue;
+	report(ctx, name, "push", 1, diff.count(), push_latency);
+	report(ctx, name, "acquire", nc, diff.count(), pop_latency);
+}
+
+template <typename Value>
+void
+bench_queues(const bench_context &ctx)
+{
+	const std::uint32_t capacity = ctx.options.capacity;
+
+#define BENCH1(queue) bench(ctx, #queue, queue)
+#define BENCH2(queue, backoff) bench(ctx, #queue " " #backoff, queue, backoff)
+
+	synch_queue<Value, std_synch> std_queue;
+	synch_queue<Value, posix_synch> posix_queue;
 
 	BENCH1(std_queue);
 	BENCH1(posix_queue);
 
 #if __linux__
 	{
-		synch_queue<std::string, futex_synch> futex_queue;
+		synch_queue<Value, futex_synch> futex_queue;
 		BENCH1(futex_queue);
 	}
 	{
-		synch_queue<std::string, futex_synch> futex_queue;
+		synch_queue<Value, futex_synch> futex_queue;
 		linear_backoff<cpu_cycle> linear_cycle_backoff(100000, 100);
 		BENCH2(futex_queue, linear_cycle_backoff);
 	}
 	{
-		synch_queue<std::string, futex_synch> futex_queue;
+		synch_queue<Value, futex_synch> futex_queue;
 		linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
 		BENCH2(futex_queue, linear_relax_backoff);
 	}
 	{
-		synch_queue<std::string, futex_synch> futex_queue;
+		synch_queue<Value, futex_synch> futex_queue;
 		yield_backoff yield_backoff;
 		BENCH2(futex_queue, yield_backoff);
 	}
 #endif
 
-	bounded_queue<std::string> a_bounded_queue(1024);
+	{
+		synch_queue<Value, std_synch, chunk_ring<Value>> std_chunk_queue;
+		BENCH1(std_chunk_queue);
+	}
+	{
+		synch_queue<Value, std_synch, chunk_ring<Value>> std_reserved_queue(
+			capacity);
+		BENCH1(std_reserved_queue);
+	}
+#if __linux__
+	{
+		synch_queue<Value, futex_synch, chunk_ring<Value>> futex_chunk_queue;
+		BENCH1(futex_chunk_queue);
+	}
+	{
+		synch_queue<Value, futex_synch, chunk_ring<Value>> futex_reserved_queue(
+			capacity);
+		BENCH1(futex_reserved_queue);
+	}
+#endif
+
+	{
+		combining_queue<Value, std_synch> combining_std_queue;
+		BENCH1(combining_std_queue);
+	}
+	{
+		combining_queue<Value, posix_synch> combining_posix_queue;
+		BENCH1(combining_posix_queue);
+	}
+#if __linux__
+	{
+		combining_queue<Value, futex_synch> combining_futex_queue;
+		BENCH1(combining_futex_queue);
+	}
+	{
+		combining_queue<Value, futex_synch> combining_futex_queue;
+		yield_backoff yield_backoff;
+		BENCH2(combining_futex_queue, yield_backoff);
+	}
+#endif
+
+	bounded_queue<Value> a_bounded_queue(capacity);
 	BENCH1(a_bounded_queue);
+	{
+		bounded_queue<Value> a_bounded_queue(capacity);
+		jittered_backoff<cpu_relax> jittered_relax_backoff(1000);
+		BENCH2(a_bounded_queue, jittered_relax_backoff);
+	}
 
-	bounded_queue<std::string, bq_synch_slot<std_synch>> bounded_std_synch_queue(1024);
+	bounded_queue<Value, bq_synch_slot<std_synch>> bounded_std_synch_queue(capacity);
 	BENCH1(bounded_std_synch_queue);
 
 	{
-		bounded_queue<std::string, bq_synch_slot<std_synch>> bounded_std_synch_queue(
-			1024);
+		bounded_queue<Value, bq_synch_slot<std_synch>> bounded_std_synch_queue(
+			capacity);
 		linear_backoff<cpu_cycle> linear_cycle_backoff(100000, 100);
 		BENCH2(bounded_std_synch_queue, linear_cycle_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_synch_slot<std_synch>> bounded_std_synch_queue(
-			1024);
+		bounded_queue<Value, bq_synch_slot<std_synch>> bounded_std_synch_queue(
+			capacity);
 		linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
 		BENCH2(bounded_std_synch_queue, linear_relax_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_synch_slot<std_synch>> bounded_std_synch_queue(
-			1024);
+		bounded_queue<Value, bq_synch_slot<std_synch>> bounded_std_synch_queue(
+			capacity);
 		yield_backoff yield_backoff;
 		BENCH2(bounded_std_synch_queue, yield_backoff);
 	}
 
 #if __linux__
 	{
-		bounded_queue<std::string, bq_synch_slot<futex_synch>>
-			bounded_futex_synch_queue(1024);
+		bounded_queue<Value, bq_synch_slot<futex_synch>>
+			bounded_futex_synch_queue(capacity);
 		BENCH1(bounded_futex_synch_queue);
 	}
 	{
-		bounded_queue<std::string, bq_synch_slot<futex_synch>>
-			bounded_futex_synch_queue(1024);
+		bounded_queue<Value, bq_synch_slot<futex_synch>>
+			bounded_futex_synch_queue(capacity);
 		linear_backoff<cpu_cycle> linear_cycle_backoff(100000, 100);
 		BENCH2(bounded_futex_synch_queue, linear_cycle_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_synch_slot<futex_synch>>
-			bounded_futex_synch_queue(1024);
+		bounded_queue<Value, bq_synch_slot<futex_synch>>
+			bounded_futex_synch_queue(capacity);
 		linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
 		BENCH2(bounded_futex_synch_queue, linear_relax_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_synch_slot<futex_synch>>
-			bounded_futex_synch_queue(1024);
+		bounded_queue<Value, bq_synch_slot<futex_synch>>
+			bounded_futex_synch_queue(capacity);
 		yield_backoff yield_backoff;
 		BENCH2(bounded_futex_synch_queue, yield_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_futex_slot> bounded_futex_queue(1024);
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
 		BENCH1(bounded_futex_queue);
 	}
 	{
-		bounded_queue<std::string, bq_futex_slot> bounded_futex_queue(1024);
+		// Type-erased access via virtual calls and via a function table.
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
+		queue_wrapper<decltype(bounded_futex_queue)> wrapper(bounded_futex_queue);
+		queue_base<Value> &bounded_futex_queue_base = wrapper;
+		BENCH1(bounded_futex_queue_base);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
+		queue_ref<Value> bounded_futex_queue_ref(bounded_futex_queue);
+		BENCH1(bounded_futex_queue_ref);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
 		linear_backoff<cpu_cycle> linear_cycle_backoff(100000, 100);
 		BENCH2(bounded_futex_queue, linear_cycle_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_futex_slot> bounded_futex_queue(1024);
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
 		linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
 		BENCH2(bounded_futex_queue, linear_relax_backoff);
 	}
 	{
-		bounded_queue<std::string, bq_futex_slot> bounded_futex_queue(1024);
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
 		yield_backoff yield_backoff;
 		BENCH2(bounded_futex_queue, yield_backoff);
 	}
+	{
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
+		spin_estimate estimate;
+		adaptive_backoff<cpu_relax> adaptive_relax_backoff(estimate);
+		BENCH2(bounded_futex_queue, adaptive_relax_backoff);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot> bounded_futex_queue(capacity);
+		jittered_backoff<cpu_relax> jittered_relax_backoff(1000);
+		BENCH2(bounded_futex_queue, jittered_relax_backoff);
+	}
+	{
+		bounded_queue<Value,
+			      bq_futex_slot,
+			      bq_padded_layout,
+			      heap_allocator,
+			      sharded_stats<>>
+			bounded_stats_queue(capacity);
+		BENCH1(bounded_stats_queue);
+		if (ctx.options.selected("bounded_stats_queue"))
+			ctx.report.note(queue_stats(bounded_stats_queue.stats()));
+	}
+	{
+		bounded_queue<Value, bq_event_slot> bounded_event_queue(capacity);
+		BENCH1(bounded_event_queue);
+	}
+	{
+		bounded_queue<Value, bq_event_slot> bounded_event_queue(capacity);
+		linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
+		BENCH2(bounded_event_queue, linear_relax_backoff);
+	}
 #endif
 
-	bounded_queue<std::string, bq_yield_slot> bounded_yield_queue(1024);
+	bounded_queue<Value, bq_yield_slot> bounded_yield_queue(capacity);
 	BENCH1(bounded_yield_queue);
 
-	std::cout << "\n";
+#if __linux__
+	{
+		priority_bounded_queue<Value, 4> priority_queue(capacity / 4);
+		lane_spreader<decltype(priority_queue)> priority_lanes(priority_queue);
+		BENCH1(priority_lanes);
+	}
+	{
+		priority_bounded_queue<Value, 4> priority_queue(capacity / 4);
+		lane_spreader<decltype(priority_queue)> priority_lanes(priority_queue);
+		yield_backoff yield_backoff;
+		BENCH2(priority_lanes, yield_backoff);
+	}
+	{
+		sharded_queue<Value> numa_sharded_queue(capacity / 4);
+		yield_backoff yield_backoff;
+		BENCH2(numa_sharded_queue, yield_backoff);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot, bq_padded_layout, numa_allocator>
+			bounded_interleaved_queue(capacity, numa_allocator::interleaved());
+		BENCH1(bounded_interleaved_queue);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot, bq_padded_layout, huge_page_allocator>
+			bounded_huge_page_queue(64 * capacity, huge_page_allocator(true));
+		BENCH1(bounded_huge_page_queue);
+	}
+#endif
+
+	{
+		unbounded_queue<Value> an_unbounded_queue;
+		BENCH1(an_unbounded_queue);
+	}
+#if __linux__
+	{
+		unbounded_queue<Value, bq_futex_slot> unbounded_futex_queue;
+		BENCH1(unbounded_futex_queue);
+	}
+	{
+		unbounded_queue<Value, bq_event_slot> unbounded_event_queue;
+		BENCH1(unbounded_event_queue);
+	}
+#endif
+	{
+		unbounded_queue<Value, bq_yield_slot> unbounded_yield_queue;
+		BENCH1(unbounded_yield_queue);
+	}
+
+	{
+		bounded_queue<Value, bq_yield_slot> padded_queue(capacity);
+		BENCH1(padded_queue);
+	}
+	{
+		bounded_queue<Value, bq_yield_slot, bq_compact_layout> compact_queue(
+			capacity);
+		BENCH1(compact_queue);
+	}
+	{
+		bounded_queue<Value, bq_yield_slot> large_padded_queue(64 * capacity);
+		BENCH1(large_padded_queue);
+	}
+	{
+		bounded_queue<Value, bq_yield_slot, bq_compact_layout> large_compact_queue(
+			64 * capacity);
+		BENCH1(large_compact_queue);
+	}
+#if __linux__
+	{
+		bounded_queue<Value, bq_futex_slot> padded_futex_queue(capacity);
+		BENCH1(padded_futex_queue);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot, bq_compact_layout>
+			compact_futex_queue(capacity);
+		BENCH1(compact_futex_queue);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot> large_padded_futex_queue(64 * capacity);
+		BENCH1(large_padded_futex_queue);
+	}
+	{
+		bounded_queue<Value, bq_futex_slot, bq_compact_layout>
+			large_compact_futex_queue(64 * capacity);
+		BENCH1(large_compact_futex_queue);
+	}
+#endif
+
+	// The broadcast ring has a single writer.
+	if (ctx.producers == 1) {
+		{
+			broadcast_ring<Value, bq_yield_slot> broadcast_yield_ring(capacity,
+										  ctx.consumers);
+			broadcast_bench(ctx, "broadcast_yield_ring", broadcast_yield_ring);
+		}
+#if __linux__
+		{
+			broadcast_ring<Value, bq_futex_slot> broadcast_futex_ring(capacity,
+										  ctx.consumers);
+			yield_backoff yield_backoff;
+			broadcast_bench(ctx,
+					"broadcast_futex_ring yield_backoff",
+					broadcast_futex_ring,
+					yield_backoff);
+		}
+#endif
+	}
+
+	if (ctx.producers == 1 && ctx.consumers == 1) {
+		{
+			spsc_bounded_queue<Value> spsc_queue(capacity);
+			BENCH1(spsc_queue);
+		}
+		{
+			spsc_bounded_queue<Value, bq_slot, cache_line_size> spsc_padded_queue(
+				capacity);
+			BENCH1(spsc_padded_queue);
+		}
+#if __linux__
+		{
+			spsc_bounded_queue<Value, bq_futex_slot> spsc_futex_queue(capacity);
+			BENCH1(spsc_futex_queue);
+		}
+		{
+			spsc_bounded_queue<Value, bq_futex_slot> spsc_futex_queue(capacity);
+			linear_backoff<cpu_relax> linear_relax_backoff(1000, 1);
+			BENCH2(spsc_futex_queue, linear_relax_backoff);
+		}
+#endif
+		{
+			spsc_bounded_queue<Value, bq_yield_slot> spsc_yield_queue(capacity);
+			BENCH1(spsc_yield_queue);
+		}
+	}
+
+}
+
+void
+usage(const char *program)
+{
+	std::cerr << "usage: " << program << " [options]\n"
+		  << "  -p, --producers N     producer threads (1)\n"
+		  << "  -c, --consumers N     consumer threads (1, 2, 4, ... up to CPUs)\n"
+		  << "      --payload TYPE    int, string, or blob (string)\n"
+		  << "      --payload-size N  string length, or blob size 16, 64, 256 (21)\n"
+		  << "  -q, --capacity N      queue capacity, a power of two (1024)\n"
+		  << "  -n, --ops N           measured pushes per producer (250000)\n"
+		  << "  -w, --warmup N        warm-up pushes per producer (1000)\n"
+		  << "      --pin             pin threads to CPUs\n"
+		  << "  -f, --format FORMAT   text, csv, or json (text)\n"
+		  << "      --filter TEXT     run benchmarks with TEXT in the name\n";
+}
+
+bool
+valid_payload(const queue_options &options)
+{
+	if (options.payload == "int" || options.payload == "string")
+		return true;
+	if (options.payload == "blob")
+		return options.payload_size == 16 || options.payload_size == 64
+		       || options.payload_size == 256;
+	return false;
+}
+
+void
+bench_payload(const bench_context &ctx)
+{
+	const std::string &payload = ctx.options.payload;
+	if (payload == "int") {
+		bench_queues<std::uint64_t>(ctx);
+	} else if (payload == "string") {
+		bench_queues<std::string>(ctx);
+	} else if (ctx.options.payload_size == 16) {
+		bench_queues<blob<16>>(ctx);
+	} else if (ctx.options.payload_size == 64) {
+		bench_queues<blob<64>>(ctx);
+	} else {
+		bench_queues<blob<256>>(ctx);
+	}
 }
 
 int
-main()
+main(int argc, char *argv[])
 {
-	unsigned n = std::thread::hardware_concurrency();
-	for (unsigned i = 1; i <= n; i += i)
-		bench(i);
+	enum { opt_payload = 256, opt_payload_size, opt_pin, opt_filter };
+	static const struct option long_options[] = {
+		{"producers", required_argument, nullptr, 'p'},
+		{"consumers", required_argument, nullptr, 'c'},
+		{"payload", required_argument, nullptr, opt_payload},
+		{"payload-size", required_argument, nullptr, opt_payload_size},
+		{"capacity", required_argument, nullptr, 'q'},
+		{"ops", required_argument, nullptr, 'n'},
+		{"warmup", required_argument, nullptr, 'w'},
+		{"pin", no_argument, nullptr, opt_pin},
+		{"format", required_argument, nullptr, 'f'},
+		{"filter", required_argument, nullptr, opt_filter},
+		{"help", no_argument, nullptr, 'h'},
+		{nullptr, 0, nullptr, 0},
+	};
+
+	queue_options options;
+	options.ops = 250 * 1000;
+
+	const char *program = argv[0];
+	int opt;
+	while ((opt = getopt_long(argc, argv, "p:c:q:n:w:f:h", long_options, nullptr)) != -1) {
+		switch (opt) {
+		case 'p':
+			options.producers = harness::parse_number(program, "producers", optarg);
+			break;
+		case 'c':
+			options.consumers = harness::parse_number(program, "consumers", optarg);
+			break;
+		case opt_payload:
+			options.payload = optarg;
+			break;
+		case opt_payload_size:
+			options.payload_size = harness::parse_number(program, "payload-size", optarg);
+			break;
+		case 'q':
+			options.capacity = harness::parse_number(program, "capacity", optarg);
+			break;
+		case 'n':
+			options.ops = harness::parse_number(program, "ops", optarg);
+			break;
+		case 'w':
+			options.warmup = harness::parse_number(program, "warmup", optarg);
+			break;
+		case opt_pin:
+			options.pin = true;
+			break;
+		case 'f':
+			options.format = harness::parse_format(program, optarg);
+			break;
+		case opt_filter:
+			options.filter = optarg;
+			break;
+		case 'h':
+			usage(program);
+			return 0;
+		default:
+			usage(program);
+			return 1;
+		}
+	}
+	if (optind < argc || options.producers == 0 || options.capacity < 4
+	    || (options.capacity & (options.capacity - 1)) != 0 || !valid_payload(options)) {
+		usage(program);
+		return 1;
+	}
+
+	std::vector<unsigned> consumer_counts;
+	if (options.consumers) {
+		consumer_counts.push_back(options.consumers);
+	} else {
+		unsigned n = std::thread::hardware_concurrency();
+		for (unsigned i = 1; i <= n; i += i)
+			consumer_counts.push_back(i);
+	}
+
+	harness::reporter report(options.format);
+	for (unsigned consumers : consumer_counts) {
+		report.note("Producers: " + std::to_string(options.producers)
+			    + ", consumers: " + std::to_string(consumers));
+		bench_context ctx{options, report, options.producers, consumers};
+		bench_payload(ctx);
+		report.note("");
+	}
 	return 0;
 }